@@ -0,0 +1,168 @@
+// stdlib
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+// C++
+#include <vector>
+// proj
+#include "slab.h"
+
+static const size_t k_classes[k_slab_num_classes] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+// objects moved between a thread cache and the global pool at once
+const size_t k_batch = 32;
+
+// a free object is a list node
+struct FreeObj {
+    FreeObj *next;
+};
+
+struct FreeList {
+    FreeObj *head = NULL;
+    size_t count = 0;
+};
+
+static void push(FreeList &list, void *ptr) {
+    FreeObj *obj = (FreeObj *)ptr;
+    obj->next = list.head;
+    list.head = obj;
+    list.count++;
+}
+
+static void *pop(FreeList &list) {
+    FreeObj *obj = list.head;
+    list.head = obj->next;
+    list.count--;
+    return obj;
+}
+
+// move up to 'n' objects
+static void move(FreeList &from, FreeList &to, size_t n) {
+    while (from.count > 0 && n-- > 0) { push(to, pop(from)); }
+}
+
+// the stats are only written by the owner thread, and read by any thread
+struct ThreadCache {
+    FreeList lists[k_slab_num_classes];
+    uint64_t allocs[k_slab_num_classes] = {};
+    uint64_t frees[k_slab_num_classes] = {};
+};
+
+// the global pool, protected by the mutex
+static struct {
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    FreeList lists[k_slab_num_classes];
+    size_t slabs[k_slab_num_classes] = {};
+    // the stats of all threads, including the exited ones
+    std::vector<ThreadCache *> caches;
+} g_pool;
+
+// the size class index for each multiple of 16 bytes
+struct ClassIndex {
+    uint8_t idx[k_slab_max_obj / 16 + 1];
+    ClassIndex() {
+        size_t c = 0;
+        for (size_t i = 0; i <= k_slab_max_obj / 16; ++i) {
+            while (k_classes[c] < i * 16) { c++; }
+            idx[i] = (uint8_t)c;
+        }
+    }
+};
+static const ClassIndex g_class_index;
+
+static size_t size_class(size_t size) {
+    return g_class_index.idx[(size + 15) / 16];
+}
+
+// give all cached objects back when the thread exits, the stats are kept
+struct CacheOwner {
+    ThreadCache *cache = NULL;
+    ~CacheOwner() {
+        if (!cache) { return; }
+        pthread_mutex_lock(&g_pool.mu);
+        for (size_t c = 0; c < k_slab_num_classes; ++c) {
+            move(cache->lists[c], g_pool.lists[c], (size_t)-1);
+        }
+        pthread_mutex_unlock(&g_pool.mu);
+    }
+};
+static thread_local CacheOwner t_owner;
+
+static ThreadCache *thread_cache() {
+    if (!t_owner.cache) {
+        t_owner.cache = new ThreadCache();
+        pthread_mutex_lock(&g_pool.mu);
+        g_pool.caches.push_back(t_owner.cache);
+        pthread_mutex_unlock(&g_pool.mu);
+    }
+    return t_owner.cache;
+}
+
+// a batch from the global pool, carve a new slab if it's empty
+static void refill(ThreadCache *tc, size_t c) {
+    pthread_mutex_lock(&g_pool.mu);
+    FreeList &global = g_pool.lists[c];
+    if (global.count == 0) {
+        char *slab = (char *)malloc(k_slab_size);
+        assert(slab);
+        for (size_t off = 0; off + k_classes[c] <= k_slab_size;
+             off += k_classes[c]) {
+            push(global, slab + off);
+        }
+        g_pool.slabs[c]++;
+    }
+    move(global, tc->lists[c], k_batch);
+    pthread_mutex_unlock(&g_pool.mu);
+}
+
+static void bump(uint64_t &counter) {
+    __atomic_store_n(&counter, counter + 1, __ATOMIC_RELAXED);
+}
+
+void *slab_alloc(size_t size) {
+    if (size > k_slab_max_obj) { return malloc(size); }
+    size_t c = size_class(size);
+    ThreadCache *tc = thread_cache();
+    if (tc->lists[c].count == 0) { refill(tc, c); }
+    bump(tc->allocs[c]);
+    return pop(tc->lists[c]);
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) { return; }
+    if (size > k_slab_max_obj) { return free(ptr); }
+    size_t c = size_class(size);
+    ThreadCache *tc = thread_cache();
+    push(tc->lists[c], ptr);
+    bump(tc->frees[c]);
+    if (tc->lists[c].count >= 2 * k_batch) {
+        // too many for this thread, keep 1 batch
+        pthread_mutex_lock(&g_pool.mu);
+        move(tc->lists[c], g_pool.lists[c], k_batch);
+        pthread_mutex_unlock(&g_pool.mu);
+    }
+}
+
+size_t slab_usable_size(size_t size) {
+    return size > k_slab_max_obj ? size : k_classes[size_class(size)];
+}
+
+void slab_stats(SlabStats (&out)[k_slab_num_classes]) {
+    pthread_mutex_lock(&g_pool.mu);
+    for (size_t c = 0; c < k_slab_num_classes; ++c) {
+        uint64_t allocs = 0, frees = 0;
+        for (ThreadCache *tc : g_pool.caches) {
+            allocs += __atomic_load_n(&tc->allocs[c], __ATOMIC_RELAXED);
+            frees += __atomic_load_n(&tc->frees[c], __ATOMIC_RELAXED);
+        }
+        size_t total = g_pool.slabs[c] * (k_slab_size / k_classes[c]);
+        out[c].obj_size = k_classes[c];
+        out[c].slabs = g_pool.slabs[c];
+        // the counters of other threads may be a bit behind
+        out[c].live = allocs > frees ? (size_t)(allocs - frees) : 0;
+        out[c].free = total > out[c].live ? total - out[c].live : 0;
+    }
+    pthread_mutex_unlock(&g_pool.mu);
+}
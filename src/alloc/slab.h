@@ -0,0 +1,36 @@
+#pragma once
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+
+// A size-class slab allocator for the small, fixed-size-after-creation nodes
+// (Entry, ZNode, ZSet). Objects of 1 size class are carved from 64KiB slabs.
+//
+// Each thread keeps its own free list per size class, so an allocation or a
+// free is a few instructions without locks. Objects move between the thread
+// caches and a global pool in batches: a thread that frees a lot (e.g. a
+// worker destroying a large zset) hands them back, a thread that runs out
+// takes a batch. The slabs are never returned to the OS.
+//
+// The caller passes the size to slab_free(), there's no per-object header.
+// Sizes over the largest class go to malloc().
+
+const size_t k_slab_size = 64 << 10;
+const size_t k_slab_num_classes = 16;
+const size_t k_slab_max_obj = 512;  // the largest size class
+
+void *slab_alloc(size_t size);
+// 'size' is the same as in slab_alloc()
+void slab_free(void *ptr, size_t size);
+// the bytes actually used by an allocation of 'size'
+size_t slab_usable_size(size_t size);
+
+// for fragmentation tracking, of all threads
+struct SlabStats {
+    size_t obj_size = 0;  // the size class
+    size_t slabs = 0;     // number of slabs
+    size_t live = 0;      // objects in use
+    size_t free = 0;      // objects in the free lists
+};
+
+void slab_stats(SlabStats (&out)[k_slab_num_classes]);
@@ -0,0 +1,73 @@
+// stdlib
+#include <assert.h>
+#include <string.h>
+// C++
+#include <utility>
+// proj
+#include "../common/messages.h"
+#include "buffer.h"
+
+const size_t k_min_capacity = 1024;
+
+// make room for n more bytes at the back
+static void buf_make_room(Buffer &buf, size_t n) {
+    size_t size = buf_size(buf);
+    size_t front = buf.data_begin - buf.buffer_begin;
+    size_t capacity = buf.buffer_end - buf.buffer_begin;
+
+    // move the data to the front if it fits, and if the move is paid for by
+    // the consumed bytes, so the copy is amortized O(1) per byte
+    if (size + n <= capacity && front >= size) {
+        memmove(buf.buffer_begin, buf.data_begin, size);
+        buf.data_begin = buf.buffer_begin;
+        buf.data_end = buf.buffer_begin + size;
+        return;
+    }
+
+    // grow geometrically
+    size_t new_cap = capacity < k_min_capacity ? k_min_capacity : capacity;
+    while (new_cap < size + n) { new_cap *= 2; }
+    uint8_t *mem = (uint8_t *)malloc(new_cap);
+    if (!mem) { die("out of memory"); }
+    if (size) { memcpy(mem, buf.data_begin, size); }
+    free(buf.buffer_begin);
+    buf.buffer_begin = mem;
+    buf.buffer_end = mem + new_cap;
+    buf.data_begin = mem;
+    buf.data_end = mem + size;
+}
+
+uint8_t *buf_reserve(Buffer &buf, size_t n) {
+    if (buf_space(buf) < n) { buf_make_room(buf, n); }
+    return buf.data_end;
+}
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
+    memcpy(buf_reserve(buf, len), data, len);
+    buf.data_end += len;
+}
+
+void buf_consume(Buffer &buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf.data_begin += n;
+    if (buf.data_begin == buf.data_end) {
+        // empty, start over from the front for free
+        buf.data_begin = buf.data_end = buf.buffer_begin;
+    }
+}
+
+void buf_truncate(Buffer &buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf.data_end = buf.data_begin + n;
+}
+
+void buf_clear(Buffer &buf) {
+    buf.data_begin = buf.data_end = buf.buffer_begin;
+}
+
+void swap(Buffer &lhs, Buffer &rhs) {
+    std::swap(lhs.buffer_begin, rhs.buffer_begin);
+    std::swap(lhs.buffer_end, rhs.buffer_end);
+    std::swap(lhs.data_begin, rhs.data_begin);
+    std::swap(lhs.data_end, rhs.data_end);
+}
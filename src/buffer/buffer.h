@@ -0,0 +1,54 @@
+#pragma once
+
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A FIFO byte buffer for the connection I/O.
+// Removing from the front of a std::vector moves the rest of the data, so
+// consuming pipelined requests one by one is O(n^2). Instead, the data is a
+// window [data_begin, data_end) inside the allocation [buffer_begin,
+// buffer_end). Consuming just moves 'data_begin', and the data is moved back to
+// the front only when the free space at the back runs out.
+//
+// +--------------+-----------------+---------------+
+// | consumed     | data            | free space    |
+// +--------------+-----------------+---------------+
+// ^buffer_begin  ^data_begin       ^data_end       ^buffer_end
+struct Buffer {
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { free(buffer_begin); }
+};
+
+inline size_t buf_size(const Buffer &buf) {
+    return buf.data_end - buf.data_begin;
+}
+inline bool buf_empty(const Buffer &buf) {
+    return buf.data_end == buf.data_begin;
+}
+inline uint8_t *buf_data(Buffer &buf) { return buf.data_begin; }
+inline const uint8_t *buf_data(const Buffer &buf) { return buf.data_begin; }
+
+// append to the back
+void buf_append(Buffer &buf, const uint8_t *data, size_t len);
+// remove from the front, O(1)
+void buf_consume(Buffer &buf, size_t n);
+// remove from the back, keeping the first n bytes
+void buf_truncate(Buffer &buf, size_t n);
+void buf_clear(Buffer &buf);
+// get at least n bytes of free space at the back, so the caller can write
+// into it directly (e.g. read() from a socket), then commit what was written
+uint8_t *buf_reserve(Buffer &buf, size_t n);
+inline size_t buf_space(const Buffer &buf) {
+    return buf.buffer_end - buf.data_end;
+}
+inline void buf_commit(Buffer &buf, size_t n) { buf.data_end += n; }
+void swap(Buffer &lhs, Buffer &rhs);
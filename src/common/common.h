@@ -1,7 +1,13 @@
 #pragma once
 
+// stdlib
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+// system
+#include <sys/random.h>
+#include <unistd.h>
 
 // intrusive data structure
 #define container_of(ptr, type, member)                    \
@@ -10,9 +16,85 @@
         (type *)((char *)__mptr - offsetof(type, member)); \
     })
 
-// FNV hash
+/*
+ * A wyhash style 64-bit hash. The input is read 8 or 16 bytes at a time, each
+ * chunk is mixed by a 64x64 -> 128-bit multiply folded back to 64 bits.
+ * Seeded per process so the slots of a key can't be predicted by clients.
+ */
+inline uint64_t g_hash_seed = 0;
+
+// call once at startup, before anything is hashed
+inline void hash_seed_init() {
+    if (getrandom(&g_hash_seed, sizeof(g_hash_seed), 0) < 0) {
+        g_hash_seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+}
+
+const uint64_t k_hash_s0 = 0xa0761d6478bd642full;
+const uint64_t k_hash_s1 = 0xe7037ed1a0b428dbull;
+const uint64_t k_hash_s2 = 0x8ebc6af09c88c6e3ull;
+const uint64_t k_hash_s3 = 0x589965cc75374cc3ull;
+
+// multiply and fold the 128-bit product
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// unaligned loads
+inline uint64_t hash_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
 inline uint64_t hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) { h = (h + data[i]) * 0x01000193; }
-    return h;
-}
\ No newline at end of file
+    uint64_t seed = g_hash_seed ^ hash_mix(g_hash_seed ^ k_hash_s0, k_hash_s1);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // 2 overlapping 4-byte reads from each end
+            size_t mid = (len >> 3) << 2;
+            a = (hash_r4(data) << 32) | hash_r4(data + mid);
+            b = (hash_r4(data + len - 4) << 32) | hash_r4(data + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)data[0] << 16) | ((uint64_t)data[len >> 1] << 8) |
+                data[len - 1];
+        }
+    } else {
+        size_t i = len;
+        const uint8_t *p = data;
+        if (i > 48) {
+            // 3 independent lanes keep the multipliers busy
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(hash_r8(p) ^ k_hash_s1, hash_r8(p + 8) ^ seed);
+                see1 = hash_mix(hash_r8(p + 16) ^ k_hash_s2,
+                                hash_r8(p + 24) ^ see1);
+                see2 = hash_mix(hash_r8(p + 32) ^ k_hash_s3,
+                                hash_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_r8(p) ^ k_hash_s1, hash_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        // the last 16 bytes, may overlap with the previous ones
+        a = hash_r8(p + i - 16);
+        b = hash_r8(p + i - 8);
+    }
+    __uint128_t r = (__uint128_t)(a ^ k_hash_s1) * (b ^ seed);
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mix(a ^ k_hash_s0 ^ len, b ^ k_hash_s1);
+}
@@ -5,22 +5,45 @@
 // C++
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
+#include "../buffer/buffer.h"
+#include "../event/event_loop.h"
 #include "../hashtable/hashtable.h"
 #include "../list/dl_list.h"
 #include "../sorted_set/zset.h"
+#include "../thread/mailbox.h"
 #include "../thread/thread_pool.h"
+#include "../timer/wheel.h"
 #include "../tree/heap.h"
 
 const size_t k_max_msg = 32 << 20;
 const size_t k_max_args = 200 * 1000;
-const size_t k_max_works = 2000;
 const size_t k_large_container_size = 1000;
+const size_t k_read_size = 64 * 1024;  // min free space for a read()
+const size_t k_max_kept_args = 1024;   // Conn::args capacity kept for reuse
+const size_t k_max_num_len = 64;       // for parsing numbers
+const uint32_t k_max_shards = 256;
+const uint32_t k_max_io_threads = 128;
+const size_t k_mem_samples = 5;  // MEMORY USAGE samples of a zset
+// ZUNIONSTORE/ZINTERSTORE with more source members run in the thread pool
+const size_t k_zstore_async = 10 * 1000;
+// replies serialized in the thread pool: more array elements or a longer string
+const size_t k_async_reply_elems = 10 * 1000;
+const size_t k_async_reply_bytes = 1 << 20;
+// background rehashing of the keyspace, per event loop iteration
+const uint64_t k_rehash_idle_us = 1000;  // nothing else to do
+const uint64_t k_rehash_busy_us = 100;   // some events were handled
+const size_t k_rehash_step_work = 1024;  // between clock checks
+// active expiry: the time of a cycle doubles while expired keys are left over,
+// but it's at most 25% of the time when clients are being served
+const uint64_t k_expire_min_us = 250;
+const uint64_t k_expire_max_us = 10000;
+const uint64_t k_expire_cpu_pct = 25;
+const size_t k_expire_step_work = 64;  // keys between clock checks
 static const ZSet k_empty_zset;
 
-typedef std::vector<uint8_t> Buffer;
-
 // Response::status
 enum {
     RES_OK = 0,
@@ -34,6 +57,12 @@ struct Response {
     std::vector<uint8_t> data;
 };
 
+// threaded I/O: a request parsed by an I/O thread
+struct ParsedReq {
+    uint32_t len = 0;    // the message body size in 'Conn::incoming'
+    uint32_t nargs = 0;  // the number of its args in 'Conn::args'
+};
+
 // Per-connection state
 struct Conn {
     int fd = -1;
@@ -42,43 +71,173 @@ struct Conn {
     bool want_write = false;
     bool want_close = false;
     // Buffered input and output
-    std::vector<uint8_t> incoming;  // data to be parsed by the application
-    std::vector<uint8_t> outgoing;  // responses generated by the application
+    Buffer incoming;  // data to be parsed by the application
+    Buffer outgoing;  // responses generated by the application
+    // the parsed request, views into 'incoming'. Reused across requests
+    std::vector<std::string_view> args;
+    // threaded I/O: all parsed requests, their args are in 'args'
+    std::vector<ParsedReq> parsed;
+    // io_uring backend: the Conn is freed only after all operations are done
+    uint32_t uring_ops = 0;
+    Buffer sending;  // the in-flight send, swapped with outgoing
+    // waiting for the response from another shard, or the thread pool
+    bool blocked = false;
     // timer
     uint64_t last_active_ms = 0;
     DL_List idle_node;
 };
 
 // Step 1 Define data types
-static struct {
+// per event loop thread, each thread owns a shard of the keyspace
+struct ExpireStats {
+    uint64_t budget_us = k_expire_min_us;  // of the next active cycle
+    uint64_t cycle_end_us = 0;
+    uint64_t expired = 0;     // keys, lazily or actively
+    uint64_t max_lag_ms = 0;  // of the oldest expired key at a cycle start
+    uint64_t per_sec = 0;     // expired keys in the last second
+    uint64_t rate_start_us = 0;
+    uint64_t rate_start_keys = 0;
+};
+
+struct ShardMsg;
+
+// memory that an async reader may still see, freed by 'f' after the readers
+// that started before it was retired
+struct Retired {
+    uint64_t seq = 0;  // the newest reader then
+    void (*f)(void *) = NULL;
+    void *arg = NULL;
+};
+
+static thread_local struct {
+    uint32_t shard_id = 0;
     HashMap db;  // top-level hashtable
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     // timers for idle connections
     DL_List idle_list;  // list head
     // timer for TTLs
-    std::vector<HeapItem> heap;
+    HeapVector heap;
+    TimerWheel wheel;  // or a timing wheel, --ttl-wheel
+    ExpireStats expire;
     // the thread pool
     ThreadPool thread_pool;
+    // the executing request, if it can be suspended for the thread pool. From
+    // a connection, or from another shard
+    Conn *cur_conn = NULL;
+    ShardMsg *cur_msg = NULL;
+    // the async jobs reading the keyspace, oldest first
+    DL_List readers;
+    uint64_t read_seq = 0;         // of the newest reader
+    std::vector<Retired> retired;  // oldest first
+    // threaded I/O: read() + parse, and write(), outside of the main thread
+    ThreadPool io_pool;
+    std::vector<std::string_view> io_cmd;  // the request being executed
+    // readiness notifications
+    EventLoop loop;
 } g_data;
 
+// TTL engines
+enum {
+    TTL_HEAP = 0,   // binary heap, ordered
+    TTL_WHEEL = 1,  // hierarchical timing wheel, O(1)
+};
+
+// shared by all shards, read-only after startup
+static struct {
+    uint32_t nshards = 1;
+    int backend = 0;
+    uint32_t io_threads = 1;  // including the main thread
+    int ttl = 0;              // TTL_HEAP or TTL_WHEEL
+    std::vector<Mailbox> mailboxes;  // indexed by shard id
+} g_server;
+
+// ShardMsg::type
+enum {
+    MSG_REQ = 1,     // a single-key request for the owner shard
+    MSG_RES = 2,     // the response, back to the connection's shard
+    MSG_KEYS = 3,    // KEYS, collects the keys from every shard in turn
+    MSG_DONE = 4,    // an AsyncJob is done by the thread pool
+};
+
+// a message between shards
+struct ShardMsg {
+    MailboxNode node;  // intrusive mailbox link
+    uint32_t type = 0;
+    uint32_t src = 0;      // the shard that owns 'conn'
+    Conn *conn = NULL;     // only touched by the 'src' shard
+    std::string req;       // the serialized request
+    Buffer out;            // the serialized response
+    uint32_t count = 0;    // MSG_KEYS: number of array elements in 'out'
+    bool blocked = false;  // MSG_REQ: waiting for the thread pool
+};
+
+// work offloaded to the thread pool by a request, which is suspended until
+// the event loop gets the job back
+struct AsyncJob {
+    ShardMsg msg;          // MSG_DONE, the suspended connection is 'msg.conn'
+    ShardMsg *req = NULL;  // or the suspended request from another shard
+    Future fut;            // of the tasks, then 'msg' to the mailbox
+    // on the event loop: write the response and free the job
+    void (*done)(AsyncJob *job, Buffer &out) = NULL;
+    // the tasks read the keyspace, see async_read()
+    DL_List reader;
+    uint64_t read_seq = 0;
+};
+
 enum {
     T_INIT = 0,
     T_STR = 1,   // string
     T_ZSET = 2,  // sorted set
 };
 
-// KV pair for the top-level hashtable
+// KV pair for the top-level hashtable. 1 allocation holds the key, and the
+// value too if it's a small string
 struct Entry {
     struct HashNode node;  // hashtable node
-    std::string key;
-    // for TTL
-    size_t heap_idx = -1;  // array index to the heap item
-    // value
-    uint32_t type = 0;
-    // one of the following
-    std::string str;
-    ZSet zset;
+    // for TTL, by g_server.ttl
+    union {
+        size_t heap_idx = -1;  // array index to the heap item
+        TimerNode timer;       // in the timing wheel
+    };
+    uint16_t type = 0;
+    uint16_t inline_cap = 0;  // room for a string value after the key
+    uint32_t klen = 0;        // the key is at the start of 'data'
+    // value, by 'type'
+    union {
+        // T_STR: after the key in 'data' if it fits, or malloc'ed
+        struct {
+            char *ptr;
+            uint32_t len;
+            uint32_t cap;
+        } str;
+        // T_ZSET
+        struct {
+            ZSet *zset;
+            uint64_t zset_read_seq;  // the last async reader of it
+        };
+    };
+    char data[0];  // flexible array
+};
+const size_t k_max_inline_str = 64;  // larger values are not inline
+
+// Command::flags
+enum {
+    CMD_READONLY = 1,    // never modifies the keyspace
+    CMD_WRITE = 2,       // may modify the keyspace
+    CMD_KEYS = 4,        // the 2nd argument is a key
+    CMD_ALL_SHARDS = 8,  // reads the whole keyspace
+    CMD_CURSOR = 16,     // the 2nd argument is a cursor, it names the shard
+};
+
+// an entry of the command table
+struct Command {
+    const char *name = NULL;  // lowercase, matched case-insensitively
+    void (*f)(std::vector<std::string_view> &cmd, Buffer &out) = NULL;
+    int32_t arity = 0;  // number of args including the name, -N means >= N
+    uint32_t flags = 0;
+    uint32_t key_pos = 1;  // the key argument, for CMD_KEYS
+    uint64_t calls = 0;    // stats
 };
 
 // error code for TAG_ERR
@@ -101,5 +260,5 @@ enum {
 
 struct LookupKey {
     struct HashNode node;  // hashtable node
-    std::string key;
+    std::string_view key;  // points to the request, not copied
 };
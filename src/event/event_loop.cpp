@@ -0,0 +1,144 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+// system
+#include <sys/epoll.h>
+#include <unistd.h>
+// proj
+#include "../common/messages.h"
+#include "event_loop.h"
+
+const size_t k_max_events = 1024;  // max ready fds per epoll_wait()
+// io_uring backend
+const uint32_t k_uring_entries = 1024;
+const uint32_t k_uring_buf_count = 1024;  // provided buffers for recv
+const uint32_t k_uring_buf_size = 16 * 1024;
+
+static uint32_t to_epoll(uint32_t flags) {
+    uint32_t events = 0;
+    if (flags & EV_READ) { events |= EPOLLIN; }
+    if (flags & EV_WRITE) { events |= EPOLLOUT; }
+    return events;
+}
+
+static uint32_t from_epoll(uint32_t events) {
+    uint32_t flags = 0;
+    if (events & EPOLLIN) { flags |= EV_READ; }
+    if (events & EPOLLOUT) { flags |= EV_WRITE; }
+    if (events & (EPOLLERR | EPOLLHUP)) { flags |= EV_ERR; }
+    return flags;
+}
+
+static short to_poll(uint32_t flags) {
+    // always poll() for error
+    short events = POLLERR;
+    if (flags & EV_READ) { events |= POLLIN; }
+    if (flags & EV_WRITE) { events |= POLLOUT; }
+    return events;
+}
+
+static uint32_t from_poll(short revents) {
+    uint32_t flags = 0;
+    if (revents & POLLIN) { flags |= EV_READ; }
+    if (revents & POLLOUT) { flags |= EV_WRITE; }
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) { flags |= EV_ERR; }
+    return flags;
+}
+
+bool init(EventLoop *loop, int backend) {
+    loop->backend = backend;
+    if (backend == EV_BACKEND_URING) {
+        return init(&loop->ring, k_uring_entries, k_uring_buf_count,
+                    k_uring_buf_size);
+    }
+    if (backend == EV_BACKEND_EPOLL) {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            msg_errno("epoll_create1() error");
+            return false;
+        }
+    }
+    return true;
+}
+
+void watch(EventLoop *loop, int fd, uint32_t flags) {
+    assert(fd >= 0 && flags != 0);
+    if (loop->interest.size() <= (size_t)fd) {
+        loop->interest.resize(fd + 1, 0);
+        loop->poll_idx.resize(fd + 1, (size_t)-1);
+    }
+    uint32_t old = loop->interest[fd];
+    if (old == flags) {
+        return;  // nothing changed, no syscall
+    }
+    loop->interest[fd] = flags;
+
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        struct epoll_event ev = {};
+        ev.events = to_epoll(flags);
+        ev.data.fd = fd;
+        int op = old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(loop->epfd, op, fd, &ev) < 0) {
+            msg_errno("epoll_ctl() error");
+        }
+    } else if (old) {
+        loop->poll_args[loop->poll_idx[fd]].events = to_poll(flags);
+    } else {
+        loop->poll_idx[fd] = loop->poll_args.size();
+        struct pollfd pfd = {fd, to_poll(flags), 0};
+        loop->poll_args.push_back(pfd);
+    }
+}
+
+void unwatch(EventLoop *loop, int fd) {
+    if ((size_t)fd >= loop->interest.size() || !loop->interest[fd]) {
+        return;
+    }
+    loop->interest[fd] = 0;
+
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        // a closed fd is removed from the epoll set automatically, but the
+        // fd may be shared, so be explicit
+        (void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    // swap with the last item, O(1)
+    size_t pos = loop->poll_idx[fd];
+    loop->poll_args[pos] = loop->poll_args.back();
+    loop->poll_idx[loop->poll_args[pos].fd] = pos;
+    loop->poll_args.pop_back();
+    loop->poll_idx[fd] = (size_t)-1;
+}
+
+static int wait_epoll(EventLoop *loop, int32_t timeout_ms) {
+    struct epoll_event events[k_max_events];
+    int rv = epoll_wait(loop->epfd, events, k_max_events, timeout_ms);
+    for (int i = 0; i < rv; ++i) {
+        Event ev;
+        ev.fd = events[i].data.fd;
+        ev.flags = from_epoll(events[i].events);
+        loop->ready.push_back(ev);
+    }
+    return rv;
+}
+
+static int wait_poll(EventLoop *loop, int32_t timeout_ms) {
+    std::vector<struct pollfd> &args = loop->poll_args;
+    int rv = poll(args.data(), (nfds_t)args.size(), timeout_ms);
+    for (size_t i = 0; rv > 0 && i < args.size(); ++i) {
+        if (args[i].revents == 0) { continue; }
+        Event ev;
+        ev.fd = args[i].fd;
+        ev.flags = from_poll(args[i].revents);
+        loop->ready.push_back(ev);
+    }
+    return rv;
+}
+
+int wait(EventLoop *loop, int32_t timeout_ms) {
+    loop->ready.clear();
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        return wait_epoll(loop, timeout_ms);
+    }
+    return wait_poll(loop, timeout_ms);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+// system
+#include <poll.h>
+// C++
+#include <vector>
+// proj
+#include "uring.h"
+
+// The event loop only tells the application which fds are ready. Two backends
+// are available:
+// - poll(): the whole interest list is passed to the kernel on every call, so
+//   each wakeup costs O(total connections).
+// - epoll: the interest list lives in the kernel. It is registered once with
+//   epoll_ctl() and only changed when the application's intent changes, so
+//   each wakeup costs O(ready connections).
+// Both are level-triggered, a ready fd is reported again until it is drained.
+//
+// The io_uring backend is completion-based rather than readiness-based, so
+// watch()/wait() don't apply. The application drives 'EventLoop::ring'
+// directly, see uring.h.
+
+enum {
+    EV_BACKEND_POLL = 0,
+    EV_BACKEND_EPOLL = 1,
+    EV_BACKEND_URING = 2,
+};
+
+// readiness flags, independent of the backend
+enum {
+    EV_READ = 1,
+    EV_WRITE = 2,
+    EV_ERR = 4,  // always reported, no need to ask for it
+};
+
+struct Event {
+    int fd = -1;
+    uint32_t flags = 0;
+};
+
+struct EventLoop {
+    int backend = EV_BACKEND_POLL;
+    // interest list, keyed by fd. 0 means not watched
+    std::vector<uint32_t> interest;
+    // epoll backend
+    int epfd = -1;
+    // poll backend: a compact array plus the fd -> index map, so watch() and
+    // unwatch() don't need to rebuild it
+    std::vector<struct pollfd> poll_args;
+    std::vector<size_t> poll_idx;
+    // ready fds returned by the last wait()
+    std::vector<Event> ready;
+    // io_uring backend
+    Uring ring;
+};
+
+// returns false if the backend is not supported
+bool init(EventLoop *loop, int backend);
+// register or update the interest of a fd, a no-op if nothing changed
+void watch(EventLoop *loop, int fd, uint32_t flags);
+void unwatch(EventLoop *loop, int fd);
+// wait for readiness, results are in 'EventLoop::ready'
+int wait(EventLoop *loop, int32_t timeout_ms);
@@ -0,0 +1,280 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+// system
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+// proj
+#include "../common/messages.h"
+#include "uring.h"
+
+// the rings are shared with the kernel, so the head/tail need atomics
+static uint32_t load_acquire(uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int uring_setup(uint32_t entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                       uint32_t flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int uring_register(int fd, uint32_t op, void *arg, uint32_t nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+// all the opcodes we use must be supported
+static bool probe(Uring *ring) {
+    const uint8_t ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND};
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = (struct io_uring_probe *)calloc(1, len);
+    bool ok = uring_register(ring->ring_fd, IORING_REGISTER_PROBE, p, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops); ++i) {
+        ok = ops[i] <= p->last_op &&
+             (p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(p);
+    return ok;
+}
+
+static bool init_rings(Uring *ring, struct io_uring_params *p) {
+    ring->sq_len = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    ring->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(io_uring_cqe);
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                        IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ptr;
+    ring->sq_head = (uint32_t *)(sq + p->sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p->sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + p->sq_off.array);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    uint8_t *cq = (uint8_t *)ring->cq_ptr;
+    ring->cq_head = (uint32_t *)(cq + p->cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return true;
+}
+
+static bool init_bufs(Uring *ring, uint32_t buf_count, uint32_t buf_size) {
+    assert(buf_count > 0 && ((buf_count - 1) & buf_count) == 0);
+    size_t ring_len = buf_count * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) { return false; }
+    ring->buf_ring = (struct io_uring_buf_ring *)br;
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->bufs = (uint8_t *)malloc((size_t)buf_count * buf_size);
+
+    // hand all buffers to the kernel
+    ring->buf_ring->tail = 0;
+    for (uint32_t i = 0; i < buf_count; ++i) { buf_recycle(ring, i); }
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = buf_count;
+    reg.bgid = k_uring_buf_group;
+    int rv = uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    return rv == 0;  // < 5.19
+}
+
+// multishot recv is a flag, not an opcode, so arm one for real: a kernel
+// without it rejects the flag with -EINVAL. The peer is shut down, so the
+// recv ends at once with EOF
+static bool probe_recv_multishot(Uring *ring) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) { return false; }
+    shutdown(fds[1], SHUT_WR);
+    prep_recv_multishot(ring, fds[0], 0);
+    struct io_uring_cqe *cqe = NULL;
+    if (wait(ring, 1000) >= 0) { cqe = peek(ring); }
+    bool ok = cqe && cqe->res >= 0;
+    if (cqe) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->flags & IORING_CQE_F_BUFFER) { buf_recycle(ring, bid); }
+        advance(ring);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+bool init(Uring *ring, uint32_t entries, uint32_t buf_count,
+          uint32_t buf_size) {
+    struct io_uring_params p = {};
+    // the completion ring must not overflow with multishot operations
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = entries * 4;
+    ring->ring_fd = uring_setup(entries, &p);
+    if (ring->ring_fd < 0) {
+        msg_errno("io_uring_setup() error");
+        return false;
+    }
+
+    bool ok = (p.features & IORING_FEAT_EXT_ARG)      // wait with timeout
+              && (p.features & IORING_FEAT_NODROP)    // no lost completions
+              && probe(ring) && init_rings(ring, &p)  // ring memory
+              && init_bufs(ring, buf_count, buf_size)
+              && probe_recv_multishot(ring);
+    if (!ok) {
+        msg("io_uring: required features are not supported");
+        clear(ring);
+    }
+    return ok;
+}
+
+void clear(Uring *ring) {
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sqes && (void *)ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+    }
+    free(ring->bufs);
+    if (ring->ring_fd >= 0) { close(ring->ring_fd); }
+    *ring = Uring();
+}
+
+// get an empty SQE, submit the pending ones if the ring is full
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    uint32_t tail = *ring->sq_tail;
+    if (tail - load_acquire(ring->sq_head) > ring->sq_mask) {
+        // full, flush without waiting
+        int rv = uring_enter(ring->ring_fd, ring->sq_pending, 0, 0, NULL, 0);
+        if (rv < 0) { die("io_uring_enter()"); }
+        ring->sq_pending -= (uint32_t)rv;
+    }
+    uint32_t idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    store_release(ring->sq_tail, tail + 1);
+    ring->sq_pending++;
+    return sqe;
+}
+
+void prep_accept_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = user_data;
+}
+
+void prep_recv_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;  // the kernel picks a buffer
+    sqe->buf_group = k_uring_buf_group;
+    sqe->user_data = user_data;
+}
+
+void prep_poll_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;  // a CQE per wakeup
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
+
+void prep_send(Uring *ring, int fd, const uint8_t *data, size_t len,
+               uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+int wait(Uring *ring, int32_t timeout_ms) {
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000 * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    // completions already there, just submit
+    uint32_t min_complete = peek(ring) ? 0 : 1;
+    // submit and wait in the same syscall
+    int rv = uring_enter(ring->ring_fd, ring->sq_pending, min_complete,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg));
+    if (rv >= 0) {
+        ring->sq_pending -= (uint32_t)rv;
+    } else if (errno == ETIME) {
+        rv = 0;  // not an error, the SQEs have been submitted
+        ring->sq_pending = 0;
+    }
+    return rv;
+}
+
+struct io_uring_cqe *peek(Uring *ring) {
+    uint32_t head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) { return NULL; }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void advance(Uring *ring) {
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+uint8_t *buf_get(Uring *ring, uint16_t bid) {
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void buf_recycle(Uring *ring, uint16_t bid) {
+    struct io_uring_buf_ring *br = ring->buf_ring;
+    uint16_t tail = br->tail;
+    // not 'br->bufs[]', the empty struct in __DECLARE_FLEX_ARRAY() has a
+    // size of 1 in C++, which shifts the array
+    struct io_uring_buf *buf = (struct io_uring_buf *)br;
+    buf += tail & (ring->buf_count - 1);
+    buf->addr = (uint64_t)(uintptr_t)buf_get(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
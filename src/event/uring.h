@@ -0,0 +1,69 @@
+#pragma once
+
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+// system
+#include <linux/io_uring.h>
+
+// io_uring is a completion-based interface: instead of asking the kernel which
+// fds are ready and then calling read()/write(), the application queues the
+// operations themselves in a shared submission ring (SQ) and reaps the results
+// from a completion ring (CQ). Many operations are submitted and waited for
+// with a single io_uring_enter() syscall.
+//
+// This is a minimal wrapper over the raw syscalls, without liburing:
+// - multishot accept: 1 SQE keeps producing a CQE per new connection.
+// - multishot recv with provided buffers: the kernel picks a buffer from a
+//   ring shared with the application, so no buffer is pinned per connection.
+// - send: queued by the application, submitted in batch with the next wait.
+
+struct Uring {
+    int ring_fd = -1;
+    // submission queue
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t *sq_array = NULL;
+    struct io_uring_sqe *sqes = NULL;
+    uint32_t sq_pending = 0;  // queued but not submitted yet
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    // provided buffer ring
+    struct io_uring_buf_ring *buf_ring = NULL;
+    uint8_t *bufs = NULL;
+    uint32_t buf_count = 0;  // power of 2
+    uint32_t buf_size = 0;
+    // for munmap()
+    void *sq_ptr = NULL;
+    size_t sq_len = 0;
+    void *cq_ptr = NULL;
+    size_t cq_len = 0;
+    size_t sqes_len = 0;
+};
+
+const uint16_t k_uring_buf_group = 0;
+
+// returns false if the kernel lacks any of the features above
+bool init(Uring *ring, uint32_t entries, uint32_t buf_count, uint32_t buf_size);
+void clear(Uring *ring);
+
+// queue operations, they are submitted by the next wait()
+void prep_accept_multishot(Uring *ring, int fd, uint64_t user_data);
+void prep_recv_multishot(Uring *ring, int fd, uint64_t user_data);
+// readiness of a non-socket fd, e.g. an eventfd
+void prep_poll_multishot(Uring *ring, int fd, uint64_t user_data);
+void prep_send(Uring *ring, int fd, const uint8_t *data, size_t len,
+               uint64_t user_data);
+
+// submit the queued operations and wait for at least 1 completion
+int wait(Uring *ring, int32_t timeout_ms);
+// consume completions, returns NULL if there is none
+struct io_uring_cqe *peek(Uring *ring);
+void advance(Uring *ring);
+// access and give back a provided buffer reported by a recv completion
+uint8_t *buf_get(Uring *ring, uint16_t bid);
+void buf_recycle(Uring *ring, uint16_t bid);
@@ -1,47 +1,151 @@
 // stdlib
 #include <assert.h>
-#include <stdlib.h>  // calloc(), free()
+#include <stdlib.h>  // malloc(), free()
+#include <string.h>  // memset()
+// system
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// C++
+#include <utility>  // std::swap()
 // proj
 #include "hashtable.h"
 
-static void init(HashTable *htab, size_t n) {
-    assert(n > 0 && ((n - 1) & n) == 0);  // n must be a power of 2
-    htab->table = (HashNode **)calloc(n, sizeof(HashNode *));
-    htab->mask = n - 1;
+// HashTable::ctrl, a used slot has the high bit cleared
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;
+
+// the 7-bit tag in the control byte
+static uint8_t tag(uint64_t hcode) { return hcode & 0x7F; }
+
+// the first group to probe, the bits are independent of the tag
+static size_t home(HashTable *htab, uint64_t hcode) {
+    return (hcode >> 7) & htab->mask;
+}
+
+static size_t capacity(HashTable *htab) {
+    return htab->ctrl ? (htab->mask + 1) * k_group_width : 0;
+}
+
+static size_t max_load(HashTable *htab) {
+    return capacity(htab) / k_max_load_den * k_max_load_num;
+}
+
+// Group matching: bit i of the result is for slot i of the group
+static uint32_t match(const uint8_t *ctrl, uint8_t c) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    __m128i eq = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)c));
+    return (uint32_t)_mm_movemask_epi8(eq);
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group_width; i++) {
+        bits |= (uint32_t)(ctrl[i] == c) << i;
+    }
+    return bits;
+#endif
+}
+
+// empty or deleted slots, the high bit is set
+static uint32_t match_free(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(group);
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group_width; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+static uint32_t match_used(const uint8_t *ctrl) {
+    return ~match_free(ctrl) & ((1u << k_group_width) - 1);
+}
+
+// the lowest set bit, the next candidate
+static size_t first(uint32_t bits) { return (size_t)__builtin_ctz(bits); }
+
+static void init(HashTable *htab, size_t ngroups) {
+    assert(ngroups > 0 && ((ngroups - 1) & ngroups) == 0);  // power of 2
+    size_t cap = ngroups * k_group_width;
+    // 1 allocation: the control bytes followed by the node pointers
+    uint8_t *mem = (uint8_t *)malloc(cap + cap * sizeof(HashNode *));
+    assert(mem);
+    memset(mem, k_ctrl_empty, cap);
+    htab->ctrl = mem;
+    htab->slots = (HashNode **)(mem + cap);
+    htab->mask = ngroups - 1;
     htab->size = 0;
+    htab->used = 0;
 }
 
-// Step 3: Linked list insertion
+/*
+ * Step 3: Probing. Groups are visited at triangular offsets (+1, +2, +3, ...)
+ * from the home group, which visits every group when the number of groups is
+ * a power of 2. A key is always in the first free slot of its probe sequence
+ * at the time of insertion, so a lookup can stop at the first group with an
+ * empty slot.
+ */
 static void insert(HashTable *htab, HashNode *node) {
-    size_t pos = node->hcode & htab->mask;  // node ->hcode & (n-1)
-    HashNode *next = htab->table[pos];
-    // Insert new node at the front, so insertion is O(1). Being intrusive means
-    // that there's no allocation in the data structure code
-    node->next = next;
-    htab->table[pos] = node;
-    htab->size++;
+    assert(htab->used < capacity(htab));
+    size_t g = home(htab, node->hcode);
+    for (size_t step = 1;; step++) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group_width];
+        if (uint32_t bits = match_free(ctrl)) {
+            size_t pos = g * k_group_width + first(bits);
+            if (htab->ctrl[pos] == k_ctrl_empty) {
+                htab->used++;  // a tombstone is reused
+            }
+            htab->ctrl[pos] = tag(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+        g = (g + step) & htab->mask;
+    }
 }
 
 // Step 6: Hashtable lookup
 static HashNode **lookup(HashTable *htab, HashNode *key,
                          bool (*eq)(HashNode *, HashNode *)) {
-    if (!htab->table) { return NULL; }
-
-    size_t pos = key->hcode & htab->mask;
-    HashNode **from = &htab->table[pos];  // incoming pointer to target
-    for (HashNode *cur; (cur = *from) != NULL; from = &cur->next) {
-        if (cur->hcode == key->hcode && eq(cur, key)) {
-            // we need the address of the pointer to delete it
-            return from;  // return  from instead of cur for deletion
+    if (!htab->ctrl) { return NULL; }
+
+    uint8_t t = tag(key->hcode);
+    size_t g = home(htab, key->hcode);
+    for (size_t step = 1; step <= htab->mask + 1; step++) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group_width];
+        // only the nodes with a matching tag are visited
+        for (uint32_t bits = match(ctrl, t); bits; bits &= bits - 1) {
+            HashNode **slot = &htab->slots[g * k_group_width + first(bits)];
+            if ((*slot)->hcode == key->hcode && eq(*slot, key)) {
+                return slot;  // the slot for deletion
+            }
         }
+        if (match(ctrl, k_ctrl_empty)) {
+            return NULL;  // the key would have been inserted here
+        }
+        g = (g + step) & htab->mask;
     }
     return NULL;
 }
 
-// Step 7: Hashtable deletion
+/*
+ * Step 7: Hashtable deletion. A lookup that stops at an empty slot would miss
+ * the keys probed past it, so the slot becomes a tombstone. Unless the group
+ * has an empty slot already: no probe sequence ever went past the group.
+ */
 static HashNode *detach(HashTable *htab, HashNode **from) {
-    HashNode *node = *from;  // the target node
-    *from = node->next;      // update the incoming pointer to target
+    HashNode *node = *from;
+    size_t pos = (size_t)(from - htab->slots);
+    size_t group = pos & ~(k_group_width - 1);
+    if (match(&htab->ctrl[group], k_ctrl_empty)) {
+        htab->ctrl[pos] = k_ctrl_empty;
+        htab->used--;
+    } else {
+        htab->ctrl[pos] = k_ctrl_deleted;
+    }
     htab->size--;
     return node;
 }
@@ -49,32 +153,70 @@ static HashNode *detach(HashTable *htab, HashNode **from) {
 /*
  * Step 9: Deal with 2 hashtables during rehashing.
  * Normally, HashMap::newer is used while HashMap::older is not.
- * But during rehashing, lookup or delet may need to query both tables
+ * But during rehashing, lookup or delet may need to query both tables.
+ * The keys are moved 1 group at a time, the moved slots in the older table
+ * become tombstones so the keys that are not moved yet can still be found.
  */
-static void trigger_rehashing(HashMap *hmap) {
-    hmap->older = hmap->newer;  // (newer, older) <- (new_table, newer)
-    init(&hmap->newer, (hmap->newer.mask + 1) * 2);
-    hmap->migrate_pos = 0;
-}
-
-static void help_rehashing(HashMap *hmap) {
+static void help_rehashing(HashMap *hmap, size_t max_work) {
+    HashTable *older = &hmap->older;
     size_t nwork = 0;
-    while (nwork < k_rehashing_work && hmap->older.size > 0) {
-        //  find a non-empty slot
-        HashNode **from = &hmap->older.table[hmap->migrate_pos];
-        if (!*from) {
-            hmap->migrate_pos++;
-            continue;  // empty slot
+    while (nwork < max_work && older->size > 0) {
+        size_t pos = hmap->migrate_pos;
+        assert(pos < capacity(older));
+        uint8_t *ctrl = &older->ctrl[pos];
+        for (uint32_t bits = match_used(ctrl); bits; bits &= bits - 1) {
+            size_t i = first(bits);
+            insert(&hmap->newer, older->slots[pos + i]);
+            ctrl[i] = k_ctrl_deleted;
+            older->size--;
+            nwork++;
         }
-        // move the first list itemto the newer table
-        insert(&hmap->newer, detach(&hmap->older, from));
-        nwork++;
+        hmap->migrate_pos += k_group_width;
+        nwork++;  // an empty group is cheap, but not free
     }
     // discard the old table if done
-    if (hmap->older.size == 0 && hmap->older.table) {
-        free(hmap->older.table);
-        hmap->older = HashTable();
+    if (older->size == 0 && older->ctrl) {
+        free(older->ctrl);
+        *older = HashTable();
+    }
+}
+
+// The work left is the groups to visit and the keys to move. It must be done
+// before the newer table reaches its load limit, so it's spread over the
+// inserts that are possible until then. Most of it is done by rehash_step()
+// when the event loop is idle, then each operation only does the minimum.
+static void help_rehashing(HashMap *hmap) {
+    if (!hmap->older.ctrl) { return; }
+    size_t left = capacity(&hmap->older) - hmap->migrate_pos;
+    left = left / k_group_width + hmap->older.size;
+    size_t limit = max_load(&hmap->newer);
+    size_t room = limit > hmap->newer.used ? limit - hmap->newer.used : 0;
+    help_rehashing(hmap, k_min_rehashing_work + 2 * left / (room + 1));
+}
+
+// the number of groups for 'want' keys under the load factor
+static size_t groups_for(size_t want) {
+    size_t ngroups = 1;
+    while (ngroups * k_group_width / k_max_load_den * k_max_load_num < want) {
+        ngroups *= 2;
     }
+    return ngroups;
+}
+
+static void resize(HashMap *hmap, size_t ngroups) {
+    // the previous rehashing is paced to be done before the newer table fills
+    // up, this is just in case
+    while (hmap->older.ctrl) { help_rehashing(hmap, (size_t)-1); }
+
+    hmap->older = hmap->newer;  // (newer, older) <- (new_table, newer)
+    init(&hmap->newer, ngroups);
+    hmap->migrate_pos = 0;
+}
+
+static void trigger_rehashing(HashMap *hmap) {
+    // room for twice the keys, the tombstones are dropped. This shrinks the
+    // table if most keys are deleted
+    resize(hmap, groups_for(size(hmap) * 2 + 1));
 }
 
 HashNode *lookup(HashMap *hmap, HashNode *key,
@@ -85,45 +227,78 @@ HashNode *lookup(HashMap *hmap, HashNode *key,
     return from ? *from : NULL;
 }
 
+// shrink by the load factor, the keys are moved incrementally like growing
+static void maybe_shrink(HashMap *hmap) {
+    if (hmap->older.ctrl) {
+        return;  // wait for the current rehashing
+    }
+    size_t cap = capacity(&hmap->newer);
+    if (cap > k_group_width && hmap->newer.size * k_min_load_den < cap) {
+        trigger_rehashing(hmap);
+    }
+}
+
 HashNode *del(HashMap *hmap, HashNode *key,
               bool (*eq)(HashNode *, HashNode *)) {
     help_rehashing(hmap);
+    HashNode *node = NULL;
     if (HashNode **from = lookup(&hmap->newer, key, eq)) {
-        return detach(&hmap->newer, from);
-    }
-    if (HashNode **from = lookup(&hmap->older, key, eq)) {
-        return detach(&hmap->older, from);
+        node = detach(&hmap->newer, from);
+    } else if (HashNode **from = lookup(&hmap->older, key, eq)) {
+        node = detach(&hmap->older, from);
     }
-    return NULL;
+    if (node) { maybe_shrink(hmap); }
+    return node;
 }
 
 // Step 10: Trigger rehashing by the load factor. Insertion always update the
-// newer table. It triggers rehashing when the load factor is high
+// newer table. It triggers rehashing when the keys and tombstones reach the
+// load factor
 void insert(HashMap *hmap, HashNode *node) {
-    if (!hmap->newer.table) {
-        init(&hmap->newer, 4);  // initialized if empty
+    if (!hmap->newer.ctrl) {
+        init(&hmap->newer, 1);  // initialized if empty
+    } else if (hmap->newer.used >= max_load(&hmap->newer)) {
+        trigger_rehashing(hmap);
     }
     insert(&hmap->newer, node);  // always insert to the newer table
-    if (!hmap->older.table) {    // check wheter we need to rehash
-        size_t threshold = (hmap->newer.mask + 1) * k_max_load_factor;
-        if (hmap->newer.size >= threshold) { trigger_rehashing(hmap); }
+    help_rehashing(hmap);        // migrate some keys
+}
+
+void reserve(HashMap *hmap, size_t n) {
+    size_t ngroups = groups_for(n);
+    if (!hmap->newer.ctrl && !hmap->older.ctrl) {
+        init(&hmap->newer, ngroups);
+    } else if (ngroups > hmap->newer.mask + 1) {
+        resize(hmap, ngroups);
     }
-    help_rehashing(hmap);  // migrate some keys
 }
 
 void clear(HashMap *hmap) {
-    free(hmap->newer.table);
-    free(hmap->older.table);
+    free(hmap->newer.ctrl);
+    free(hmap->older.ctrl);
     *hmap = HashMap();
 }
 
 size_t size(HashMap *hmap) { return hmap->newer.size + hmap->older.size; }
 
+bool is_rehashing(HashMap *hmap) { return hmap->older.ctrl != NULL; }
+
+bool rehash_step(HashMap *hmap, size_t nwork) {
+    help_rehashing(hmap, nwork);
+    return is_rehashing(hmap);
+}
+
+size_t mem_usage(HashMap *hmap) {
+    size_t slots = capacity(&hmap->newer) + capacity(&hmap->older);
+    return slots * (1 + sizeof(HashNode *));
+}
+
 static bool foreach (HashTable *htab, bool (*f)(HashNode *, void *),
                      void *arg) {
-    for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
-        for (HashNode *node = htab->table[i]; node != NULL; node = node->next) {
-            if (!f(node, arg)) { return false; }
+    for (size_t g = 0; g < capacity(htab); g += k_group_width) {
+        for (uint32_t bits = match_used(&htab->ctrl[g]); bits;
+             bits &= bits - 1) {
+            if (!f(htab->slots[g + first(bits)], arg)) { return false; }
         }
     }
     return true;
@@ -131,4 +306,66 @@ static bool foreach (HashTable *htab, bool (*f)(HashNode *, void *),
 
 void foreach (HashMap *hmap, bool (*f)(HashNode *, void *), void *arg) {
     foreach (&hmap->newer, f, arg) &&foreach (&hmap->older, f, arg);
-}
\ No newline at end of file
+}
+
+/*
+ * Step 11: Scan with a cursor. The cursor is a home group, all nodes that
+ * hash to it are visited by walking its probe sequence like a lookup.
+ *
+ * Table size changes are handled like Redis: the cursor is incremented from
+ * the high bits down (reverse binary). With 2**n groups, home group h becomes
+ * h, h + 2**n, h + 2*2**n ... with a larger table, and those all come right
+ * after h in this order. So the groups that are done stay done when the table
+ * grows or shrinks, a node can be visited twice but it's never missed.
+ */
+static uint64_t rev(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// the next cursor, the bits outside of the mask are ignored
+static uint64_t next_cursor(uint64_t v, uint64_t mask) {
+    v |= ~mask;
+    return rev(rev(v) + 1);
+}
+
+// all nodes whose home group is 'h'
+static void scan_home(HashTable *htab, size_t h, void (*f)(HashNode *, void *),
+                      void *arg) {
+    size_t g = h;
+    for (size_t step = 1; step <= htab->mask + 1; step++) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group_width];
+        for (uint32_t bits = match_used(ctrl); bits; bits &= bits - 1) {
+            HashNode *node = htab->slots[g * k_group_width + first(bits)];
+            if (home(htab, node->hcode) == h) { f(node, arg); }
+        }
+        if (match(ctrl, k_ctrl_empty)) {
+            return;  // the end of the probe sequence
+        }
+        g = (g + step) & htab->mask;
+    }
+}
+
+uint64_t scan(HashMap *hmap, uint64_t cursor, void (*f)(HashNode *, void *),
+              void *arg) {
+    HashTable *small = &hmap->newer;
+    HashTable *large = &hmap->older;
+    if (!large->ctrl) {
+        // not rehashing
+        if (!small->ctrl) { return 0; }
+        scan_home(small, cursor & small->mask, f, arg);
+        return next_cursor(cursor, small->mask);
+    }
+    if (!small->ctrl || small->mask > large->mask) { std::swap(small, large); }
+
+    // a home group of the smaller table, then all of its expansions in the
+    // larger table
+    scan_home(small, cursor & small->mask, f, arg);
+    do {
+        scan_home(large, cursor & large->mask, f, arg);
+        cursor = next_cursor(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
@@ -3,38 +3,54 @@
 #include <stddef.h>
 #include <stdint.h>
 
-// Fixed-size chaining hashtable
-// For a chaining  hashtable, the load factor limit should be greater than 1
-const size_t k_max_load_factor = 8;
-const size_t k_rehashing_work = 128;  // constant work
+// Open addressing hashtable (Swiss table)
+// The slots are probed in groups of 16. Each slot has a control byte holding
+// 7 bits of the hash (the tag), so a group is checked for candidates with a
+// few SIMD instructions, and most mismatches never touch the nodes.
+const size_t k_group_width = 16;
+// max (live + deleted) / capacity, as a fraction
+const size_t k_max_load_num = 7;
+const size_t k_max_load_den = 8;
+// shrink when keys / capacity < 1 / k_min_load_den. A resize targets a load
+// factor of 7/32 to 7/16, far enough from both limits to not go back and forth
+const size_t k_min_load_den = 8;
+// the rehashing work done by each operation: at least the minimum, more if
+// the newer table would fill up before the rehashing is done
+const size_t k_min_rehashing_work = 16;
 
 // Step 0: Choose a hash function. For Redis do not use cryptographic hash
 // functions for hashtables because they are slow and overkill
 
-// Step 1: Define the intrusive list node. Just an intrusove linked list node
-// with the hash value of the key
+// Step 1: Define the intrusive node. Just the hash value of the key, the
+// table stores pointers to the nodes
 struct HashNode {
-    HashNode *next = NULL;
     uint64_t hcode = 0;
 };
 
 /*
  * Step 2: Define the fixed-size hashtable.
- * hash(key) % N maps a hash value to a slot, but Modulo or division are slow
- * CPU operations is common to use powers of 2 so it can be done by a fast
- * bitwise and: hash(key) & (N-1)
+ * The capacity is a power of 2 number of groups, so hash(key) & (N-1) selects
+ * the first group to probe.
+ * ctrl[i] is one of:
+ *   - 0xxxxxxx: slot i is used, the low 7 bits of the hash
+ *   - k_ctrl_empty: never used, terminates probing
+ *   - k_ctrl_deleted: a tombstone, probing continues past it
  */
 struct HashTable {
-    HashNode **table = NULL;  // array of slots
-    size_t mask = 0;          // power of 2 array size, 2**n-1
+    uint8_t *ctrl = NULL;     // control bytes, 1 per slot
+    HashNode **slots = NULL;  // in the same allocation as 'ctrl'
+    size_t mask = 0;          // number of groups - 1
     size_t size = 0;          // number of keys
+    size_t used = 0;          // keys + tombstones
 };
 
 // Step 8: Define hashtable interfaces
+// 2 tables for incremental resizing: keys are moved from 'older' to 'newer'
+// a few at a time
 struct HashMap {
     HashTable newer;
     HashTable older;
-    size_t migrate_pos = 0;
+    size_t migrate_pos = 0;  // the next slot of 'older' to move
 };
 
 // helper struct for the hashtable key compare function
@@ -48,8 +64,22 @@ struct HashKey {
 HashNode *lookup(HashMap *hmap, HashNode *key,
                  bool (*eq)(HashNode *, HashNode *));
 void insert(HashMap *hmap, HashNode *node);
+// room for n keys without resizing, for bulk inserts
+void reserve(HashMap *hmap, size_t n);
 HashNode *del(HashMap *hmap, HashNode *key, bool (*eq)(HashNode *, HashNode *));
 void clear(HashMap *hmap);
 size_t size(HashMap *hmap);
+// bytes allocated for the tables, not including the nodes
+size_t mem_usage(HashMap *hmap);
+// background rehashing, the unit of work is a group or a node
+bool is_rehashing(HashMap *hmap);
+// returns false if the rehashing is done
+bool rehash_step(HashMap *hmap, size_t nwork);
 // invoke the callback on each node until it returns false
-void foreach (HashMap *hmap, bool (*f)(HashNode *, void *), void *arg);
\ No newline at end of file
+void foreach (HashMap *hmap, bool (*f)(HashNode *, void *), void *arg);
+// cursor based iteration, starts and ends with cursor 0. Invokes the callback
+// on a few nodes and returns the next cursor. A node that is in the map for
+// the whole iteration is visited at least once, even across resizes. The map
+// must not be modified by the callback
+uint64_t scan(HashMap *hmap, uint64_t cursor, void (*f)(HashNode *, void *),
+              void *arg);
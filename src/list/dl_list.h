@@ -27,5 +27,17 @@ inline void detach(DL_List *node) {
     next->prev = prev;
 }
 
+// move all nodes of 'from' to the end of 'to', 'from' becomes empty
+inline void splice(DL_List *from, DL_List *to) {
+    if (from->next == from) { return; }
+    DL_List *first = from->next;
+    DL_List *last = from->prev;
+    first->prev = to->prev;
+    to->prev->next = first;
+    last->next = to;
+    to->prev = last;
+    init(from);
+}
+
 // and empty list is a list with only the dummy node
 inline bool is_empty(DL_List *node) { return node->next == node; }
\ No newline at end of file
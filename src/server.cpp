@@ -1,6 +1,7 @@
 // stdlib
 #include <assert.h>
 #include <errno.h>
+#include <malloc.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,16 +11,20 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/ip.h>
-#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 // C++
+#include <algorithm>
+#include <new>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
+#include "alloc/slab.h"
 #include "common/common.h"
 #include "common/messages.h"
 #include "common/types.h"
+#include "event/event_loop.h"
 #include "hashtable/hashtable.h"
 #include "sorted_set/zset.h"
 #include "thread/thread_pool.h"
@@ -43,14 +48,21 @@ static void fd_set_nb(int fd) {
     // fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-// append to the back
-static void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
-}
+// create a 'struct Conn' for an accepted socket
+static Conn *conn_new(int connfd) {
+    Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->want_read = true;  // read the first request
+    conn->last_active_ms = get_monotonic_msec();
+    insert_before(&g_data.idle_list, &conn->idle_node);
 
-// remove from the front
-static void buf_consume(Buffer &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
+    // put it into the map
+    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+    assert(!g_data.fd2conn[conn->fd]);
+    g_data.fd2conn[conn->fd] = conn;
+    return conn;
 }
 
 // the event loop calls back the application code to do the accept()
@@ -70,25 +82,14 @@ static int32_t handle_accept(int fd) {
 
     // set the new connection fd to non-blocking mode
     fd_set_nb(connfd);
-
-    // create a 'struct Conn'
-    Conn *conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;  // read the first request
-    conn->last_active_ms = get_monotonic_msec();
-    insert_before(&g_data.idle_list, &conn->idle_node);
-
-    // put it into the map
-    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-        g_data.fd2conn.resize(conn->fd + 1);
-    }
-    assert(!g_data.fd2conn[conn->fd]);
-    g_data.fd2conn[conn->fd] = conn;
-
+    conn_new(connfd);
+    // register the interest once, it only changes when the intent flips
+    watch(&g_data.loop, connfd, EV_READ);
     return 0;
 }
 
 static void destroy(Conn *conn) {
+    unwatch(&g_data.loop, conn->fd);
     (void)close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
     detach(&conn->idle_node);
@@ -105,11 +106,11 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
 }
 
 // remember *& is a reference to a pointer. References are just pointers with
-// different syntax
+// different syntax. The string is not copied, 'out' points into the input
 static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
-                     std::string &out) {
+                     std::string_view &out) {
     if (cur + n > end) { return false; }
-    out.assign(cur, cur + n);
+    out = std::string_view((const char *)cur, n);
     cur += n;
     return true;
 }
@@ -124,8 +125,11 @@ static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
  *    4B     4B    ...    4B   ...
  */
 // Step 1: parse the request command. Length-prefixed data parsing (trivial)
+// The arguments are views into 'Conn::incoming', they are only valid until the
+// request is consumed. Handlers must copy what they store. The arguments are
+// appended to 'out'.
 static int32_t parse_req(const uint8_t *data, size_t size,
-                         std::vector<std::string> &out) {
+                         std::vector<std::string_view> &out) {
     const uint8_t *end = data + size;
     uint32_t nstr = 0;
     if (!read_u32(data, end, nstr)) { return -1; }
@@ -133,10 +137,10 @@ static int32_t parse_req(const uint8_t *data, size_t size,
         return -1;  // safety limit
     }
 
-    while (out.size() < nstr) {
+    for (uint32_t i = 0; i < nstr; ++i) {
         uint32_t len = 0;
         if (!read_u32(data, end, len)) { return -1; }
-        out.push_back(std::string());
+        out.push_back(std::string_view());
         if (!read_str(data, end, len, out.back())) { return -1; }
     }
 
@@ -148,7 +152,9 @@ static int32_t parse_req(const uint8_t *data, size_t size,
 }
 
 // help functions for the serialization
-static void buf_append_u8(Buffer &buf, uint8_t data) { buf.push_back(data); }
+static void buf_append_u8(Buffer &buf, uint8_t data) {
+    buf_append(buf, &data, 1);
+}
 static void buf_append_u32(Buffer &buf, uint32_t data) {
     buf_append(buf, (const uint8_t *)&data, 4);
 }
@@ -188,14 +194,14 @@ static void out_arr(Buffer &out, uint32_t n) {
 }
 
 static size_t out_begin_arr(Buffer &out) {
-    out.push_back(TAG_ARR);
-    buf_append_u32(out, 0);  // filled by out_end_arr()
-    return out.size() - 4;   // the 'ctx' arg
+    buf_append_u8(out, TAG_ARR);
+    buf_append_u32(out, 0);    // filled by out_end_arr()
+    return buf_size(out) - 4;  // the 'ctx' arg
 }
 
 static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
-    assert(out[ctx - 1] == TAG_ARR);
-    memcpy(&out[ctx], &n, 4);
+    assert(buf_data(out)[ctx - 1] == TAG_ARR);
+    memcpy(&buf_data(out)[ctx], &n, 4);
 }
 
 // function to output serialized data
@@ -206,31 +212,198 @@ static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
     buf_append(out, (const uint8_t *)msg.data(), msg.size());
 }
 
-static Entry *entry_new(uint32_t type) {
-    Entry *ent = new Entry();
-    ent->type = type;
+// a response body serialized by the thread pool, after 4 bytes of room for the
+// header. It's moved instead of copied if the response is alone in 'out', i.e.
+// 'out' is only the 4-byte header
+static void out_body(Buffer &out, Buffer &body) {
+    if (buf_size(out) == 4) {
+        swap(out, body);
+    } else {
+        buf_append(out, buf_data(body) + 4, buf_size(body) - 4);
+    }
+}
+
+/*
+ * Offloading a request to the thread pool. The handler calls async_begin()
+ * and queues the tasks with the job's future. The request is suspended like a
+ * request waiting for another shard: the connection, or the forwarding shard,
+ * gets nothing else meanwhile. The last task pushes the job into this shard's
+ * mailbox, and the event loop writes the response with 'AsyncJob::done'.
+ *
+ * The tasks either get a copy of what they need, or read the keyspace in
+ * place after async_read(). The keyspace isn't locked, but while a reader is
+ * running the event loop doesn't modify or free anything it may see:
+ *   - A deleted entry, or a replaced string or sorted set, is retired and
+ *     freed after the readers that started before it.
+ *   - A sorted set being read is copied before an update, a big string is
+ *     written to a new allocation. The readers see the old version.
+ * The keys don't change, so the readers only need the entries to be kept.
+ */
+static Mailbox *my_mailbox();
+
+// only a request from a connection or another shard can be suspended
+static bool can_suspend() { return g_data.cur_conn || g_data.cur_msg; }
+
+static void async_begin(AsyncJob *job, uint32_t ntasks) {
+    assert(can_suspend());
+    job->msg.type = MSG_DONE;
+    job->msg.src = g_data.shard_id;
+    job->msg.conn = g_data.cur_conn;
+    job->req = g_data.cur_msg;
+    job->fut.pending = ntasks;
+    job->fut.mailbox = my_mailbox();
+    job->fut.node = &job->msg.node;
+    if (job->req) {
+        job->req->blocked = true;
+    } else {
+        job->msg.conn->blocked = true;
+    }
+}
+
+// a job reads the keyspace in the thread pool until it's done
+static void async_read(AsyncJob *job) {
+    job->read_seq = ++g_data.read_seq;
+    insert_before(&g_data.readers, &job->reader);
+}
+
+// whether a reader may see memory from when 'seq' was the newest reader
+static bool is_read(uint64_t seq) {
+    if (is_empty(&g_data.readers)) { return false; }
+    AsyncJob *oldest = container_of(g_data.readers.next, AsyncJob, reader);
+    return seq >= oldest->read_seq;
+}
+
+// free now, or after the readers that may see it
+static void retire(void (*f)(void *), void *arg) {
+    if (is_empty(&g_data.readers)) { return f(arg); }
+    g_data.retired.push_back(Retired{g_data.read_seq, f, arg});
+}
+
+// a reader is done, free what the others can't see
+static void async_read_end(AsyncJob *job) {
+    detach(&job->reader);
+    std::vector<Retired> &retired = g_data.retired;
+    size_t n = 0;
+    for (; n < retired.size() && !is_read(retired[n].seq); ++n) {
+        retired[n].f(retired[n].arg);
+    }
+    retired.erase(retired.begin(), retired.begin() + n);
+}
+
+// the key is copied into the entry, with room for an inline string value
+static Entry *entry_new(uint32_t type, std::string_view key, uint64_t hcode,
+                        size_t val_size) {
+    size_t inline_cap = 0;
+    if (type == T_STR && val_size <= k_max_inline_str) {
+        inline_cap = (val_size + 7) & ~(size_t)7;  // some room to grow
+    }
+    Entry *ent = (Entry *)slab_alloc(sizeof(Entry) + key.size() + inline_cap);
+    ent->node.hcode = hcode;
+    if (g_server.ttl == TTL_WHEEL) {
+        ent->timer = TimerNode();
+    } else {
+        ent->heap_idx = -1;
+    }
+    ent->type = (uint16_t)type;
+    ent->inline_cap = (uint16_t)inline_cap;
+    ent->klen = (uint32_t)key.size();
+    memcpy(&ent->data[0], key.data(), key.size());
+    if (type == T_STR) {
+        ent->str.ptr = &ent->data[key.size()];
+        ent->str.len = 0;
+        ent->str.cap = (uint32_t)inline_cap;
+    } else {
+        ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+        ent->zset_read_seq = 0;
+    }
     return ent;
 }
 
+static size_t entry_size(Entry *ent) {
+    return sizeof(Entry) + ent->klen + ent->inline_cap;
+}
+
+static std::string_view entry_key(Entry *ent) {
+    return std::string_view(ent->data, ent->klen);
+}
+
+static bool str_is_inline(Entry *ent) {
+    return ent->str.ptr == &ent->data[ent->klen];
+}
+
+static std::string_view entry_str(Entry *ent) {
+    return std::string_view(ent->str.ptr, ent->str.len);
+}
+
+// copy the value, reuse the space if it fits
+static void entry_set_str(Entry *ent, std::string_view val) {
+    if (!str_is_inline(ent) && !is_empty(&g_data.readers)) {
+        // an async GET may be reading it, don't overwrite it
+        retire(&free, ent->str.ptr);
+        ent->str.ptr = &ent->data[ent->klen];
+        ent->str.cap = ent->inline_cap;
+    }
+    if (val.size() > ent->str.cap) {
+        if (!str_is_inline(ent)) { free(ent->str.ptr); }
+        ent->str.ptr = (char *)malloc(val.size());
+        assert(ent->str.ptr);
+        ent->str.cap = (uint32_t)val.size();
+    }
+    memcpy(ent->str.ptr, val.data(), val.size());
+    ent->str.len = (uint32_t)val.size();
+}
+
+// the TTL is in the heap or in the timing wheel
+static bool entry_has_ttl(Entry *ent) {
+    if (g_server.ttl == TTL_WHEEL) { return is_armed(&ent->timer); }
+    return ent->heap_idx != (size_t)-1;
+}
+
+static uint64_t entry_expire_at(Entry *ent) {
+    if (g_server.ttl == TTL_WHEEL) { return ent->timer.expire_at; }
+    return g_data.heap[ent->heap_idx].val;
+}
+
 static void set_ttl(Entry *ent, int64_t ttl_ms);
 
 // sorted set destruction in the thread pool
 
+static void zset_del(ZSet *zset) {
+    clear(zset);
+    zset->~ZSet();
+    slab_free(zset, sizeof(ZSet));
+}
+
+// wrapper function for the thread pool
+static void zset_del(void *arg) { zset_del((ZSet *)arg); }
+
+// a retired copy of a set, large ones in the thread pool
+static void zset_drop(void *arg) {
+    ZSet *zset = (ZSet *)arg;
+    if (size(zset) > k_large_container_size) {
+        queue(&g_data.thread_pool, &zset_del, zset);
+    } else {
+        zset_del(zset);
+    }
+}
+
 // previous del()
 static void del_sync(Entry *ent) {
-    if (ent->type == T_ZSET) { clear(&ent->zset); }
-    delete ent;
+    if (ent->type == T_ZSET) {
+        zset_del(ent->zset);
+    } else if (!str_is_inline(ent)) {
+        free(ent->str.ptr);
+    }
+    slab_free(ent, entry_size(ent));
 }
 
 // wrapper function for the thread pool
 static void del(void *arg) { del_sync((Entry *)arg); }
 
-// new del()
-static void del(Entry *ent) {
-    // unlink it from any data structures
-    set_ttl(ent, -1);  // remove from the heap data structure
+static void del_drop(void *arg) {
+    Entry *ent = (Entry *)arg;
     // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? size(&ent->zset.hmap) : 0;
+    size_t set_size = (ent->type == T_ZSET) ? size(ent->zset) : 0;
     if (set_size > k_large_container_size) {
         queue(&g_data.thread_pool, &del, ent);
     } else {
@@ -238,73 +411,205 @@ static void del(Entry *ent) {
     }
 }
 
+// new del()
+static void del(Entry *ent) {
+    // unlink it from any data structures
+    set_ttl(ent, -1);  // remove from the heap data structure
+    retire(&del_drop, ent);  // an async reader may still see it
+}
+
+// a set about to be modified. If a reader may see it, the reader keeps it and
+// the key gets a copy
+static ZSet *zset_write(Entry *ent) {
+    if (!is_read(ent->zset_read_seq)) { return ent->zset; }
+    ZSet *old = ent->zset;
+    std::vector<ZPair> pairs;
+    pairs.reserve(size(old));
+    ZIter it;
+    for (bool ok = at(old, 0, &it); ok; ok = next(&it)) {
+        pairs.push_back(ZPair{it.score, it.name, it.len});
+    }
+    ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+    build(ent->zset, pairs.data(), pairs.size());  // in order already
+    ent->zset_read_seq = 0;
+    retire(&zset_drop, old);
+    return ent->zset;
+}
+
 // equality comparison  for the top-level hashtable
 static bool eq(HashNode *node, HashNode *key) {
     struct Entry *ent = container_of(node, struct Entry, node);
     struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-    return ent->key == keydata->key;
+    return entry_key(ent) == keydata->key;
+}
+
+static bool same(HashNode *node, HashNode *key) { return node == key; }
+
+// the TTL has passed, but the key may not be deleted yet
+static bool entry_expired(Entry *ent, uint64_t now_ms) {
+    return entry_has_ttl(ent) && entry_expire_at(ent) < now_ms;
+}
+
+// the key with the earliest TTL if it has expired. The wheel only knows the
+// tick of the TTLs, and may advance up to 'now_ms' to find one.
+static Entry *ttl_first_expired(uint64_t now_ms) {
+    if (g_server.ttl == TTL_WHEEL) {
+        TimerNode *timer = peek_expired(&g_data.wheel, now_ms);
+        return timer ? container_of(timer, Entry, timer) : NULL;
+    }
+    const HeapVector &heap = g_data.heap;
+    if (heap.empty() || heap[0].val >= now_ms) { return NULL; }
+    return container_of(heap[0].ref, Entry, heap_idx);
+}
+
+// when ttl_first_expired() may return a key, -1 for never
+static uint64_t ttl_next_ms() {
+    if (g_server.ttl == TTL_WHEEL) { return next_expiry(&g_data.wheel); }
+    return g_data.heap.empty() ? (uint64_t)-1 : g_data.heap[0].val;
+}
+
+static void expire_key(Entry *ent) {
+    HashNode *node = del(&g_data.db, &ent->node, &same);
+    assert(node == &ent->node);
+    (void)node;
+    del(ent);
+    g_data.expire.expired++;
+}
+
+// expired keys per second, a new sample each second
+static void expire_rate_update(uint64_t now_us) {
+    ExpireStats &st = g_data.expire;
+    uint64_t elapsed_us = now_us - st.rate_start_us;
+    if (elapsed_us < 1000000) { return; }
+    st.per_sec = (st.expired - st.rate_start_keys) * 1000000 / elapsed_us;
+    st.rate_start_us = now_us;
+    st.rate_start_keys = st.expired;
+}
+
+// how late the expiry of the oldest expired key is
+static uint64_t expire_lag_ms(uint64_t now_ms) {
+    Entry *ent = ttl_first_expired(now_ms);
+    return ent ? now_ms - entry_expire_at(ent) : 0;
+}
+
+// Look up a key for a command. The active expiry may be behind, an expired key
+// is deleted here (lazy expiry) so that it's never visible.
+static Entry *entry_lookup(LookupKey &key) {
+    HashNode *node = lookup(&g_data.db, &key.node, &eq);
+    if (!node) { return NULL; }
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_has_ttl(ent) && entry_expire_at(ent) < get_monotonic_msec()) {
+        expire_key(ent);
+        return NULL;
+    }
+    return ent;
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
+// A large reply is serialized in the thread pool, the task reads the keyspace
+// in place and writes the whole response into the job's buffer, which is then
+// moved into 'Conn::outgoing'
+struct ReplyJob {
+    AsyncJob async;
+    Buffer buf;  // 4 bytes of room for the response header, then the body
+    // what to serialize, by the task
+    std::string_view str;       // GET
+    std::vector<Entry *> keys;  // KEYS
+    ZIter it;                   // ZQUERY, from 'it'
+    int64_t limit = 0;          // array elements
+};
+
+static void reply_done(AsyncJob *async, Buffer &out) {
+    ReplyJob *job = container_of(async, ReplyJob, async);
+    out_body(out, job->buf);
+    delete job;
+}
+
+// queue the task 'f' of the job
+static void reply_queue(ReplyJob *job, void (*f)(void *)) {
+    async_begin(&job->async, 1);
+    async_read(&job->async);
+    job->async.done = &reply_done;
+    queue(&g_data.thread_pool, f, job, &job->async.fut);
+}
+
+// the buffer is allocated once in the thread pool, not grown on the event loop
+static Buffer &reply_buf(ReplyJob *job, size_t body_size) {
+    buf_reserve(job->buf, 4 + body_size);
+    buf_append_u32(job->buf, 0);  // the response header
+    return job->buf;
+}
+
+static void get_run(void *arg) {
+    ReplyJob *job = (ReplyJob *)arg;
+    Buffer &out = reply_buf(job, 5 + job->str.size());
+    out_str(out, job->str.data(), job->str.size());
+}
+
+static void do_get(std::vector<std::string_view> &cmd, Buffer &out) {
     // a dummy 'Entry' just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
 
     // hashtable lookup
-    HashNode *node = lookup(&g_data.db, &key.node, &eq);
-    if (!node) { return out_nil(out); }
+    Entry *ent = entry_lookup(key);
+    if (!ent) { return out_nil(out); }
 
     // copy the value
-    Entry *ent = container_of(node, Entry, node);
     if (ent->type != T_STR) {
         return out_err(out, ERR_BAD_TYP, "not a string value");
     }
-    return out_str(out, ent->str.data(), ent->str.size());
+    std::string_view val = entry_str(ent);
+    if (val.size() >= k_async_reply_bytes && can_suspend()) {
+        ReplyJob *job = new ReplyJob();
+        job->str = val;  // not modified in place while it's read
+        return reply_queue(job, &get_run);
+    }
+    return out_str(out, val.data(), val.size());
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
+static void do_set(std::vector<std::string_view> &cmd, Buffer &out) {
     // dummy 'Entry' just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
 
     // hashtable lookup
-    HashNode *node = lookup(&g_data.db, &key.node, &eq);
-    if (node) {
+    Entry *ent = entry_lookup(key);
+    if (ent) {
         // found, update the value
-        Entry *ent = container_of(node, Entry, node);
         if (ent->type != T_STR) {
             return out_err(out, ERR_BAD_TYP, "a non-string value exists");
         }
-        ent->str.swap(cmd[2]);
+        entry_set_str(ent, cmd[2]);  // copy the value
     } else {
         // not found, allocate & insert a new pair
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
+        ent = entry_new(T_STR, key.key, key.node.hcode, cmd[2].size());
+        entry_set_str(ent, cmd[2]);
         insert(&g_data.db, &ent->node);
     }
     return out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
+static void do_del(std::vector<std::string_view> &cmd, Buffer &out) {
     // dummy 'Entry' just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
-    //  hashable delete
-    HashNode *node = del(&g_data.db, &key.node, &eq);
-    if (node) {  // deallocate the pair
-        del(container_of(node, Entry, node));
+    //  hashable delete, an expired key doesn't count
+    Entry *ent = entry_lookup(key);
+    if (ent) {  // deallocate the pair
+        HashNode *node = del(&g_data.db, &ent->node, &same);
+        assert(node == &ent->node);
+        (void)node;
+        del(ent);
     }
-    return out_int(out, node ? 1 : 0);
+    return out_int(out, ent ? 1 : 0);
 }
 
 // swap element with last item and delete the last item.
 // O(1) approach and compatible with  the heap data structure.
-static void del(std::vector<HeapItem> &a, size_t pos) {
+static void del(HeapVector &a, size_t pos) {
     // swap the erased item with the last item
     a[pos] = a.back();
     a.pop_back();
@@ -312,7 +617,7 @@ static void del(std::vector<HeapItem> &a, size_t pos) {
     if (pos < a.size()) { update(a.data(), pos, a.size()); }
 }
 
-static void upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+static void upsert(HeapVector &a, size_t pos, HeapItem t) {
     if (pos < a.size()) {
         a[pos] = t;  // update and existing item
     } else {
@@ -324,6 +629,15 @@ static void upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
 
 // set or remove TTL
 static void set_ttl(Entry *ent, int64_t ttl_ms) {
+    if (g_server.ttl == TTL_WHEEL) {
+        if (ttl_ms < 0) {
+            del(&g_data.wheel, &ent->timer);
+        } else {
+            uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+            upsert(&g_data.wheel, &ent->timer, expire_at);
+        }
+        return;
+    }
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
         // setting a negative TTL means removing the TTL
         del(g_data.heap, ent->heap_idx);
@@ -336,260 +650,1306 @@ static void set_ttl(Entry *ent, int64_t ttl_ms) {
     }
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
+// the views are not NUL-terminated, numbers are copied to the stack for
+// strtoll() and strtod()
+static bool to_cstr(std::string_view s, char (&buf)[k_max_num_len]) {
+    if (s.size() >= sizeof(buf)) { return false; }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    return true;
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    char buf[k_max_num_len];
+    if (!to_cstr(s, buf)) { return false; }
     char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
 }
 
 // PEXPIRE key ttl_ms
-static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
+static void do_expire(std::vector<std::string_view> &cmd, Buffer &out) {
     int64_t ttl_ms = 0;
     if (!str2int(cmd[2], ttl_ms)) {
         return out_err(out, ERR_BAD_ARG, "expect int64");
     }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
 
-    HashNode *node = lookup(&g_data.db, &key.node, &eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        set_ttl(ent, ttl_ms);
-    }
-    return out_int(out, node ? 1 : 0);
+    Entry *ent = entry_lookup(key);
+    if (ent) { set_ttl(ent, ttl_ms); }
+    return out_int(out, ent ? 1 : 0);
 }
 
 // PTTL key
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
+static void do_ttl(std::vector<std::string_view> &cmd, Buffer &out) {
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
 
-    HashNode *node = lookup(&g_data.db, &key.node, &eq);
-    if (!node) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
         return out_int(out, -2);  // not found
     }
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
+    if (!entry_has_ttl(ent)) {
         return out_int(out, -1);  // no TTL
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t expire_at = entry_expire_at(ent);
     uint64_t now_ms = get_monotonic_msec();
     return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
 
+struct KeysArg {
+    Buffer *out = NULL;
+    std::vector<Entry *> *ents = NULL;  // collected instead of serialized
+    uint32_t count = 0;
+    uint64_t now_ms = 0;
+};
+
+// the map can't be modified while iterating, expired keys are just skipped
 static bool cb_keys(HashNode *node, void *arg) {
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
+    KeysArg *ka = (KeysArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent, ka->now_ms)) { return true; }
+    if (ka->ents) {
+        ka->ents->push_back(ent);
+    } else {
+        std::string_view key = entry_key(ent);
+        out_str(*ka->out, key.data(), key.size());
+    }
+    ka->count++;
     return true;
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)size(&g_data.db));
-    foreach (&g_data.db, &cb_keys, (void *)&out);
+// KEYS in sharded mode: the array elements of the local shard
+static void keys_append(Buffer &out, uint32_t *count) {
+    KeysArg ka;
+    ka.out = &out;
+    ka.now_ms = get_monotonic_msec();
+    foreach (&g_data.db, &cb_keys, (void *)&ka);
+    *count += ka.count;
 }
 
-static bool str2dbl(const std::string &s, double &out) {
+// the entries are kept while they're read, the keys never change
+static void keys_run(void *arg) {
+    ReplyJob *job = (ReplyJob *)arg;
+    size_t bytes = 5;
+    for (Entry *ent : job->keys) { bytes += 5 + ent->klen; }
+    Buffer &out = reply_buf(job, bytes);
+    out_arr(out, (uint32_t)job->keys.size());
+    for (Entry *ent : job->keys) {
+        std::string_view key = entry_key(ent);
+        out_str(out, key.data(), key.size());
+    }
+}
+
+static void do_keys(std::vector<std::string_view> &, Buffer &out) {
+    if (size(&g_data.db) > k_async_reply_elems && can_suspend()) {
+        // only the pointers are collected on the event loop
+        ReplyJob *job = new ReplyJob();
+        job->keys.reserve(size(&g_data.db));
+        KeysArg ka;
+        ka.ents = &job->keys;
+        ka.now_ms = get_monotonic_msec();
+        foreach (&g_data.db, &cb_keys, (void *)&ka);
+        return reply_queue(job, &keys_run);
+    }
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    keys_append(out, &n);
+    out_end_arr(out, ctx, n);
+}
+
+static bool str2dbl(std::string_view s, double &out) {
+    char buf[k_max_num_len];
+    if (!to_cstr(s, buf)) { return false; }
     char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
 }
 
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect float");
+static bool cmd_eq(const char *name, std::string_view s);
+
+// the options of ZADD, and the (score, name) pairs
+struct ZAddArgs {
+    bool nx = false;    // only add new members
+    bool xx = false;    // only update existing ones
+    bool gt = false;    // only update to a greater score
+    bool lt = false;    // only update to a lower score
+    bool incr = false;  // add to the score, like ZINCRBY
+    std::vector<ZPair> pairs;
+};
+
+// NULL or the error message
+static const char *parse_zadd_args(std::vector<std::string_view> &cmd,
+                                   ZAddArgs &args) {
+    size_t pos = 2;
+    for (; pos < cmd.size(); ++pos) {
+        if (cmd_eq("nx", cmd[pos])) {
+            args.nx = true;
+        } else if (cmd_eq("xx", cmd[pos])) {
+            args.xx = true;
+        } else if (cmd_eq("gt", cmd[pos])) {
+            args.gt = true;
+        } else if (cmd_eq("lt", cmd[pos])) {
+            args.lt = true;
+        } else if (cmd_eq("incr", cmd[pos])) {
+            args.incr = true;
+        } else {
+            break;
+        }
+    }
+    if (pos == cmd.size() || (cmd.size() - pos) % 2 != 0) {
+        return "syntax error";
+    }
+    if (args.nx && (args.xx || args.gt || args.lt)) {
+        return "NX is not compatible with XX, GT or LT";
+    }
+    if (args.gt && args.lt) { return "GT and LT are not compatible"; }
+    if (args.incr && cmd.size() - pos != 2) {
+        return "INCR takes a single score and name";
+    }
+    // all or nothing
+    args.pairs.resize((cmd.size() - pos) / 2);
+    for (ZPair &p : args.pairs) {
+        if (!str2dbl(cmd[pos], p.score)) { return "expect float"; }
+        p.name = cmd[pos + 1].data();
+        p.len = cmd[pos + 1].size();
+        pos += 2;
+    }
+    return NULL;
+}
+
+// whether the options allow the update
+static bool zadd_score(const ZAddArgs &args, bool exists, double old,
+                       double score) {
+    if ((exists && args.nx) || (!exists && args.xx)) { return false; }
+    if (exists && args.gt && !(score > old)) { return false; }
+    if (exists && args.lt && !(score < old)) { return false; }
+    return true;
+}
+
+static bool name_less(const ZPair &lhs, const ZPair &rhs) {
+    return std::string_view(lhs.name, lhs.len) <
+           std::string_view(rhs.name, rhs.len);
+}
+
+// The names repeated in 1 command are updated in order, so they are folded
+// into the last score that the options allow.
+static void zadd_dedup(const ZAddArgs &args, std::vector<ZPair> &pairs) {
+    std::stable_sort(pairs.begin(), pairs.end(), &name_less);
+    size_t n = 0;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        if (n > 0 && !name_less(pairs[n - 1], pairs[i])) {
+            double score = pairs[i].score;
+            if (zadd_score(args, true, pairs[n - 1].score, score)) {
+                pairs[n - 1].score = score;
+            }
+        } else {
+            pairs[n++] = pairs[i];
+        }
+    }
+    pairs.resize(n);
+}
+
+// ZADD zset [NX | XX] [GT | LT] [INCR] score name [score name ...]
+static void do_zadd(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZAddArgs args;
+    if (const char *err = parse_zadd_args(cmd, args)) {
+        return out_err(out, ERR_BAD_ARG, err);
     }
 
     // look up or create zset
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
-    HashNode *hnode = lookup(&g_data.db, &key.node, &eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {  // insert a new key
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+    Entry *ent = entry_lookup(key);
+    if (!ent && args.xx) {  // nothing to update
+        return args.incr ? out_nil(out) : out_int(out, 0);
+    } else if (!ent) {  // insert a new key
+        ent = entry_new(T_ZSET, key.key, key.node.hcode, 0);
         insert(&g_data.db, &ent->node);
     } else {  // check the existing key
-        ent = container_of(hnode, Entry, node);
         if (ent->type != T_ZSET) {
             return out_err(out, ERR_BAD_TYP, "expect zset");
         }
     }
+    ZSet *zset = zset_write(ent);
 
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+    // bulk load a new set: sorted and built bottom-up
+    if (size(zset) == 0 && args.pairs.size() > 1 && !args.xx) {
+        zadd_dedup(args, args.pairs);
+        build(zset, args.pairs.data(), args.pairs.size());
+        return out_int(out, (int64_t)args.pairs.size());
+    }
+
+    // add or update the tuples
+    reserve(zset, size(zset) + args.pairs.size());
+    int64_t added = 0;
+    for (ZPair &p : args.pairs) {
+        ZIter it;
+        bool exists = lookup(zset, p.name, p.len, &it);
+        double score = p.score;
+        if (args.incr && exists) { score += it.score; }
+        if (isnan(score)) {
+            return out_err(out, ERR_BAD_ARG, "the score is not a number");
+        }
+        if (!zadd_score(args, exists, it.score, score)) {
+            if (args.incr) { return out_nil(out); }
+            continue;
+        }
+        added += insert(zset, p.name, p.len, score) ? 1 : 0;
+        if (args.incr) { return out_dbl(out, score); }
+    }
+    return out_int(out, added);
 }
 
-static ZSet *expect_zset(std::string &s) {
+// the entry too, NULL if the key doesn't exist
+static ZSet *expect_zset(std::string_view s, Entry *&ent) {
     LookupKey key;
-    key.key.swap(s);
+    key.key = s;
     key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
-    HashNode *hnode = lookup(&g_data.db, &key.node, &eq);
-    if (!hnode) {  // non-existent key is treated as an empty zset
+    ent = entry_lookup(key);
+    if (!ent) {  // non-existent key is treated as an empty zset
         return (ZSet *)&k_empty_zset;
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    return ent->type == T_ZSET ? ent->zset : NULL;
+}
+
+static ZSet *expect_zset(std::string_view s) {
+    Entry *ent = NULL;
+    return expect_zset(s, ent);
 }
 
 // zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+static void do_zrem(std::vector<std::string_view> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_lookup(key);
+    if (!ent) { return out_int(out, 0); }  // an empty zset
+    if (ent->type != T_ZSET) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = lookup(zset, name.data(), name.size());
-    if (znode) { del(zset, znode); }
-    return out_int(out, znode ? 1 : 0);
+    std::string_view name = cmd[2];
+    bool removed = del(zset_write(ent), name.data(), name.size());
+    return out_int(out, removed ? 1 : 0);
 }
 
 // zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zscore(std::vector<std::string_view> &cmd, Buffer &out) {
     ZSet *zset = expect_zset(cmd[1]);
     if (!zset) { return out_err(out, ERR_BAD_TYP, "expected zset"); }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    std::string_view name = cmd[2];
+    ZIter it;
+    bool found = lookup(zset, name.data(), name.size(), &it);
+    return found ? out_dbl(out, it.score) : out_nil(out);
+}
+
+// name and score pairs, at most 'limit' array elements
+static void out_zquery(Buffer &out, ZIter *it, bool ok, int64_t limit) {
+    size_t ctx = out_begin_arr(out);
+    int64_t n = 0;
+    while (ok && n < limit) {
+        out_str(out, it->name, it->len);
+        out_dbl(out, it->score);
+        ok = next(it);
+        n += 2;
+    }
+    out_end_arr(out, ctx, (uint32_t)n);
+}
+
+static void zquery_run(void *arg) {
+    ReplyJob *job = (ReplyJob *)arg;
+    // per member: a name, guessed at 14 bytes, and a score. It grows if the
+    // names are longer
+    int64_t members = (job->limit + 1) / 2;
+    Buffer &out = reply_buf(job, 5 + members * (5 + 14 + 9));
+    out_zquery(out, &job->it, true, job->limit);
 }
 
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
+static void do_zquery(std::vector<std::string_view> &cmd, Buffer &out) {
     // parse args
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_BAD_ARG, "expect floating point number");
     }
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t _offset = 0, limit = 0;
     if (!str2int(cmd[4], _offset) || !str2int(cmd[5], limit)) {
         return out_err(out, ERR_BAD_ARG, "expect int");
     }
 
     // get the zset
-    ZSet *zset = expect_zset(cmd[1]);
+    Entry *ent = NULL;
+    ZSet *zset = expect_zset(cmd[1], ent);
     if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
 
     // seek key
     if (limit <= 0) { return out_arr(out, 0); }
-    ZNode *znode = seekge(zset, score, name.data(), name.size());
-    znode = offset(znode, _offset);
-
-    // output
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while (znode && n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = offset(znode, +1);
-        n += 2;
+    ZIter it;
+    bool ok = seekge(zset, score, name.data(), name.size(), &it) &&
+              offset(&it, _offset);
+
+    // many members in the thread pool, the set is kept while it's read
+    int64_t left = ok ? 2 * ((int64_t)size(zset) - rank(&it)) : 0;
+    if ((size_t)std::min(left, limit) > k_async_reply_elems && can_suspend()) {
+        ReplyJob *job = new ReplyJob();
+        job->it = it;
+        job->limit = std::min(left, limit);
+        reply_queue(job, &zquery_run);
+        ent->zset_read_seq = job->async.read_seq;
+        return;
     }
-    out_end_arr(out, ctx, (uint32_t)n);
+    out_zquery(out, &it, ok, limit);
 }
 
-// Step 2: Process the command
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
-    } else {
-        return out_err(out, ERR_UNKNOWN, "unknown command");
+// ZRANK zset name, from the subtree counts
+static void do_zrank(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+
+    ZIter it;
+    if (!lookup(zset, cmd[2].data(), cmd[2].size(), &it)) {
+        return out_nil(out);
     }
+    int64_t r = rank(&it);
+    if (cmd_eq("zrevrank", cmd[0])) { r = (int64_t)size(zset) - 1 - r; }
+    return out_int(out, r);
 }
 
-// Step 3: Serialize the response
-static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();    // message header position
-    buf_append_u32(out, 0);  // reserve space
+// a score bound: a number, [+-]inf, or an exclusive '(' number. The range is
+// made inclusive, the exclusive bound is moved to the next double.
+static bool str2bound(std::string_view s, bool is_min, double &out) {
+    bool exclusive = !s.empty() && s[0] == '(';
+    if (exclusive) { s.remove_prefix(1); }
+    if (!str2dbl(s, out)) { return false; }
+    if (exclusive) { out = nextafter(out, is_min ? INFINITY : -INFINITY); }
+    return true;
 }
 
-static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+// the first member >= min
+static bool zseek_min(ZSet *zset, double min, ZIter *it) {
+    return seekge(zset, min, "", 0, it);
 }
 
-static void response_end(Buffer &out, size_t header) {
-    size_t msg_size = response_size(out, header);
-    if (msg_size > k_max_msg) {
-        out.resize(header + 4);
-        out_err(out, ERR_TOO_BIG, "response is too big");
-        msg_size = response_size(out, header);
+// the last member <= max
+static bool zseek_max(ZSet *zset, double max, ZIter *it) {
+    if (max != INFINITY && seekge(zset, nextafter(max, INFINITY), "", 0, it)) {
+        return prev(it);
     }
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
+    return at(zset, (int64_t)size(zset) - 1, it);
 }
 
-// the handling is split into try_one_request(). If there is not enough data, it
-// will do nothing until a future loop iteration process 1 request if there is
-// enough data
-static bool try_one_request(Conn *conn) {
-    // Step 3: Try to parse the accumulated buffer
-    // Protocol: message header
-    if (conn->incoming.size() < 4) {
-        return false;  // want read
+// ZCOUNT zset min max, the difference of 2 ranks
+static void do_zcount(std::vector<std::string_view> &cmd, Buffer &out) {
+    double min = 0, max = 0;
+    if (!str2bound(cmd[2], true, min) || !str2bound(cmd[3], false, max)) {
+        return out_err(out, ERR_BAD_ARG, "min or max is not a float");
     }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
 
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
-    if (len > k_max_msg) {  // protocol error
-        msg("too long");
-        conn->want_close = true;
-        return false;  // want close
+    ZIter first, last;
+    if (!zseek_min(zset, min, &first) || !zseek_max(zset, max, &last)) {
+        return out_int(out, 0);
     }
+    int64_t n = rank(&last) - rank(&first) + 1;
+    return out_int(out, n > 0 ? n : 0);
+}
 
-    // Protocol: message body
-    if (4 + len > conn->incoming.size()) {
-        return false;  // want read
+struct RangeArgs {
+    bool withscores = false;
+    int64_t offset = 0;
+    int64_t count = -1;  // negative for all
+};
+
+// [WITHSCORES] [LIMIT offset count]
+static bool parse_range_args(std::vector<std::string_view> &cmd, size_t pos,
+                             bool limit, RangeArgs &args) {
+    while (pos < cmd.size()) {
+        if (cmd_eq("withscores", cmd[pos])) {
+            args.withscores = true;
+            pos++;
+        } else if (limit && cmd_eq("limit", cmd[pos]) &&
+                   pos + 2 < cmd.size()) {
+            if (!str2int(cmd[pos + 1], args.offset) ||
+                !str2int(cmd[pos + 2], args.count)) {
+                return false;
+            }
+            pos += 3;
+        } else {
+            return false;
+        }
     }
+    return true;
+}
 
-    const uint8_t *request = &conn->incoming[4];
-
-    // Step 4: Process the parsed message
-    // got one request, do some application logic
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        msg("bad request");
-        conn->want_close = true;
-        return false;  // want close
+// output the members from 'it' in either direction, while in [min, max]
+static void out_zrange(Buffer &out, ZIter *it, bool ok, bool rev, double min,
+                       double max, const RangeArgs &args) {
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    int64_t left = args.count;
+    while (ok && left != 0 && it->score >= min && it->score <= max) {
+        out_str(out, it->name, it->len);
+        if (args.withscores) { out_dbl(out, it->score); }
+        n += args.withscores ? 2 : 1;
+        left--;
+        ok = rev ? prev(it) : next(it);
+    }
+    out_end_arr(out, ctx, n);
+}
+
+// ZRANGEBYSCORE zset min max [WITHSCORES] [LIMIT offset count]
+// ZREVRANGEBYSCORE zset max min [WITHSCORES] [LIMIT offset count]
+// The offset is skipped by rank, the rest is iterated.
+static void do_zrangebyscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    bool rev = cmd_eq("zrevrangebyscore", cmd[0]);
+    double min = 0, max = 0;
+    if (!str2bound(cmd[rev ? 3 : 2], true, min) ||
+        !str2bound(cmd[rev ? 2 : 3], false, max)) {
+        return out_err(out, ERR_BAD_ARG, "min or max is not a float");
+    }
+    RangeArgs args;
+    if (!parse_range_args(cmd, 4, true, args)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+
+    ZIter it;
+    bool ok = rev ? zseek_max(zset, max, &it) : zseek_min(zset, min, &it);
+    int64_t skip = rev ? -args.offset : args.offset;
+    ok = ok && args.offset >= 0 && offset(&it, skip);
+    return out_zrange(out, &it, ok, rev, min, max, args);
+}
+
+// ZREVRANGE zset start stop [WITHSCORES], by rank from the highest score
+static void do_zrevrange(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    RangeArgs args;
+    if (!parse_range_args(cmd, 4, false, args)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+
+    // negative ranks are from the end
+    int64_t n = (int64_t)size(zset);
+    if (start < 0) { start = std::max(start + n, (int64_t)0); }
+    if (stop < 0) { stop += n; }
+    stop = std::min(stop, n - 1);
+    args.count = stop - start + 1;
+
+    ZIter it;
+    bool ok = start <= stop && at(zset, n - 1 - start, &it);
+    return out_zrange(out, &it, ok, true, -INFINITY, INFINITY, args);
+}
+
+/*
+ * ZUNIONSTORE/ZINTERSTORE. The members of the sources are split into
+ * partitions by the hash of the name, so all the members of 1 name are in 1
+ * partition. Each partition scans all the sources and keeps its own members.
+ * A partition is sorted by name to aggregate each name, then by (score, name).
+ * The sorted partitions are merged and the set is built bottom-up.
+ *
+ * A large job runs the partitions in parallel in the thread pool, the future
+ * of the partitions merges them. The job is a reader, see async_read(), so the
+ * workers scan the sources in place and the event loop only looks up the keys.
+ * The connection waits like for another shard, and the event loop publishes
+ * the set when the job shows up in its mailbox.
+ */
+enum {
+    AGG_SUM = 0,
+    AGG_MIN = 1,
+    AGG_MAX = 2,
+};
+
+// a member of a source, the name is in 'ZStorePart::names'
+struct ZStoreItem {
+    uint64_t hcode = 0;
+    double score = 0;  // weighted
+    uint32_t src = 0;  // the index of the source
+    uint32_t len = 0;
+    size_t pos = 0;
+};
+
+struct ZStoreJob;
+
+// the members of all sources that hash to 1 partition
+struct ZStorePart {
+    ZStoreJob *job = NULL;
+    size_t idx = 0;  // the members with 'hcode % nparts == idx'
+    std::string names;
+    std::vector<ZStoreItem> items;
+    std::vector<ZPair> out;  // the aggregated members, in zless() order
+};
+
+struct ZStoreJob {
+    AsyncJob async;  // the future is of the partitions
+    std::string dest;
+    bool inter = false;
+    int aggregate = AGG_SUM;
+    std::vector<ZSet *> srcs;
+    std::vector<double> weights;  // 1 per source
+    std::vector<ZStorePart> parts;
+    ZSet result;
+};
+
+// the options after the keys
+struct ZStoreArgs {
+    std::vector<std::string_view> keys;
+    std::vector<double> weights;  // 1 per key
+    int aggregate = AGG_SUM;
+};
+
+// NULL or the error message
+static const char *parse_zstore_args(std::vector<std::string_view> &cmd,
+                                     ZStoreArgs &args) {
+    int64_t numkeys = 0;
+    if (!str2int(cmd[2], numkeys) || numkeys < 1) {
+        return "numkeys should be greater than 0";
+    }
+    if ((uint64_t)numkeys > cmd.size() - 3) { return "syntax error"; }
+    args.keys.assign(cmd.begin() + 3, cmd.begin() + 3 + numkeys);
+    args.weights.assign(numkeys, 1);
+    for (size_t pos = 3 + numkeys; pos < cmd.size();) {
+        if (cmd_eq("weights", cmd[pos]) && pos + numkeys < cmd.size()) {
+            for (int64_t i = 0; i < numkeys; ++i) {
+                if (!str2dbl(cmd[pos + 1 + i], args.weights[i])) {
+                    return "weight value is not a float";
+                }
+            }
+            pos += 1 + numkeys;
+        } else if (cmd_eq("aggregate", cmd[pos]) && pos + 1 < cmd.size()) {
+            std::string_view agg = cmd[pos + 1];
+            if (cmd_eq("sum", agg)) {
+                args.aggregate = AGG_SUM;
+            } else if (cmd_eq("min", agg)) {
+                args.aggregate = AGG_MIN;
+            } else if (cmd_eq("max", agg)) {
+                args.aggregate = AGG_MAX;
+            } else {
+                return "syntax error";
+            }
+            pos += 2;
+        } else {
+            return "syntax error";
+        }
+    }
+    return NULL;
+}
+
+// copy the members of the partition out of the sources
+static void zstore_scan(ZStorePart *part) {
+    ZStoreJob *job = part->job;
+    size_t nparts = job->parts.size();
+    size_t total = 0;
+    for (ZSet *zset : job->srcs) { total += size(zset); }
+    part->items.reserve(total / nparts + total / nparts / 8 + 16);
+    for (uint32_t src = 0; src < job->srcs.size(); ++src) {
+        ZIter it;
+        for (bool ok = at(job->srcs[src], 0, &it); ok; ok = next(&it)) {
+            // the tree encoding has the hash already
+            uint64_t hcode = it.node ? it.node->hmap.hcode
+                                     : hash((const uint8_t *)it.name, it.len);
+            if (hcode % nparts != part->idx) { continue; }
+            ZStoreItem item;
+            item.hcode = hcode;
+            item.score = it.score * job->weights[src];
+            if (isnan(item.score)) { item.score = 0; }  // inf * 0
+            item.src = src;
+            item.len = (uint32_t)it.len;
+            item.pos = part->names.size();
+            part->names.append(it.name, it.len);
+            part->items.push_back(item);
+        }
+    }
+}
+
+static double zstore_agg(int aggregate, double acc, double score) {
+    if (aggregate == AGG_MIN) { return std::min(acc, score); }
+    if (aggregate == AGG_MAX) { return std::max(acc, score); }
+    acc += score;
+    return isnan(acc) ? 0 : acc;  // inf + -inf
+}
+
+// aggregate the members of each name in the partition
+static void zstore_part(ZStorePart *part) {
+    ZStoreJob *job = part->job;
+    const char *names = part->names.data();
+    std::vector<ZStoreItem> &items = part->items;
+    // by name, then in the order of the sources
+    auto same = [names](const ZStoreItem &lhs, const ZStoreItem &rhs) {
+        return lhs.hcode == rhs.hcode && lhs.len == rhs.len &&
+               0 == memcmp(names + lhs.pos, names + rhs.pos, lhs.len);
+    };
+    std::sort(items.begin(), items.end(),
+              [names](const ZStoreItem &lhs, const ZStoreItem &rhs) {
+                  if (lhs.hcode != rhs.hcode) { return lhs.hcode < rhs.hcode; }
+                  if (lhs.len != rhs.len) { return lhs.len < rhs.len; }
+                  int rv = memcmp(names + lhs.pos, names + rhs.pos, lhs.len);
+                  return rv != 0 ? rv < 0 : lhs.src < rhs.src;
+              });
+
+    for (size_t i = 0, j = 0; i < items.size(); i = j) {
+        double score = items[i].score;
+        for (j = i + 1; j < items.size() && same(items[i], items[j]); ++j) {
+            score = zstore_agg(job->aggregate, score, items[j].score);
+        }
+        if (job->inter && j - i < job->srcs.size()) { continue; }
+        part->out.push_back(ZPair{score, names + items[i].pos, items[i].len});
+    }
+    std::vector<ZStoreItem>().swap(items);
+    std::sort(part->out.begin(), part->out.end(),
+              [](const ZPair &lhs, const ZPair &rhs) {
+                  return zless(lhs, rhs);
+              });
+}
+
+// merge the sorted partitions in log2(n) rounds and build the set
+static void zstore_finish(ZStoreJob *job) {
+    std::vector<ZPair> pairs;
+    std::vector<size_t> ends;  // of the sorted runs
+    for (ZStorePart &part : job->parts) {
+        pairs.insert(pairs.end(), part.out.begin(), part.out.end());
+        ends.push_back(pairs.size());
+    }
+    while (ends.size() > 1) {
+        std::vector<size_t> merged;
+        for (size_t i = 0; i < ends.size(); i += 2) {
+            if (i + 1 < ends.size()) {
+                size_t begin = i > 0 ? ends[i - 1] : 0;
+                std::inplace_merge(pairs.begin() + begin,
+                                   pairs.begin() + ends[i],
+                                   pairs.begin() + ends[i + 1],
+                                   [](const ZPair &lhs, const ZPair &rhs) {
+                                       return zless(lhs, rhs);
+                                   });
+            }
+            merged.push_back(ends[std::min(i + 1, ends.size() - 1)]);
+        }
+        ends.swap(merged);
+    }
+    build(&job->result, pairs.data(), pairs.size());
+    // the names are copied, free them here rather than on the event loop
+    std::vector<ZStorePart>().swap(job->parts);
+}
+
+// a partition in the thread pool
+static void zstore_run(void *arg) {
+    ZStorePart *part = (ZStorePart *)arg;
+    zstore_scan(part);
+    zstore_part(part);
+}
+
+// after the last partition, still in the thread pool
+static void zstore_then(Future *fut) {
+    AsyncJob *async = container_of(fut, AsyncJob, fut);
+    zstore_finish(container_of(async, ZStoreJob, async));
+}
+
+// replace the destination key with the result, an empty result deletes it
+static int64_t zstore_publish(ZStoreJob *job) {
+    LookupKey key;
+    key.key = job->dest;
+    key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
+    if (Entry *ent = entry_lookup(key)) {
+        HashNode *node = del(&g_data.db, &ent->node, &same);
+        assert(node == &ent->node);
+        (void)node;
+        del(ent);
+    }
+    int64_t n = (int64_t)size(&job->result);
+    if (n > 0) {
+        Entry *ent = entry_new(T_ZSET, key.key, key.node.hcode, 0);
+        std::swap(*ent->zset, job->result);
+        insert(&g_data.db, &ent->node);
+    }
+    clear(&job->result);
+    return n;
+}
+
+static uint32_t shard_of(std::string_view key);
+
+// back in the event loop
+static void zstore_done(AsyncJob *async, Buffer &out) {
+    ZStoreJob *job = container_of(async, ZStoreJob, async);
+    int64_t n = zstore_publish(job);
+    delete job;
+    out_int(out, n);
+}
+
+// ZUNIONSTORE dest numkeys key [key ...] [WEIGHTS weight ...]
+//     [AGGREGATE SUM | MIN | MAX]
+// ZINTERSTORE, same arguments
+static void do_zstore(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZStoreArgs args;
+    if (const char *err = parse_zstore_args(cmd, args)) {
+        return out_err(out, ERR_BAD_ARG, err);
+    }
+    // the sources, in the shard of the destination
+    std::vector<ZSet *> srcs;
+    std::vector<Entry *> ents;  // NULL for a missing key
+    size_t total = 0;
+    for (std::string_view key : args.keys) {
+        if (g_server.nshards > 1 && shard_of(key) != g_data.shard_id) {
+            return out_err(out, ERR_BAD_ARG, "keys in different shards");
+        }
+        Entry *ent = NULL;
+        ZSet *zset = expect_zset(key, ent);
+        if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+        srcs.push_back(zset);
+        ents.push_back(ent);
+        total += size(zset);
+    }
+
+    // large inputs in parallel, if the request can wait
+    bool async = can_suspend() && total > k_zstore_async;
+    size_t nthreads = g_data.thread_pool.workers.size();
+    size_t nparts = async ? std::max(nthreads, (size_t)1) : 1;
+    ZStoreJob *job = new ZStoreJob();
+    job->dest = cmd[1];
+    job->inter = cmd_eq("zinterstore", cmd[0]);
+    job->aggregate = args.aggregate;
+    job->srcs.swap(srcs);
+    job->weights.swap(args.weights);
+    job->parts.resize(nparts);
+    for (size_t i = 0; i < nparts; ++i) {
+        job->parts[i].job = job;
+        job->parts[i].idx = i;
+    }
+
+    if (!async) {
+        zstore_scan(&job->parts[0]);
+        zstore_part(&job->parts[0]);
+        zstore_finish(job);
+        int64_t n = zstore_publish(job);
+        delete job;
+        return out_int(out, n);
+    }
+    async_begin(&job->async, (uint32_t)nparts);
+    async_read(&job->async);
+    job->async.fut.then = &zstore_then;
+    job->async.done = &zstore_done;
+    // an update copies the sets, the workers keep reading the old ones
+    for (Entry *ent : ents) {
+        if (ent) { ent->zset_read_seq = job->async.read_seq; }
+    }
+    for (ZStorePart &part : job->parts) {
+        queue(&g_data.thread_pool, &zstore_run, &part, &job->async.fut);
+    }
+}
+
+// glob-style pattern matching for SCAN MATCH
+// a single char or a [...] class, returns the position after it
+static size_t glob_token(std::string_view pat, size_t p, uint8_t c, bool &ok) {
+    if (pat[p] == '?') {
+        ok = true;
+        return p + 1;
+    }
+    if (pat[p] == '\\' && p + 1 < pat.size()) {
+        ok = (uint8_t)pat[p + 1] == c;
+        return p + 2;
+    }
+    if (pat[p] != '[') {
+        ok = (uint8_t)pat[p] == c;
+        return p + 1;
+    }
+    // [abc] [^abc] [a-z]
+    size_t i = p + 1;
+    bool negate = i < pat.size() && pat[i] == '^';
+    if (negate) { i++; }
+    bool found = false;
+    for (; i < pat.size() && pat[i] != ']'; i++) {
+        if (pat[i] == '\\' && i + 1 < pat.size()) {
+            found |= (uint8_t)pat[++i] == c;
+        } else if (i + 2 < pat.size() && pat[i + 1] == '-' &&
+                   pat[i + 2] != ']') {
+            uint8_t lo = (uint8_t)pat[i], hi = (uint8_t)pat[i + 2];
+            if (lo > hi) { std::swap(lo, hi); }
+            found |= lo <= c && c <= hi;
+            i += 2;
+        } else {
+            found |= (uint8_t)pat[i] == c;
+        }
+    }
+    ok = found != negate;
+    return i < pat.size() ? i + 1 : i;  // skip the ']'
+}
+
+// '*' backtracks to the last star only, so it's O(n*m) at worst
+static bool glob_match(std::string_view pat, std::string_view str) {
+    size_t p = 0, s = 0;
+    size_t star_p = std::string_view::npos, star_s = 0;
+    while (s < str.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star_p = ++p;  // try to match nothing first
+            star_s = s;
+            continue;
+        }
+        bool ok = false;
+        size_t next = p < pat.size() ? glob_token(pat, p, str[s], ok) : p;
+        if (ok) {
+            p = next;
+            s++;
+        } else if (star_p != std::string_view::npos) {
+            p = star_p;  // the last star eats 1 more char
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*') { p++; }
+    return p == pat.size();
+}
+
+// the options after the cursor: [MATCH pattern] [COUNT n]
+struct ScanArgs {
+    bool match = false;
+    std::string_view pattern;
+    int64_t count = 10;
+};
+
+static bool parse_scan_args(std::vector<std::string_view> &cmd, size_t pos,
+                            ScanArgs &args) {
+    for (; pos + 1 < cmd.size(); pos += 2) {
+        if (cmd_eq("match", cmd[pos])) {
+            args.match = true;
+            args.pattern = cmd[pos + 1];
+        } else if (cmd_eq("count", cmd[pos])) {
+            if (!str2int(cmd[pos + 1], args.count) || args.count < 1) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return pos == cmd.size();
+}
+
+static void cb_collect(HashNode *node, void *arg) {
+    ((std::vector<HashNode *> *)arg)->push_back(node);
+}
+
+// call scan() until about 'count' nodes are collected
+static uint64_t scan_some(HashMap *hmap, uint64_t cursor, int64_t count,
+                          std::vector<HashNode *> &nodes) {
+    int64_t iters = 0;  // bound the work if most slots are empty
+    do {
+        cursor = scan(hmap, cursor, &cb_collect, &nodes);
+    } while (cursor && (int64_t)nodes.size() < count && ++iters < count * 10);
+    return cursor;
+}
+
+// SCAN cursor [MATCH pattern] [COUNT n]
+// The low bits of the cursor are the shard, the rest is the hashtable cursor
+static void do_scan(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor) || cursor < 0 ||
+        (uint64_t)cursor % k_max_shards != g_data.shard_id) {
+        return out_err(out, ERR_BAD_ARG, "invalid cursor");
+    }
+    ScanArgs args;
+    if (!parse_scan_args(cmd, 2, args)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+
+    std::vector<HashNode *> nodes;
+    uint64_t next = scan_some(&g_data.db, (uint64_t)cursor / k_max_shards,
+                              args.count, nodes);
+    if (next != 0) {
+        next = next * k_max_shards + g_data.shard_id;
+    } else if (g_data.shard_id + 1 < g_server.nshards) {
+        next = g_data.shard_id + 1;  // continue with the next shard
+    }
+
+    out_arr(out, 2);
+    out_int(out, (int64_t)next);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    uint64_t now_ms = get_monotonic_msec();
+    for (HashNode *node : nodes) {
+        Entry *ent = container_of(node, Entry, node);
+        if (entry_expired(ent, now_ms)) { continue; }
+        std::string_view key = entry_key(ent);
+        if (args.match && !glob_match(args.pattern, key)) { continue; }
+        out_str(out, key.data(), key.size());
+        n++;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+// ZSCAN key cursor [MATCH pattern] [COUNT n]
+static void do_zscan(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t cursor = 0;
+    if (!str2int(cmd[2], cursor) || cursor < 0) {
+        return out_err(out, ERR_BAD_ARG, "invalid cursor");
+    }
+    ScanArgs args;
+    if (!parse_scan_args(cmd, 3, args)) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) { return out_err(out, ERR_BAD_TYP, "expect zset"); }
+
+    std::vector<std::pair<std::string_view, double>> items;
+    uint64_t next = 0;
+    if (zset->index) {
+        std::vector<HashNode *> nodes;
+        next = scan_some(&zset->index->hmap, (uint64_t)cursor, args.count,
+                         nodes);
+        for (HashNode *node : nodes) {
+            ZNode *znode = container_of(node, ZNode, hmap);
+            std::string_view name(znode->name, znode->len);
+            items.emplace_back(name, znode->score);
+        }
+    } else {
+        // a listpack is small, all of it at once
+        ZIter it;
+        for (bool ok = at(zset, 0, &it); ok; ok = offset(&it, +1)) {
+            items.emplace_back(std::string_view(it.name, it.len), it.score);
+        }
+    }
+
+    out_arr(out, 2);
+    out_int(out, (int64_t)next);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (auto &item : items) {
+        if (args.match && !glob_match(args.pattern, item.first)) { continue; }
+        out_str(out, item.first.data(), item.first.size());
+        out_dbl(out, item.second);
+        n += 2;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+static void cb_sample(HashNode *node, void *arg) {
+    size_t *total = (size_t *)arg;
+    ZNode *znode = container_of(node, ZNode, hmap);
+    total[0] += slab_usable_size(sizeof(ZNode) + znode->len);
+    total[1]++;
+}
+
+// the zset nodes are sampled instead of visiting all of them
+static size_t zset_mem_usage(ZSet *zset) {
+    size_t bytes = slab_usable_size(sizeof(ZSet));
+    if (!zset->index) { return bytes + malloc_usable_size(zset->lp); }
+
+    ZIndex *index = zset->index;
+    bytes += slab_usable_size(sizeof(ZIndex)) + mem_usage(&index->hmap) +
+             mem_usage(&index->tree);
+    size_t n = size(&index->hmap);
+    size_t sample[2] = {0, 0};  // bytes, count
+    uint64_t cursor = 0;
+    do {
+        cursor = scan(&index->hmap, cursor, &cb_sample, sample);
+    } while (cursor && sample[1] < k_mem_samples);
+    if (sample[1] > 0) { bytes += sample[0] * n / sample[1]; }
+    return bytes;
+}
+
+// MEMORY USAGE key, the bytes allocated for a key and its value
+static void do_memory(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (!cmd_eq("usage", cmd[1])) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    LookupKey key;
+    key.key = cmd[2];
+    key.node.hcode = hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_lookup(key);
+    if (!ent) { return out_nil(out); }
+
+    size_t bytes = slab_usable_size(entry_size(ent));
+    bytes += 1 + sizeof(HashNode *);  // the hashtable slot
+    if (ent->type == T_ZSET) {
+        bytes += zset_mem_usage(ent->zset);
+    } else if (!str_is_inline(ent)) {
+        bytes += malloc_usable_size(ent->str.ptr);
+    }
+    return out_int(out, (int64_t)bytes);
+}
+
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out);
+
+// Step 2: Process the command
+// The command table. Each command is found in O(1) with a hash of its name
+// instead of a chain of string compares.
+static Command g_cmds[] = {
+    {"get", &do_get, 2, CMD_READONLY | CMD_KEYS},
+    {"set", &do_set, 3, CMD_WRITE | CMD_KEYS},
+    {"del", &do_del, 2, CMD_WRITE | CMD_KEYS},
+    {"pexpire", &do_expire, 3, CMD_WRITE | CMD_KEYS},
+    {"pttl", &do_ttl, 2, CMD_READONLY | CMD_KEYS},
+    {"keys", &do_keys, 1, CMD_READONLY | CMD_ALL_SHARDS},
+    {"zadd", &do_zadd, -4, CMD_WRITE | CMD_KEYS},
+    {"zrem", &do_zrem, 3, CMD_WRITE | CMD_KEYS},
+    {"zscore", &do_zscore, 3, CMD_READONLY | CMD_KEYS},
+    {"zquery", &do_zquery, 6, CMD_READONLY | CMD_KEYS},
+    {"zrank", &do_zrank, 3, CMD_READONLY | CMD_KEYS},
+    {"zrevrank", &do_zrank, 3, CMD_READONLY | CMD_KEYS},
+    {"zcount", &do_zcount, 4, CMD_READONLY | CMD_KEYS},
+    {"zrangebyscore", &do_zrangebyscore, -4, CMD_READONLY | CMD_KEYS},
+    {"zrevrangebyscore", &do_zrangebyscore, -4, CMD_READONLY | CMD_KEYS},
+    {"zrevrange", &do_zrevrange, -4, CMD_READONLY | CMD_KEYS},
+    {"zunionstore", &do_zstore, -4, CMD_WRITE | CMD_KEYS},
+    {"zinterstore", &do_zstore, -4, CMD_WRITE | CMD_KEYS},
+    {"scan", &do_scan, -2, CMD_READONLY | CMD_CURSOR},
+    {"zscan", &do_zscan, -3, CMD_READONLY | CMD_KEYS},
+    {"memory", &do_memory, 3, CMD_READONLY | CMD_KEYS, 2},
+    {"info", &do_info, -1, CMD_READONLY},
+};
+
+const size_t k_num_cmds = sizeof(g_cmds) / sizeof(g_cmds[0]);
+// open addressing, at most half full so the probe sequences are short
+const size_t k_cmd_slots = 64;
+static_assert(k_num_cmds * 2 <= k_cmd_slots, "grow k_cmd_slots");
+static Command *g_cmd_index[k_cmd_slots];
+
+static uint8_t lower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+// FNV, case-insensitive
+static size_t cmd_hash(std::string_view name) {
+    uint32_t h = 0x811C9DC5;
+    for (char c : name) { h = (h + lower((uint8_t)c)) * 0x01000193; }
+    return h;
+}
+
+static bool cmd_eq(const char *name, std::string_view s) {
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (name[i] == '\0' || name[i] != lower((uint8_t)s[i])) {
+            return false;
+        }
+    }
+    return name[s.size()] == '\0';
+}
+
+static void cmd_init() {
+    for (size_t i = 0; i < k_num_cmds; ++i) {
+        Command *c = &g_cmds[i];
+        size_t pos = cmd_hash(c->name) & (k_cmd_slots - 1);
+        while (g_cmd_index[pos]) { pos = (pos + 1) & (k_cmd_slots - 1); }
+        g_cmd_index[pos] = c;
+    }
+}
+
+static Command *cmd_lookup(std::string_view name) {
+    size_t pos = cmd_hash(name) & (k_cmd_slots - 1);
+    while (Command *c = g_cmd_index[pos]) {
+        if (cmd_eq(c->name, name)) { return c; }
+        pos = (pos + 1) & (k_cmd_slots - 1);
+    }
+    return NULL;
+}
+
+// INFO [section]
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out) {
+    std::string_view section = cmd.size() > 1 ? cmd[1] : "";
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    if (section.empty() || cmd_eq("commandstats", section)) {
+        for (size_t i = 0; i < k_num_cmds; ++i) {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "cmdstat_%s:calls=%llu",
+                               g_cmds[i].name,
+                               (unsigned long long)__atomic_load_n(
+                                   &g_cmds[i].calls, __ATOMIC_RELAXED));
+            out_str(out, line, (size_t)len);
+            n++;
+        }
+    }
+    if (section.empty() || cmd_eq("memory", section)) {
+        // of all shards, from the allocator
+        struct mallinfo2 mi = mallinfo2();
+        char line[128];
+        int len = snprintf(line, sizeof(line), "used_memory:%zu", mi.uordblks);
+        out_str(out, line, (size_t)len);
+        n++;
+        len = snprintf(line, sizeof(line), "db_keys:%zu", size(&g_data.db));
+        out_str(out, line, (size_t)len);
+        n++;
+        len = snprintf(line, sizeof(line), "db_rehashing:%d",
+                       (int)is_rehashing(&g_data.db));
+        out_str(out, line, (size_t)len);
+        n++;
+    }
+    if (section.empty() || cmd_eq("stats", section)) {
+        // of this shard
+        ExpireStats &st = g_data.expire;
+        uint64_t now_us = get_monotonic_usec();
+        expire_rate_update(now_us);
+        char line[128];
+        int len = snprintf(line, sizeof(line),
+                           "expired_keys:%llu,per_sec=%llu",
+                           (unsigned long long)st.expired,
+                           (unsigned long long)st.per_sec);
+        out_str(out, line, (size_t)len);
+        n++;
+        len = snprintf(line, sizeof(line), "expire_lag_ms:%llu,max=%llu",
+                       (unsigned long long)expire_lag_ms(now_us / 1000),
+                       (unsigned long long)st.max_lag_ms);
+        out_str(out, line, (size_t)len);
+        n++;
+        len = snprintf(line, sizeof(line), "expire_cycle_budget_us:%llu",
+                       (unsigned long long)st.budget_us);
+        out_str(out, line, (size_t)len);
+        n++;
+    }
+    if (section.empty() || cmd_eq("threads", section)) {
+        // of this shard, the utilization since the start
+        const char *names[] = {"thread_pool", "io_pool"};
+        ThreadPool *pools[] = {&g_data.thread_pool, &g_data.io_pool};
+        std::vector<WorkerStats> workers;
+        for (size_t i = 0; i < 2; ++i) {
+            stats(pools[i], workers);
+            for (size_t w = 0; w < workers.size(); ++w) {
+                const WorkerStats &st = workers[w];
+                uint64_t total_ns = st.busy_ns + st.idle_ns;
+                char line[128];
+                int len = snprintf(
+                    line, sizeof(line),
+                    "%s_%zu:tasks=%llu,steals=%llu,busy_pct=%.1f", names[i],
+                    w, (unsigned long long)st.tasks,
+                    (unsigned long long)st.steals,
+                    total_ns ? 100.0 * st.busy_ns / total_ns : 0.0);
+                out_str(out, line, (size_t)len);
+                n++;
+            }
+        }
+    }
+    if (section.empty() || cmd_eq("slab", section)) {
+        SlabStats stats[k_slab_num_classes];
+        slab_stats(stats);
+        for (const SlabStats &st : stats) {
+            if (st.slabs == 0) { continue; }
+            char line[128];
+            int len = snprintf(line, sizeof(line),
+                               "slab_%zu:slabs=%zu,live=%zu,free=%zu",
+                               st.obj_size, st.slabs, st.live, st.free);
+            out_str(out, line, (size_t)len);
+            n++;
+        }
+    }
+    out_end_arr(out, ctx, n);
+}
+
+static bool cmd_arity_ok(Command *c, size_t n) {
+    return c->arity > 0 ? n == (size_t)c->arity : n >= (size_t)-c->arity;
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Buffer &out) {
+    Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c) { return out_err(out, ERR_UNKNOWN, "unknown command"); }
+    if (!cmd_arity_ok(c, cmd.size())) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments");
+    }
+
+    // shared by all shards
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+    return c->f(cmd, out);
+}
+
+// Step 3: Serialize the response
+static void response_begin(Buffer &out, size_t *header) {
+    *header = buf_size(out);  // message header position
+    buf_append_u32(out, 0);  // reserve space
+}
+
+static size_t response_size(Buffer &out, size_t header) {
+    return buf_size(out) - header - 4;
+}
+
+static void response_end(Buffer &out, size_t header) {
+    size_t msg_size = response_size(out, header);
+    if (msg_size > k_max_msg) {
+        buf_truncate(out, header + 4);
+        out_err(out, ERR_TOO_BIG, "response is too big");
+        msg_size = response_size(out, header);
+    }
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(&buf_data(out)[header], &len, 4);
+}
+
+// the handling is split into try_one_request(). If there is not enough data, it
+// will do nothing until a future loop iteration process 1 request if there is
+// enough data
+static bool try_forward(Conn *conn, std::vector<std::string_view> &cmd,
+                        const uint8_t *request, uint32_t len);
+
+static bool try_one_request(Conn *conn) {
+    if (conn->blocked) {
+        return false;  // wait for the reply from another shard
+    }
+    // Step 3: Try to parse the accumulated buffer
+    // Protocol: message header
+    if (buf_size(conn->incoming) < 4) {
+        return false;  // want read
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, buf_data(conn->incoming), 4);
+    if (len > k_max_msg) {  // protocol error
+        msg("too long");
+        conn->want_close = true;
+        return false;  // want close
+    }
+
+    // Protocol: message body
+    if (4 + len > buf_size(conn->incoming)) {
+        return false;  // want read
+    }
+
+    const uint8_t *request = buf_data(conn->incoming) + 4;
+
+    // Step 4: Process the parsed message
+    // got one request, do some application logic
+    std::vector<std::string_view> &cmd = conn->args;
+    cmd.clear();  // reuse the capacity
+    if (parse_req(request, len, cmd) < 0) {
+        msg("bad request");
+        conn->want_close = true;
+        return false;  // want close
+    }
+
+    // the key is owned by another shard, the request is sent there
+    bool forwarded = try_forward(conn, cmd, request, len);
+    if (!forwarded) {
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        g_data.cur_conn = conn;
+        do_request(cmd, conn->outgoing);
+        g_data.cur_conn = NULL;
+        if (conn->blocked) {
+            // waiting for the thread pool, the response is written later
+            buf_truncate(conn->outgoing, header_pos);
+        } else {
+            response_end(conn->outgoing, header_pos);
+        }
     }
 
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
-
     // Step 5: Remove the message from 'Conn:incoming'
     buf_consume(conn->incoming, 4 + len);
-    return true;  // Success
+    // the views are dangling now. Don't keep the capacity of a huge request
+    cmd.clear();
+    if (cmd.capacity() > k_max_kept_args) {
+        std::vector<std::string_view>().swap(cmd);
+    }
+    return !conn->blocked;  // Success
 }
 
 // Protocol parser with non-blocking read
@@ -603,69 +1963,111 @@ static bool try_one_request(Conn *conn) {
  *    4B   ....    4B   ....
  */
 
-static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+static void handle_incoming(Conn *conn);
+
+// returns true if all of 'outgoing' is written
+static bool write_outgoing(Conn *conn) {
+    assert(!buf_empty(conn->outgoing));
+    ssize_t rv = write(conn->fd, buf_data(conn->outgoing),
+                       buf_size(conn->outgoing));
 
     if (rv < 0 && errno == EAGAIN) {
-        return;  // actually not ready
+        return false;  // actually not ready
     }
 
     if (rv < 0) {
         msg_errno("write() error");
         conn->want_close = true;  // error handling
-        return;
+        return false;
     }
 
     // remove written data from 'outgoing'
     buf_consume(conn->outgoing, (size_t)rv);
 
     // update the readiness intention
-    if (conn->outgoing.size() == 0) {  // all data is written
-                                       // Step 2: Written 1 response
-        conn->want_read = true;        // Step 3: Wait for more data
-        conn->want_write = false;
-    }  // else: want write
+    if (!buf_empty(conn->outgoing)) {
+        return false;  // want write
+    }
+    // all data is written
+    // Step 2: Written 1 response
+    conn->want_read = true;  // Step 3: Wait for more data
+    conn->want_write = false;
+    return true;
 }
 
-static void handle_read(Conn *conn) {
-    // Step 1: Do a non-blocking read
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+static void handle_write(Conn *conn) {
+    if (write_outgoing(conn) && !buf_empty(conn->incoming)) {
+        // requests that were held back, e.g. by a reply from another shard
+        handle_incoming(conn);
+    }
+}
+
+// shared by all backends, once new data is in 'Conn::incoming'
+static void handle_incoming(Conn *conn) {
+    // Step 3: Try to parse the accumulated buffer
+    // Step 4: Process the parsed message
+    // Step 5: Remove the message from 'Conn::incoming'
+
+    // Add pipelining, parse requests and generate responses
+    while (try_one_request(conn)) {}  // ASSUMPTION: at most 1 request
+
+    // update the readiness intention
+    if (!buf_empty(conn->outgoing)) {  // has a response
+                                       // Step 1: Process 1 request
+        conn->want_read = false;
+        conn->want_write = true;
+    }  // else: want read
+}
+
+// how much to read into 'Conn::incoming'. If a large request is partially
+// received, make room for all of it, so it's read straight into its final
+// place instead of being copied piece by piece
+static size_t read_size(Conn *conn) {
+    size_t n = k_read_size;
+    size_t have = buf_size(conn->incoming);
+    if (have >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, buf_data(conn->incoming), 4);
+        if (len <= k_max_msg && 4 + len > have + n) { n = 4 + len - have; }
+    }
+    return n;
+}
+
+// returns false if there is no new data
+static bool read_incoming(Conn *conn) {
+    // Step 1: Do a non-blocking read, directly into 'Conn::incoming'
+    Buffer &in = conn->incoming;
+    uint8_t *dst = buf_reserve(in, read_size(conn));
+    ssize_t rv = read(conn->fd, dst, buf_space(in));
     if (rv < 0 && errno == EAGAIN) {
-        return;  // actually not ready
+        return false;  // actually not ready
     }
     // handle IO error
     if (rv < 0) {
         msg_errno("read() error");
         conn->want_close = true;
-        return;  // want close
+        return false;  // want close
     }
     // handle EOF
     if (rv == 0) {
-        if (conn->incoming.size() == 0) {
+        if (buf_empty(in)) {
             msg("client closed");
         } else {
             msg("unexpected EOF");
         }
         conn->want_close = true;
-        return;  // want close
+        return false;  // want close
     }
 
     // Step 2: Add new data to the 'Conn::incoming' buffer
-    buf_append(conn->incoming, buf, (size_t)rv);
-    // Step 3: Try to parse the accumulated buffer
-    // Step 4: Process the parsed message
-    // Step 5: Remove the message from 'Conn::incoming'
-
-    // Add pipelining, parse requests and generate responses
-    while (try_one_request(conn)) {}  // ASSUMPTION: at most 1 request
+    buf_commit(in, (size_t)rv);
+    return true;
+}
 
-    // update the readiness intention
-    if (conn->outgoing.size() > 0) {  // has a response
-                                      // Step 1: Process 1 request
-        conn->want_read = false;
-        conn->want_write = true;
+static void handle_read(Conn *conn) {
+    if (!read_incoming(conn)) { return; }
+    handle_incoming(conn);
+    if (conn->want_write) {
         // The socket is likely ready to write in a request-response protocol.
         // try to write without waiting for the next iteration
         return handle_write(conn);  // optimization
@@ -677,15 +2079,16 @@ static uint32_t next_timer_ms() {
     uint64_t next_ms = (uint64_t)-1;
 
     // idle timer using a linked list
-    if (is_empty(&g_data.idle_list)) {
+    if (!is_empty(&g_data.idle_list)) {
         Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
         next_ms = conn->last_active_ms + k_idle_timeout_ms;
     }
 
-    // TTL timers using a heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-        next_ms = g_data.heap[0].val;
-    }
+    // TTL timers using a heap or a timing wheel
+    next_ms = std::min(next_ms, ttl_next_ms());
+
+    // continue the background rehashing without waiting
+    if (is_rehashing(&g_data.db)) { next_ms = now_ms; }
 
     // timeout value
     if (next_ms == (uint64_t)-1) {
@@ -699,9 +2102,74 @@ static uint32_t next_timer_ms() {
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool same(HashNode *node, HashNode *key) { return node == key; }
+static void uring_close(Conn *conn);
+
+static void conn_close(Conn *conn) {
+    conn->want_close = true;
+    if (conn->blocked) {
+        // the reply from another shard or the thread pool refers to this
+        // 'Conn', free it later. Stop watching it and remove it from the idle
+        // timers meanwhile
+        unwatch(&g_data.loop, conn->fd);
+        detach(&conn->idle_node);
+        init(&conn->idle_node);
+    } else if (g_data.loop.backend == EV_BACKEND_URING) {
+        uring_close(conn);
+    } else {
+        destroy(conn);
+    }
+}
+
+// Move the keyspace to the new table in the background, a quiet keyspace
+// doesn't keep 2 tables forever and the operations do less of it. More time
+// is spent on it if there was nothing else to do.
+static void process_rehashing(bool idle) {
+    if (!is_rehashing(&g_data.db)) { return; }
+    uint64_t budget_us = idle ? k_rehash_idle_us : k_rehash_busy_us;
+    uint64_t start_us = get_monotonic_usec();
+    while (rehash_step(&g_data.db, k_rehash_step_work)) {
+        if (get_monotonic_usec() - start_us >= budget_us) { break; }
+    }
+}
 
-static void process_timers() {
+// Delete the expired keys in the order of the TTLs, under a time budget.
+// A mass expiry is spread over several cycles: the budget doubles while there
+// are expired keys left over and the loop runs the next cycle without waiting
+// (see next_timer_ms()). If clients are being served, the expiry gets at most
+// k_expire_cpu_pct of the time.
+static void process_expire(bool idle) {
+    ExpireStats &st = g_data.expire;
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t now_ms = start_us / 1000;
+    uint64_t budget_us = st.budget_us;
+    if (!idle) {
+        uint64_t busy_us = start_us - st.cycle_end_us;
+        uint64_t fair_us =
+            busy_us * k_expire_cpu_pct / (100 - k_expire_cpu_pct);
+        budget_us = std::min(budget_us, std::max(fair_us, k_expire_min_us));
+    }
+    st.max_lag_ms = std::max(st.max_lag_ms, expire_lag_ms(now_ms));
+
+    size_t nwork = 0;
+    while (Entry *ent = ttl_first_expired(now_ms)) {
+        expire_key(ent);
+        if (++nwork % k_expire_step_work == 0 &&
+            get_monotonic_usec() - start_us >= budget_us) {
+            break;  // don't stall the server if too many keys are expiring
+        }
+    }
+
+    // adapt to the share of the expired keys that is left
+    if (expire_lag_ms(now_ms) > 0) {
+        st.budget_us = std::min(st.budget_us * 2, k_expire_max_us);
+    } else {
+        st.budget_us = std::max(st.budget_us / 2, k_expire_min_us);
+    }
+    st.cycle_end_us = get_monotonic_usec();
+    expire_rate_update(st.cycle_end_us);
+}
+
+static void process_timers(bool idle) {
     uint64_t now_ms = get_monotonic_msec();
     // idle timers using a linked list
     while (!is_empty(&g_data.idle_list)) {
@@ -712,31 +2180,387 @@ static void process_timers() {
         }
 
         fprintf(stderr, "removing idle connection: %d\n", conn->fd);
-        destroy(conn);
+        conn_close(conn);
     }
-    // TTL timers using a heap
-    size_t nworks = 0;
-    const std::vector<HeapItem> &heap = g_data.heap;
-    while (!heap.empty() && heap[0].val < now_ms) {
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        HashNode *node = del(&g_data.db, &ent->node, &same);
-        assert(node == &ent->node);
-        fprintf(stderr, "Key expired: %s\n", ent->key.c_str());
-        // delete the key
-        del(ent);
-        if (nworks++ >= k_max_works) {
-            // don't stall the server if too many keys are expiring at once
-            break;
+    // TTL timers using a heap or a timing wheel
+    process_expire(idle);
+}
+
+// tell the event loop about the application's intent. It's only a syscall
+// with epoll when 'want_read'/'want_write' actually flipped
+static void update_interest(Conn *conn) {
+    uint32_t flags = 0;
+    if (conn->want_read) { flags |= EV_READ; }
+    if (conn->want_write) { flags |= EV_WRITE; }
+    watch(&g_data.loop, conn->fd, flags);
+}
+
+// update the idle timer by moving conn to  the end of the list
+static void touch(Conn *conn) {
+    conn->last_active_ms = get_monotonic_msec();
+    detach(&conn->idle_node);
+    insert_before(&g_data.idle_list, &conn->idle_node);
+}
+
+static void handle_conn(const Event &ev) {
+    Conn *conn = g_data.fd2conn[ev.fd];
+    if (!conn) { return; }
+    touch(conn);
+
+    // read and write logic
+    if ((ev.flags & EV_READ) && conn->want_read) {
+        handle_read(conn);  // application logic
+    }
+    if ((ev.flags & EV_WRITE) && conn->want_write) {
+        handle_write(conn);  // application logic
+    }
+
+    // Step 5: Terminate connections
+    // close the socket from socket error on application logic
+    if ((ev.flags & EV_ERR) || conn->want_close) {
+        conn_close(conn);
+    } else {
+        update_interest(conn);
+    }
+}
+
+/*
+ * io_uring backend. Instead of a readiness event followed by read()/write(),
+ * the operations themselves are queued and completed by the kernel:
+ * - 1 multishot accept for the listening socket.
+ * - 1 multishot recv per connection, the data lands in a provided buffer.
+ * - at most 1 send per connection, covering all the pipelined responses.
+ * All the SQEs queued in a loop iteration are submitted by the same
+ * io_uring_enter() that waits for the next completions.
+ *
+ * The 'Conn' state machine is unchanged: requests are only processed in the
+ * 'want_read' state, data received while a send is in flight is buffered.
+ */
+enum {
+    OP_ACCEPT = 1,
+    OP_RECV = 2,
+    OP_SEND = 3,
+    OP_WAKE = 4,  // the mailbox eventfd is readable
+};
+const uint64_t k_op_mask = 7;  // 'Conn' is 8-byte aligned
+
+static uint64_t op_data(Conn *conn, uint64_t op) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_close(Conn *conn) {
+    conn->want_close = true;
+    if (conn->uring_ops == 0) { return destroy(conn); }
+    // the 'Conn' is freed later, remove it from the idle timers now
+    detach(&conn->idle_node);
+    init(&conn->idle_node);
+    // terminate the pending operations, they complete with an error or EOF
+    (void)shutdown(conn->fd, SHUT_RDWR);
+}
+
+// move the pending responses to 'Conn::sending' and send them in one go
+static void uring_send(Conn *conn) {
+    if (!buf_empty(conn->sending) || buf_empty(conn->outgoing)) { return; }
+    swap(conn->sending, conn->outgoing);
+    prep_send(&g_data.loop.ring, conn->fd, buf_data(conn->sending),
+              buf_size(conn->sending), op_data(conn, OP_SEND));
+    conn->uring_ops++;
+}
+
+static void uring_accept(int connfd) {
+    if (connfd < 0) {
+        errno = -connfd;
+        msg_errno("accept() error");
+        return;
+    }
+    fprintf(stderr, "New client fd %d\n", connfd);
+    Conn *conn = conn_new(connfd);
+    prep_recv_multishot(&g_data.loop.ring, connfd, op_data(conn, OP_RECV));
+    conn->uring_ops++;
+}
+
+static void uring_recv(Conn *conn, int32_t res, uint32_t flags) {
+    Uring *ring = &g_data.loop.ring;
+    if (flags & IORING_CQE_F_BUFFER) {
+        // Step 2: Add new data to the 'Conn::incoming' buffer
+        uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        if (res > 0 && !conn->want_close) {
+            buf_append(conn->incoming, buf_get(ring, bid), (size_t)res);
         }
+        buf_recycle(ring, bid);  // give it back to the kernel
     }
+
+    if (res == 0) {
+        msg(buf_empty(conn->incoming) ? "client closed" : "unexpected EOF");
+        conn->want_close = true;
+    } else if (res < 0 && res != -ENOBUFS) {
+        errno = -res;
+        msg_errno("recv() error");
+        conn->want_close = true;
+    }
+    if (conn->want_close) { return; }
+
+    // re-arm, it stops on ENOBUFS or when the kernel decides so
+    if (!(flags & IORING_CQE_F_MORE)) {
+        prep_recv_multishot(ring, conn->fd, op_data(conn, OP_RECV));
+        conn->uring_ops++;
+    }
+    if (conn->want_read) { handle_incoming(conn); }
+    uring_send(conn);
 }
 
-// core part of server
-int main() {
-    // initialization
-    init(&g_data.idle_list);
-    init(&g_data.thread_pool, 4);
+static void uring_sent(Conn *conn, int32_t res) {
+    if (res < 0) {
+        errno = -res;
+        msg_errno("send() error");
+        conn->want_close = true;
+        return;
+    }
+    buf_consume(conn->sending, (size_t)res);
+    if (!buf_empty(conn->sending)) {
+        // short send, continue with the rest
+        prep_send(&g_data.loop.ring, conn->fd, buf_data(conn->sending),
+                  buf_size(conn->sending), op_data(conn, OP_SEND));
+        conn->uring_ops++;
+        return;
+    }
+    if (buf_empty(conn->outgoing)) {  // all data is written
+        conn->want_read = true;    // Step 3: Wait for more data
+        conn->want_write = false;
+        // the requests that arrived while sending
+        handle_incoming(conn);
+    }
+    uring_send(conn);
+}
+
+static void handle_mailbox();
+
+static void handle_cqe(int fd, const struct io_uring_cqe *cqe) {
+    uint64_t op = cqe->user_data & k_op_mask;
+    if (op == OP_WAKE) {
+        handle_mailbox();
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {  // re-arm
+            prep_poll_multishot(&g_data.loop.ring, my_mailbox()->fd, OP_WAKE);
+        }
+        return;
+    }
+    if (op == OP_ACCEPT) {
+        uring_accept(cqe->res);
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {  // re-arm
+            prep_accept_multishot(&g_data.loop.ring, fd, OP_ACCEPT);
+        }
+        return;
+    }
+
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~k_op_mask);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->uring_ops--;  // this operation is done
+    }
+    if (!conn->want_close) { touch(conn); }
+
+    if (op == OP_RECV) {
+        uring_recv(conn, cqe->res, cqe->flags);
+    } else {
+        assert(op == OP_SEND);
+        uring_sent(conn, cqe->res);
+    }
+
+    // Step 5: Terminate connections
+    if (conn->want_close) { conn_close(conn); }
+}
+
+static void uring_loop(int fd) {
+    Uring *ring = &g_data.loop.ring;
+    prep_accept_multishot(ring, fd, OP_ACCEPT);
+    // from other shards and the thread pool
+    prep_poll_multishot(ring, my_mailbox()->fd, OP_WAKE);
+    while (true) {
+        // submit the queued operations and wait for completions
+        int32_t timeout_ms = next_timer_ms();
+        int rv = wait(ring, timeout_ms);
+        if (rv < 0 && errno == EINTR) {
+            continue;  // not an error
+        }
+        if (rv < 0) { die("io_uring_enter()"); }
+
+        // reap the completions
+        bool idle = true;
+        while (struct io_uring_cqe *cqe = peek(ring)) {
+            struct io_uring_cqe copy = *cqe;
+            advance(ring);
+            handle_cqe(fd, &copy);
+            idle = false;
+        }
+        process_timers(idle);     // handle timers
+        process_rehashing(idle);  // background work
+    }
+}
+
+/*
+ * Sharded mode. Each event loop thread owns a shard of the keyspace, with its
+ * own listening socket (SO_REUSEPORT lets the kernel spread the connections),
+ * its own hashtable, TTL heap and idle list. There are no locks: a request
+ * for a key owned by another shard is copied into a message and sent to the
+ * owner's mailbox. The owner executes it and sends the response back. The
+ * connection processes no other request meanwhile, so the responses stay in
+ * order.
+ */
+static Mailbox *my_mailbox() { return &g_server.mailboxes[g_data.shard_id]; }
+
+static uint32_t shard_of(std::string_view key) {
+    uint64_t h = hash((const uint8_t *)key.data(), key.size());
+    // don't use the low bits, they select the hashtable slot in the shard
+    return (uint32_t)(((h * 0x9E3779B97F4A7C15ull) >> 32) % g_server.nshards);
+}
+
+static uint32_t next_shard(uint32_t shard) {
+    return (shard + 1) % g_server.nshards;
+}
+
+static void send_msg(uint32_t shard, ShardMsg *m) {
+    push(&g_server.mailboxes[shard], &m->node);
+}
+
+// called before executing a request, returns true if it's sent elsewhere
+static bool try_forward(Conn *conn, std::vector<std::string_view> &cmd,
+                        const uint8_t *request, uint32_t len) {
+    if (g_server.nshards == 1 || cmd.empty()) { return false; }
+    Command *c = cmd_lookup(cmd[0]);
+    if (!c || !cmd_arity_ok(c, cmd.size())) {
+        return false;  // the error is reported locally
+    }
+
+    uint32_t dst = g_data.shard_id;
+    uint32_t type = 0;
+    if (c->flags & CMD_KEYS) {
+        dst = shard_of(cmd[c->key_pos]);
+        type = MSG_REQ;
+    } else if (c->flags & CMD_CURSOR) {
+        int64_t cursor = 0;
+        if (!str2int(cmd[1], cursor) || cursor < 0) {
+            return false;  // the error is reported locally
+        }
+        dst = (uint32_t)((uint64_t)cursor % k_max_shards);
+        if (dst >= g_server.nshards) { return false; }
+        type = MSG_REQ;
+    } else if (c->flags & CMD_ALL_SHARDS) {
+        dst = next_shard(g_data.shard_id);  // visit each shard in turn
+        type = MSG_KEYS;
+        __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);  // no do_request()
+    }
+    if (dst == g_data.shard_id) { return false; }
+
+    ShardMsg *m = new ShardMsg();
+    m->type = type;
+    m->src = g_data.shard_id;
+    m->conn = conn;
+    m->req.assign((const char *)request, len);  // 'cmd' points to 'incoming'
+    conn->blocked = true;
+    send_msg(dst, m);
+    return true;
+}
 
+// the owner shard executes the request
+static void shard_exec(ShardMsg *m) {
+    std::vector<std::string_view> cmd;
+    int32_t err = parse_req((const uint8_t *)m->req.data(), m->req.size(), cmd);
+    assert(err == 0);  // already checked by the sender
+    (void)err;
+
+    size_t header_pos = 0;
+    response_begin(m->out, &header_pos);
+    g_data.cur_msg = m;
+    do_request(cmd, m->out);
+    g_data.cur_msg = NULL;
+    if (m->blocked) {
+        // waiting for the thread pool, sent back by async_done()
+        buf_truncate(m->out, header_pos);
+        return;
+    }
+    response_end(m->out, header_pos);
+
+    m->type = MSG_RES;
+    send_msg(m->src, m);
+}
+
+// the response of a blocked connection is in 'outgoing', flush it and continue
+// with the pipelined requests
+static void conn_resume(Conn *conn) {
+    conn->blocked = false;
+    if (conn->want_close) { return conn_close(conn); }
+    conn->want_read = false;  // the response must be written first
+    conn->want_write = true;
+    if (g_data.loop.backend == EV_BACKEND_URING) {
+        uring_send(conn);
+        return;
+    }
+    handle_write(conn);
+    if (conn->want_close) {
+        conn_close(conn);
+    } else {
+        update_interest(conn);
+    }
+}
+
+// the response is back in the connection's shard
+static void shard_reply(ShardMsg *m) {
+    Conn *conn = m->conn;
+    if (m->type == MSG_KEYS) {
+        // all the other shards are visited, add the local keys
+        keys_append(m->out, &m->count);
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        out_arr(conn->outgoing, m->count);
+        buf_append(conn->outgoing, buf_data(m->out), buf_size(m->out));
+        response_end(conn->outgoing, header_pos);
+    } else if (buf_empty(conn->outgoing)) {
+        swap(conn->outgoing, m->out);  // a large response isn't copied
+    } else {
+        buf_append(conn->outgoing, buf_data(m->out), buf_size(m->out));
+    }
+    delete m;
+    conn_resume(conn);
+}
+
+// the thread pool is done, respond to the suspended request
+static void async_done(AsyncJob *job) {
+    Conn *conn = job->msg.conn;
+    ShardMsg *req = job->req;
+    Buffer &out = req ? req->out : conn->outgoing;
+    if (job->read_seq) { async_read_end(job); }
+    size_t header_pos = 0;
+    response_begin(out, &header_pos);
+    job->done(job, out);  // the job is freed
+    response_end(out, header_pos);
+    if (req) {
+        req->blocked = false;
+        req->type = MSG_RES;
+        send_msg(req->src, req);
+    } else {
+        conn_resume(conn);
+    }
+}
+
+static void handle_mailbox() {
+    MailboxNode *node = pop_all(my_mailbox());
+    while (node) {
+        ShardMsg *m = container_of(node, ShardMsg, node);
+        node = node->next;
+        if (m->type == MSG_REQ) {
+            shard_exec(m);
+        } else if (m->type == MSG_KEYS && m->src != g_data.shard_id) {
+            keys_append(m->out, &m->count);
+            send_msg(next_shard(g_data.shard_id), m);
+        } else if (m->type == MSG_DONE) {
+            async_done(container_of(m, AsyncJob, msg));
+        } else {
+            shard_reply(m);
+        }
+    }
+}
+
+// Step 1 - 4: a listening socket
+static int listen_socket() {
     // Step 1: Obtain a socket handle
     /*
      * +------------+----------------------------------+
@@ -759,6 +2583,10 @@ int main() {
      * 4th argument is the option value
      */
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (g_server.nshards > 1) {
+        // 1 listening socket per shard on the same port
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
 
     // Step 3: Bind to and address
     // struct sockaddr_in holds IPv4:port pair stored as big-endian numbers,
@@ -778,73 +2606,323 @@ int main() {
     // the socket is created after listen()
     rv = listen(fd, SOMAXCONN);
     if (rv) { die("listen()"); }
+    return fd;
+}
+
+/*
+ * Threaded I/O. The syscalls and the parsing are done by the I/O threads, the
+ * requests are still executed by the event loop thread, one at a time, so the
+ * data structures need no locks. For each batch of ready connections:
+ *   1. The I/O threads read() and parse all complete requests.
+ *   2. The event loop thread executes them in order.
+ *   3. The I/O threads write() the responses.
+ * The event loop thread takes a share of the work and waits for the rest, so
+ * a connection is only touched by 1 thread at a time.
+ */
+
+// 1. runs in an I/O thread: split and parse the complete requests in
+// 'Conn::incoming', without executing or consuming them
+static void parse_incoming(Conn *conn) {
+    const uint8_t *data = buf_data(conn->incoming);
+    size_t size = buf_size(conn->incoming);
+    size_t pos = 0;
+    while (size - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, data + pos, 4);
+        if (len > k_max_msg) {  // protocol error
+            msg("too long");
+            conn->want_close = true;
+            break;
+        }
+        if (4 + len > size - pos) {
+            break;  // want read
+        }
+        size_t nargs = conn->args.size();
+        if (parse_req(data + pos + 4, len, conn->args) < 0) {
+            msg("bad request");
+            conn->want_close = true;
+            break;
+        }
+        nargs = conn->args.size() - nargs;
+        conn->parsed.push_back(ParsedReq{len, (uint32_t)nargs});
+        pos += 4 + len;
+    }
+}
+
+static void io_read(Conn *conn) {
+    if (read_incoming(conn)) { parse_incoming(conn); }
+}
+
+// 2. the event loop thread: execute the parsed requests in order. The ones
+// after a suspended request are left in 'incoming', they're executed by
+// handle_incoming() when it's resumed
+static void exec_parsed(Conn *conn) {
+    std::vector<std::string_view> &cmd = g_data.io_cmd;
+    std::vector<std::string_view>::iterator arg = conn->args.begin();
+    for (const ParsedReq &req : conn->parsed) {
+        if (conn->blocked) { break; }
+        cmd.assign(arg, arg + req.nargs);
+        arg += req.nargs;
+
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        g_data.cur_conn = conn;
+        do_request(cmd, conn->outgoing);
+        g_data.cur_conn = NULL;
+        if (conn->blocked) {
+            buf_truncate(conn->outgoing, header_pos);  // written later
+        } else {
+            response_end(conn->outgoing, header_pos);
+        }
+        // the views stay valid, consuming doesn't move the data
+        buf_consume(conn->incoming, 4 + req.len);
+    }
+    cmd.clear();
+    conn->parsed.clear();
+    conn->args.clear();
+    if (conn->args.capacity() > k_max_kept_args) {
+        std::vector<std::string_view>().swap(conn->args);
+    }
+
+    // update the readiness intention
+    if (!buf_empty(conn->outgoing)) {
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+}
+
+// 3. runs in an I/O thread
+static void io_write(Conn *conn) { (void)write_outgoing(conn); }
 
-    // event loop
-    std::vector<struct pollfd> poll_args;
+// a share of the connections for 1 thread
+struct IOBatch {
+    void (*f)(Conn *) = NULL;
+    Conn **conns = NULL;
+    size_t n = 0;
+};
+
+static void io_batch_run(void *arg) {
+    IOBatch *b = (IOBatch *)arg;
+    for (size_t i = 0; i < b->n; ++i) {
+        b->f(b->conns[i]);
+    }
+}
+
+// split the connections among all threads and wait for them
+static void io_fanout(std::vector<Conn *> &conns, void (*f)(Conn *)) {
+    size_t nthreads = g_server.io_threads;
+    if (conns.size() < 2 * nthreads) {
+        // too few to be worth the handoff
+        for (Conn *conn : conns) { f(conn); }
+        return;
+    }
+    std::vector<IOBatch> batches(nthreads);
+    size_t step = (conns.size() + nthreads - 1) / nthreads;
+    for (size_t i = 0; i < nthreads; ++i) {
+        size_t begin = std::min(i * step, conns.size());
+        size_t end = std::min(begin + step, conns.size());
+        batches[i] = IOBatch{f, conns.data() + begin, end - begin};
+    }
+    for (size_t i = 1; i < nthreads; ++i) {
+        queue(&g_data.io_pool, &io_batch_run, &batches[i]);
+    }
+    io_batch_run(&batches[0]);  // the event loop thread does its share too
+    wait_idle(&g_data.io_pool);
+}
+
+static void collect_conn(const Event &ev, std::vector<Conn *> &reads,
+                         std::vector<Conn *> &writes) {
+    Conn *conn = g_data.fd2conn[ev.fd];
+    if (!conn) { return; }
+    touch(conn);
+    if (ev.flags & EV_ERR) {
+        conn_close(conn);
+    } else if ((ev.flags & EV_READ) && conn->want_read) {
+        reads.push_back(conn);
+    } else if ((ev.flags & EV_WRITE) && conn->want_write) {
+        writes.push_back(conn);
+    }
+}
+
+// the ready connections of 1 event loop iteration
+static void handle_conns_threaded(std::vector<Conn *> &reads,
+                                  std::vector<Conn *> &writes) {
+    io_fanout(reads, &io_read);
+    // a connection with a response moves to 'writes', so it's in only 1 list
+    // and isn't closed twice below
+    size_t nreads = 0;
+    for (Conn *conn : reads) {
+        exec_parsed(conn);
+        if (conn->want_write && !conn->want_close) {
+            writes.push_back(conn);
+        } else {
+            reads[nreads++] = conn;
+        }
+    }
+    reads.resize(nreads);
+    // the responses are likely writable now, don't wait for the next iteration
+    io_fanout(writes, &io_write);
+
+    for (std::vector<Conn *> *list : {&reads, &writes}) {
+        for (Conn *conn : *list) {
+            if (conn->want_close) {
+                conn_close(conn);
+            } else {
+                update_interest(conn);
+            }
+        }
+    }
+    reads.clear();
+    writes.clear();
+}
+
+// the readiness-based event loop, poll() or epoll
+static void event_loop(int fd) {
+    // the listening socket is always watched for new connections
+    watch(&g_data.loop, fd, EV_READ);
+    // the mailbox, from other shards and the thread pool
+    int wake_fd = my_mailbox()->fd;
+    watch(&g_data.loop, wake_fd, EV_READ);
+
+    // threaded I/O: the connections of 1 iteration
+    bool threaded = g_server.io_threads > 1;
+    std::vector<Conn *> reads, writes;
 
     // Step 5: Accept connections
     while (true) {
-        // Step 1: Construct the fd list for 'poll()'
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // put the listening sockets in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
-        // the rest are connection sockets
-        for (Conn *conn : g_data.fd2conn) {
-            if (!conn) { continue; }
-
-            // always poll() for error
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            // poll() flags from the application's intent
-            if (conn->want_read) { pfd.events |= POLLIN; }
-            if (conn->want_write) { pfd.events |= POLLOUT; }
-            poll_args.push_back(pfd);
-        }
-        // Step 2: Call 'poll()'
         // wait for readiness
         int32_t timeout_ms = next_timer_ms();
-        // poll is the only blocking syscall in the entire program.
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+        // this is the only blocking syscall in the entire program.
+        int rv = wait(&g_data.loop, timeout_ms);
         if (rv < 0 && errno == EINTR) {
             continue;  // not an error
         }
 
-        if (rv < 0) { die("poll"); }
+        if (rv < 0) { die("wait()"); }
+
+        // only the ready fds are visited
+        bool woken = false;
+        for (const Event &ev : g_data.loop.ready) {
+            if (ev.fd == fd) {
+                handle_accept(fd);  // accept new connections
+            } else if (ev.fd == wake_fd) {
+                woken = true;
+            } else if (threaded) {
+                collect_conn(ev, reads, writes);  // handled in a batch
+            } else {
+                handle_conn(ev);  // invoke application callbacks
+            }
+        }
+        if (threaded) { handle_conns_threaded(reads, writes); }
+        // after the batch, a resumed connection may be closed
+        if (woken) { handle_mailbox(); }  // other shards, the thread pool
+        bool idle = g_data.loop.ready.empty();
+        process_timers(idle);     // handle timers
+        process_rehashing(idle);  // background work
+    }  // the event loop
+}
 
-        // Step 3: Accept new connections
-        // handle the listening socket
-        if (poll_args[0].revents) { handle_accept(fd); }
+// each shard runs in its own thread
+static void *reactor(void *arg) {
+    g_data.shard_id = (uint32_t)(uintptr_t)arg;
 
-        // Step 4: Invoke application callbacks
-        // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i) {  // note: skip the 1st
-            uint32_t ready = poll_args[i].revents;
-            if (ready == 0) { continue; }
+    // initialization
+    init(&g_data.idle_list);
+    init(&g_data.readers);
+    init(&g_data.wheel, get_monotonic_msec());
+    init(&g_data.thread_pool, g_server.nshards > 1 ? 1 : 4);
+    init(&g_data.io_pool, g_server.io_threads - 1);
+    int backend = g_server.backend;
+    if (backend == EV_BACKEND_URING && !init(&g_data.loop, backend)) {
+        msg("falling back to epoll");
+        backend = EV_BACKEND_EPOLL;
+    }
+    if (backend == EV_BACKEND_EPOLL && !init(&g_data.loop, backend)) {
+        msg("falling back to poll()");
+        backend = EV_BACKEND_POLL;
+    }
+    if (backend == EV_BACKEND_POLL) { init(&g_data.loop, backend); }
 
-            Conn *conn = g_data.fd2conn[poll_args[i].fd];
+    int fd = listen_socket();
+    if (g_data.loop.backend == EV_BACKEND_URING) {
+        uring_loop(fd);
+    } else {
+        event_loop(fd);
+    }
+    return NULL;  // never returns
+}
 
-            // update the idle timer by moving conn to  the end of the list
-            conn->last_active_ms = get_monotonic_msec();
-            detach(&conn->idle_node);
-            insert_before(&g_data.idle_list, &conn->idle_node);
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [--poll | --epoll | --uring]"
+            " [--threads N | --io-threads N] [--ttl-wheel]"
+            " [--zset-max-listpack-entries N] [--zset-max-listpack-value N]\n",
+            argv0);
+    exit(1);
+}
 
-            // read and write logic
-            if (ready & POLLIN) {
-                assert(conn->want_read);
-                handle_read(conn);  // application logic
-            }
-            if (ready & POLLOUT) {
-                assert(conn->want_write);
-                handle_write(conn);  // application logic
+// core part of server
+int main(int argc, char **argv) {
+    // the event loop backend, epoll unless asked otherwise
+    int backend = EV_BACKEND_EPOLL;
+    uint32_t nshards = 1;
+    uint32_t io_threads = 1;
+    int ttl = TTL_HEAP;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--poll")) {
+            backend = EV_BACKEND_POLL;
+        } else if (0 == strcmp(argv[i], "--epoll")) {
+            backend = EV_BACKEND_EPOLL;
+        } else if (0 == strcmp(argv[i], "--uring")) {
+            backend = EV_BACKEND_URING;
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nshards = (uint32_t)atoi(argv[++i]);
+            if (nshards < 1 || nshards > k_max_shards) { usage(argv[0]); }
+        } else if (0 == strcmp(argv[i], "--io-threads") && i + 1 < argc) {
+            io_threads = (uint32_t)atoi(argv[++i]);
+            if (io_threads < 1 || io_threads > k_max_io_threads) {
+                usage(argv[0]);
             }
+        } else if (0 == strcmp(argv[i], "--ttl-wheel")) {
+            ttl = TTL_WHEEL;
+        } else if (0 == strcmp(argv[i], "--zset-max-listpack-entries") &&
+                   i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0) { usage(argv[0]); }
+            g_zset_limits.max_entries = (size_t)n;
+        } else if (0 == strcmp(argv[i], "--zset-max-listpack-value") &&
+                   i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0 || n > 255) { usage(argv[0]); }
+            g_zset_limits.max_value = (size_t)n;
+        } else {
+            usage(argv[0]);
+        }
+    }
 
-            // Step 5: Terminate connections
-            // close the socket from socket error on application logic
-            if ((ready & POLLERR) || conn->want_close) { destroy(conn); }
-        }  // for each connection sockets
-        process_timers();  // handle timers
-    }  // the event loop
+    // threaded I/O is for the readiness-based loops of a single shard
+    if (io_threads > 1 && (nshards > 1 || backend == EV_BACKEND_URING)) {
+        usage(argv[0]);
+    }
 
+    // shared by all threads, set up before any of them is started
+    hash_seed_init();
+    cmd_init();
+    g_server.backend = backend;
+    g_server.nshards = nshards;
+    g_server.io_threads = io_threads;
+    g_server.ttl = ttl;
+    g_server.mailboxes.resize(nshards);
+    for (uint32_t i = 0; i < nshards; ++i) {
+        init(&g_server.mailboxes[i]);
+    }
+
+    // shard 0 runs in the main thread
+    for (uint32_t i = 1; i < nshards; ++i) {
+        pthread_t th;
+        int rv = pthread_create(&th, NULL, &reactor, (void *)(uintptr_t)i);
+        if (rv) { die("pthread_create()"); }
+    }
+    reactor(NULL);
     return 0;
 }
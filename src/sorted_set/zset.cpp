@@ -2,17 +2,23 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+// C++
+#include <algorithm>
+#include <new>
+#include <vector>
 // proj
+#include "../alloc/slab.h"
 #include "../common/common.h"
 #include "zset.h"
 
+ZSetLimits g_zset_limits;
+
 static ZNode *znode_new(const char *name, size_t len, double score) {
     //  C++ doesn't know about flexible arrays, so can't new the struct.
-    // need to use allocating function malloc(), paired with deallocating
+    // need to use allocating function slab_alloc(), paired with deallocating
     // function to avoid memory leak
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);  // struct + array
-    init(&node->tree);
-    node->hmap.next = NULL;
+    ZNode *node = (ZNode *)slab_alloc(sizeof(ZNode) + len);  // struct + array
+    node->tree = BItem();
     node->hmap.hcode = hash((uint8_t *)name, len);
     node->score = score;
     node->len = len;
@@ -20,125 +26,406 @@ static ZNode *znode_new(const char *name, size_t len, double score) {
     return node;
 }
 
-static void del(ZNode *node) { free(node); }
+static void del(ZNode *node) { slab_free(node, sizeof(ZNode) + node->len); }
 
 static size_t min(size_t lhs, size_t rhs) { return lhs < rhs ? lhs : rhs; }
 
+// names are ordered by bytes, then by length
+static int name_cmp(const char *lhs, size_t llen, const char *rhs,
+                    size_t rlen) {
+    int rv = memcmp(lhs, rhs, min(llen, rlen));
+    if (rv != 0) { return rv; }
+    return llen < rlen ? -1 : (llen > rlen ? 1 : 0);
+}
+
+// (lhs.score, lhs.name) < (score, name)
+static bool zless(const ZIter *lhs, double score, const char *name,
+                  size_t len) {
+    if (lhs->score != score) { return lhs->score < score; }
+    return name_cmp(lhs->name, lhs->len, name, len) < 0;
+}
+
+// Part 1: The listpack encoding
+// An entry is | score 8 | len 1 | name | len 1 |, the length at the end is
+// for iterating backwards.
+const size_t k_lp_overhead = sizeof(double) + 2;
+
+static size_t lp_entry_size(size_t len) { return k_lp_overhead + len; }
+
+// decode the entry at 'pos'
+static void lp_load(ZIter *it, uint32_t pos, uint32_t idx) {
+    const uint8_t *e = &it->zset->lp[pos];
+    it->node = NULL;
+    it->pos = pos;
+    it->idx = idx;
+    memcpy(&it->score, e, sizeof(double));
+    it->len = e[sizeof(double)];
+    it->name = (const char *)&e[sizeof(double) + 1];
+}
+
+static bool lp_first(ZSet *zset, ZIter *it) {
+    it->zset = zset;
+    if (zset->lp_size == 0) { return false; }
+    lp_load(it, 0, 0);
+    return true;
+}
+
+static bool lp_next(ZIter *it) {
+    if (it->idx + 1 >= it->zset->lp_size) { return false; }
+    lp_load(it, it->pos + (uint32_t)lp_entry_size(it->len), it->idx + 1);
+    return true;
+}
+
+static bool lp_prev(ZIter *it) {
+    if (it->idx == 0) { return false; }
+    size_t len = it->zset->lp[it->pos - 1];  // the trailing length
+    lp_load(it, it->pos - (uint32_t)lp_entry_size(len), it->idx - 1);
+    return true;
+}
+
+static bool lp_lookup(ZSet *zset, const char *name, size_t len, ZIter *it) {
+    for (bool ok = lp_first(zset, it); ok; ok = lp_next(it)) {
+        if (it->len == len && 0 == memcmp(it->name, name, len)) { return true; }
+    }
+    return false;
+}
+
+// the first entry >= (score, name), or the end
+static uint32_t lp_lower_bound(ZSet *zset, double score, const char *name,
+                               size_t len, ZIter *it) {
+    for (bool ok = lp_first(zset, it); ok; ok = lp_next(it)) {
+        if (!zless(it, score, name, len)) { return it->pos; }
+    }
+    return zset->lp_bytes;
+}
+
+static void lp_reserve(ZSet *zset, size_t bytes) {
+    if (bytes <= zset->lp_cap) { return; }
+    size_t cap = zset->lp_cap + zset->lp_cap / 2;
+    cap = cap < bytes ? bytes : cap;
+    zset->lp = (uint8_t *)realloc(zset->lp, cap);
+    assert(zset->lp);
+    zset->lp_cap = (uint32_t)cap;
+}
+
+// write an entry at 'pos', the space is reserved
+static void lp_write(ZSet *zset, uint32_t pos, const char *name, size_t len,
+                     double score) {
+    size_t esize = lp_entry_size(len);
+    uint8_t *e = &zset->lp[pos];
+    memmove(e + esize, e, zset->lp_bytes - pos);
+    memcpy(e, &score, sizeof(double));
+    e[sizeof(double)] = (uint8_t)len;
+    memcpy(&e[sizeof(double) + 1], name, len);
+    e[esize - 1] = (uint8_t)len;
+    zset->lp_bytes += (uint32_t)esize;
+    zset->lp_size++;
+}
+
+static void lp_insert(ZSet *zset, const char *name, size_t len, double score) {
+    lp_reserve(zset, zset->lp_bytes + lp_entry_size(len));
+    ZIter it;
+    uint32_t pos = lp_lower_bound(zset, score, name, len, &it);
+    lp_write(zset, pos, name, len, score);
+}
+
+static void lp_del(ZIter *it) {
+    ZSet *zset = it->zset;
+    size_t esize = lp_entry_size(it->len);
+    uint8_t *e = &zset->lp[it->pos];
+    memmove(e, e + esize, zset->lp_bytes - it->pos - esize);
+    zset->lp_bytes -= (uint32_t)esize;
+    zset->lp_size--;
+    // give back the space after mass deletes
+    if (zset->lp_bytes < zset->lp_cap / 4) {
+        zset->lp_cap = zset->lp_bytes ? zset->lp_bytes * 2 : 0;
+        if (zset->lp_cap == 0) {
+            free(zset->lp);
+            zset->lp = NULL;
+        } else {
+            zset->lp = (uint8_t *)realloc(zset->lp, zset->lp_cap);
+            assert(zset->lp);
+        }
+    }
+}
+
+static void lp_clear(ZSet *zset) {
+    free(zset->lp);
+    zset->lp = NULL;
+    zset->lp_bytes = zset->lp_cap = zset->lp_size = 0;
+}
+
+// Part 2: The tree encoding
 static bool cmp(HashNode *node, HashNode *key) {
     ZNode *znode = container_of(node, ZNode, hmap);
     HashKey *hkey = container_of(key, HashKey, node);
     if (znode->len != hkey->len) { return false; }
-    return 0 == memcpy(znode->name, hkey->name, znode->len);
+    return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
-ZNode *lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->root) { return NULL; }
-
+static ZNode *lookup(ZIndex *index, const char *name, size_t len) {
     HashKey key;
     key.node.hcode = hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HashNode *found = lookup(&zset->hmap, &key.node, &cmp);
+    HashNode *found = lookup(&index->hmap, &key.node, &cmp);
     return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
-static bool zless(AVLNode *lhs, double score, const char *name, size_t len) {
-    ZNode *zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) { return zl->score < score; }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
-    return (rv != 0) ? (rv < 0) : (zl->len < len);
-}
+// the name of a key in the tree, the score is compared by the tree
+struct ZKey {
+    const char *name = NULL;
+    size_t len = 0;
+};
 
-//(lhs.score, lhs.name) < (rhs.score, rhs.name)
-static bool zless(AVLNode *lhs, AVLNode *rhs) {
-    ZNode *zr = container_of(rhs, ZNode, tree);
-    return zless(lhs, zr->score, zr->name, zr->len);
+// (item.name) vs (key.name) for the same score
+static int zcmp(BItem *item, const void *key) {
+    ZNode *zl = container_of(item, ZNode, tree);
+    const ZKey *zk = (const ZKey *)key;
+    return name_cmp(zl->name, zl->len, zk->name, zk->len);
 }
 
-static void insert(ZSet *zset, ZNode *node) {
-    AVLNode *parent = NULL;        // insert under this node
-    AVLNode **from = &zset->root;  // the incoming pointer to the next node
-    while (*from) {                // tree search
-        parent = *from;
-        from = zless(&node->tree, parent) ? &parent->left : &parent->right;
-    }
-
-    *from = &node->tree;  // attach the new node
-    node->tree.parent = parent;
-    zset->root = fix(&node->tree);
+static void insert(ZIndex *index, ZNode *node) {
+    ZKey key = {node->name, node->len};
+    insert(&index->tree, &node->tree, node->score, &key, &zcmp);
 }
 
-// detaching and re-inserting the AVL node will fi  the order if the score
+// detaching and re-inserting the tree item will fix the order if the score
 // changes
-static void update(ZSet *zset, ZNode *node, double score) {
-    // detach the tree node
-    zset->root = del(&node->tree);
-    init(&node->tree);
-    // reinsert the tree node
+static void update(ZIndex *index, ZNode *node, double score) {
+    if (node->score == score) { return; }
+    del(&index->tree, &node->tree);
     node->score = score;
-    insert(zset, node);
+    insert(index, node);
 }
 
-// must handle the case where the pair already exists
-bool insert(ZSet *zset, const char *name, size_t len, double score) {
-    if (ZNode *node = lookup(zset, name, len)) {
-        update(zset, node, score);
-        return false;
-    }
-
+static void add(ZIndex *index, const char *name, size_t len, double score) {
     ZNode *node = znode_new(name, len, score);
-    insert(&zset->hmap, &node->hmap);
-    insert(zset, node);
-    return true;
+    insert(&index->hmap, &node->hmap);
+    insert(index, node);
 }
 
-// no need to search-and-delete function because delete can be done with node
-// reference
-void del(ZSet *zset, ZNode *node) {
+static void del(ZIndex *index, ZNode *node) {
     // remove from the hashtable
     HashKey key;
     key.node.hcode = node->hmap.hcode;
     key.name = node->name;
     key.len = node->len;
-    HashNode *found = del(&zset->hmap, &key.node, &cmp);
+    HashNode *found = del(&index->hmap, &key.node, &cmp);
     assert(found);
     // remove from the tree
-    zset->root = del(&node->tree);
+    del(&index->tree, &node->tree);
     // deallocate the node
     del(node);
 }
 
-// seek is just a tree search
-ZNode *seekge(ZSet *zset, double score, const char *name, size_t len) {
-    AVLNode *found = NULL;
-    for (AVLNode *node = zset->root; node;) {
-        if (zless(node, score, name, len)) {
-            node = node->right;  // node < key
-        } else {
-            found = node;  // candidate
-            node = node->left;
+static void node_load(ZIter *it, ZNode *node) {
+    it->node = node;
+    it->name = node->name;
+    it->len = node->len;
+    it->score = node->score;
+}
+
+// the position in the leaf is found once, then the iteration is O(1)
+static bool node_seek(ZIter *it, BItem *item) {
+    if (!item) { return false; }
+    seek(&it->cursor, item);
+    node_load(it, container_of(item, ZNode, tree));
+    return true;
+}
+
+static void dispose(BItem *item) { del(container_of(item, ZNode, tree)); }
+
+static void index_free(ZSet *zset) {
+    ZIndex *index = zset->index;
+    clear(&index->hmap);
+    clear(&index->tree, &dispose);
+    index->~ZIndex();
+    slab_free(index, sizeof(ZIndex));
+    zset->index = NULL;
+}
+
+// Part 3: Conversions
+static void to_tree(ZSet *zset) {
+    ZIndex *index = new (slab_alloc(sizeof(ZIndex))) ZIndex();
+    ZIter it;
+    for (bool ok = lp_first(zset, &it); ok; ok = lp_next(&it)) {
+        add(index, it.name, it.len, it.score);
+    }
+    lp_clear(zset);
+    zset->index = index;
+}
+
+// only if all the names fit in a listpack
+static void to_listpack(ZSet *zset) {
+    BTree *tree = &zset->index->tree;
+    size_t bytes = 0;
+    for (BItem *item = at(tree, 0); item; item = offset(item, +1)) {
+        ZNode *node = container_of(item, ZNode, tree);
+        if (node->len > g_zset_limits.max_value) { return; }
+        bytes += lp_entry_size(node->len);
+    }
+    lp_reserve(zset, bytes);
+    // already sorted
+    for (BItem *item = at(tree, 0); item; item = offset(item, +1)) {
+        ZNode *node = container_of(item, ZNode, tree);
+        lp_write(zset, zset->lp_bytes, node->name, node->len, node->score);
+    }
+    index_free(zset);
+}
+
+void build(ZSet *zset, ZPair *pairs, size_t n) {
+    assert(size(zset) == 0);
+    // a lambda is inlined by std::sort, a function pointer is not
+    auto cmp = [](const ZPair &lhs, const ZPair &rhs) {
+        return zless(lhs, rhs);
+    };
+    if (!std::is_sorted(pairs, pairs + n, cmp)) {
+        std::sort(pairs, pairs + n, cmp);
+    }
+
+    // a listpack is written in order
+    bool small = n <= g_zset_limits.max_entries;
+    size_t bytes = 0;
+    for (size_t i = 0; small && i < n; ++i) {
+        small = pairs[i].len <= g_zset_limits.max_value;
+        bytes += lp_entry_size(pairs[i].len);
+    }
+    if (small) {
+        lp_reserve(zset, bytes);
+        for (size_t i = 0; i < n; ++i) {
+            lp_write(zset, zset->lp_bytes, pairs[i].name, pairs[i].len,
+                     pairs[i].score);
+        }
+        return;
+    }
+
+    // the tree is built bottom-up, the hashtable doesn't grow on the way
+    assert(!zset->index);  // an empty set is a listpack
+    lp_clear(zset);
+    ZIndex *index = new (slab_alloc(sizeof(ZIndex))) ZIndex();
+    zset->index = index;
+    reserve(&index->hmap, n);
+    std::vector<BItem *> items(n);
+    std::vector<double> scores(n);
+    for (size_t i = 0; i < n; ++i) {
+        ZNode *node = znode_new(pairs[i].name, pairs[i].len, pairs[i].score);
+        insert(&index->hmap, &node->hmap);
+        items[i] = &node->tree;
+        scores[i] = node->score;
+    }
+    build(&index->tree, items.data(), scores.data(), n);
+}
+
+void reserve(ZSet *zset, size_t n) {
+    if (zset->index) { reserve(&zset->index->hmap, n); }
+}
+
+// Part 4: The interfaces of both encodings
+size_t size(ZSet *zset) {
+    return zset->index ? size(&zset->index->hmap) : zset->lp_size;
+}
+
+bool lookup(ZSet *zset, const char *name, size_t len, ZIter *it) {
+    it->zset = zset;
+    if (!zset->index) { return lp_lookup(zset, name, len, it); }
+    ZNode *node = lookup(zset->index, name, len);
+    return node && node_seek(it, &node->tree);
+}
+
+// must handle the case where the pair already exists
+bool insert(ZSet *zset, const char *name, size_t len, double score) {
+    if (!zset->index) {
+        ZIter it;
+        if (lp_lookup(zset, name, len, &it)) {
+            if (it.score != score) {
+                lp_del(&it);
+                lp_insert(zset, name, len, score);
+            }
+            return false;
         }
+        if (len <= g_zset_limits.max_value &&
+            zset->lp_size < g_zset_limits.max_entries) {
+            lp_insert(zset, name, len, score);
+            return true;
+        }
+        to_tree(zset);
+    }
+
+    if (ZNode *node = lookup(zset->index, name, len)) {
+        update(zset->index, node, score);
+        return false;
+    }
+    add(zset->index, name, len, score);
+    return true;
+}
+
+bool del(ZSet *zset, const char *name, size_t len) {
+    ZIter it;
+    if (!lookup(zset, name, len, &it)) { return false; }
+    if (!zset->index) {
+        lp_del(&it);
+        return true;
+    }
+    del(zset->index, it.node);
+    // half the limit so that a set doesn't flip between the encodings
+    if (size(zset) <= g_zset_limits.max_entries / 2) { to_listpack(zset); }
+    return true;
+}
+
+// seek is just a search
+bool seekge(ZSet *zset, double score, const char *name, size_t len,
+            ZIter *it) {
+    it->zset = zset;
+    if (!zset->index) {
+        return lp_lower_bound(zset, score, name, len, it) < zset->lp_bytes;
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    ZKey key = {name, len};
+    return node_seek(it, seekge(&zset->index->tree, score, &key, &zcmp));
 }
 
-// iterate is just offset +-1, which is just walking AVL tree
-ZNode *offset(ZNode *node, int64_t _offset) {
-    AVLNode *tnode = node ? offset(&node->tree, _offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+bool next(ZIter *it) {
+    if (!it->zset->index) { return lp_next(it); }
+    if (!next(&it->cursor)) { return false; }
+    node_load(it, container_of(get(&it->cursor), ZNode, tree));
+    return true;
 }
 
-static void dispose(AVLNode *node) {
-    if (!node) { return; }
+bool prev(ZIter *it) {
+    if (!it->zset->index) { return lp_prev(it); }
+    if (!prev(&it->cursor)) { return false; }
+    node_load(it, container_of(get(&it->cursor), ZNode, tree));
+    return true;
+}
 
-    dispose(node->left);
-    dispose(node->right);
-    del(container_of(node, ZNode, tree));
+// a long offset on the tree is found by rank
+bool offset(ZIter *it, int64_t _offset) {
+    if (_offset == 1) { return next(it); }
+    if (_offset == -1) { return prev(it); }
+    if (it->zset->index) {
+        return node_seek(it, offset(&it->node->tree, _offset));
+    }
+    if (_offset < -(int64_t)it->idx ||
+        _offset >= (int64_t)(it->zset->lp_size - it->idx)) {
+        return false;
+    }
+    for (; _offset > 0; _offset--) { lp_next(it); }
+    for (; _offset < 0; _offset++) { lp_prev(it); }
+    return true;
+}
+
+bool at(ZSet *zset, int64_t rank, ZIter *it) {
+    it->zset = zset;
+    if (zset->index) { return node_seek(it, at(&zset->index->tree, rank)); }
+    return lp_first(zset, it) && offset(it, rank);
+}
+
+int64_t rank(ZIter *it) {
+    return it->zset->index ? rank(&it->node->tree) : (int64_t)it->idx;
 }
 
 //  destroy the zset
 void clear(ZSet *zset) {
-    clear(&zset->hmap);
-    dispose(zset->root);
-    zset->root = NULL;
-}
\ No newline at end of file
+    lp_clear(zset);
+    if (zset->index) { index_free(zset); }
+}
@@ -1,18 +1,47 @@
 #pragma once
 
+// stdlib
+#include <string.h>
+// proj
 #include "../hashtable/hashtable.h"
-#include "../tree/avl.h"
+#include "../tree/btree.h"
 
 // A sorted set is a collection of sorted (score, name) pairs indexed in 2 ways
 
+/*
+ * 2 encodings:
+ *   - listpack: a small set is 1 buffer of sorted (score, name) entries. Point
+ *     queries are a linear scan, range queries a sequential read.
+ *   - tree: a B+tree by (score, name) and a hashtable by name.
+ * A set is converted to the tree encoding when it gets too many members or a
+ * long name, and back when it shrinks to half the max number of members.
+ */
+struct ZSetLimits {
+    size_t max_entries = 128;  // members of a listpack
+    size_t max_value = 64;     // name length in a listpack, at most 255
+};
+
+// set before the server starts
+extern ZSetLimits g_zset_limits;
+
+// the tree encoding
+struct ZIndex {
+    BTree tree;    // index by (score, name)
+    HashMap hmap;  // index by name
+};
+
 struct ZSet {
-    AVLNode *root = NULL;  // index by (score, name)
-    HashMap hmap;          // index by name
+    // the listpack encoding, each entry is | score | len | name | len |
+    uint8_t *lp = NULL;
+    uint32_t lp_bytes = 0;  // used
+    uint32_t lp_cap = 0;    // allocated
+    uint32_t lp_size = 0;   // number of entries
+    ZIndex *index = NULL;   // the tree encoding if not NULL
 };
 
 struct ZNode {
     // data structure nodes
-    AVLNode tree;
+    BItem tree;
     HashNode hmap;
     // data
     double score = 0;
@@ -21,11 +50,53 @@ struct ZNode {
     char name[0];  // flexible array
 };
 
+// a member of either encoding, invalidated by any update of the set
+struct ZIter {
+    ZSet *zset = NULL;
+    // the listpack encoding: the offset of the entry and its rank
+    uint32_t pos = 0;
+    uint32_t idx = 0;
+    // the tree encoding
+    ZNode *node = NULL;
+    BIter cursor;
+    // the member
+    const char *name = NULL;
+    size_t len = 0;
+    double score = 0;
+};
+
+// a member for bulk loads
+struct ZPair {
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// the order of the members, by (score, name)
+inline bool zless(const ZPair &lhs, const ZPair &rhs) {
+    if (lhs.score != rhs.score) { return lhs.score < rhs.score; }
+    int rv = memcmp(lhs.name, rhs.name, lhs.len < rhs.len ? lhs.len : rhs.len);
+    return rv != 0 ? rv < 0 : lhs.len < rhs.len;
+}
+
+size_t size(ZSet *zset);
 // point queries and updates
 bool insert(ZSet *zset, const char *name, size_t len, double score);
-ZNode *lookup(ZSet *zset, const char *name, size_t len);
-void del(ZSet *zset, ZNode *node);
-// range queries command
-ZNode *seekge(ZSet *zset, double score, const char *name, size_t len);
-ZNode *offset(ZNode *node, int64_t _offset);
-void clear(ZSet *zset);
\ No newline at end of file
+bool lookup(ZSet *zset, const char *name, size_t len, ZIter *it);
+bool del(ZSet *zset, const char *name, size_t len);
+// bulk load an empty set in O(n) after sorting, the names are unique. The
+// sort is skipped if the pairs are already in zless() order.
+void build(ZSet *zset, ZPair *pairs, size_t n);
+// room for n members, for many inserts
+void reserve(ZSet *zset, size_t n);
+// range queries, false if there is no such member
+bool seekge(ZSet *zset, double score, const char *name, size_t len,
+            ZIter *it);
+bool offset(ZIter *it, int64_t offset);
+// offset +-1 in O(1), for iterating in either direction
+bool next(ZIter *it);
+bool prev(ZIter *it);
+// 0-based position by (score, name)
+bool at(ZSet *zset, int64_t rank, ZIter *it);
+int64_t rank(ZIter *it);
+void clear(ZSet *zset);
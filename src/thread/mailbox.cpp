@@ -0,0 +1,46 @@
+// stdlib
+#include <errno.h>
+#include <stdint.h>
+// system
+#include <sys/eventfd.h>
+#include <unistd.h>
+// proj
+#include "../common/messages.h"
+#include "mailbox.h"
+
+void init(Mailbox *mb) {
+    mb->head = NULL;
+    mb->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->fd < 0) { die("eventfd()"); }
+}
+
+void push(Mailbox *mb, MailboxNode *node) {
+    MailboxNode *head = __atomic_load_n(&mb->head, __ATOMIC_RELAXED);
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&mb->head, &head, node, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        // was empty, the consumer may be sleeping
+        uint64_t one = 1;
+        ssize_t rv = write(mb->fd, &one, sizeof(one));
+        if (rv < 0 && errno != EAGAIN) { msg_errno("eventfd write() error"); }
+    }
+}
+
+MailboxNode *pop_all(Mailbox *mb) {
+    // clear the wakeup before taking the nodes, so a concurrent push that
+    // finds the stack empty is never missed
+    uint64_t cnt = 0;
+    (void)read(mb->fd, &cnt, sizeof(cnt));
+    MailboxNode *node = __atomic_exchange_n(&mb->head, NULL, __ATOMIC_ACQUIRE);
+    // reverse to FIFO order
+    MailboxNode *fifo = NULL;
+    while (node) {
+        MailboxNode *next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
+    return fifo;
+}
@@ -0,0 +1,27 @@
+#pragma once
+// stdlib
+#include <stddef.h>
+
+// A lock-free multi-producer single-consumer queue between threads.
+// Producers push intrusive nodes onto a lock-free stack with a CAS. The
+// consumer takes the whole stack at once with an atomic exchange, so there is
+// no ABA problem, and reverses it to get the FIFO order.
+//
+// The consumer is an event loop, so it's woken up through an eventfd that is
+// watched like any other fd. Only the push that makes the mailbox non-empty
+// writes to the eventfd.
+
+struct MailboxNode {
+    MailboxNode *next = NULL;
+};
+
+struct Mailbox {
+    MailboxNode *head = NULL;  // accessed atomically
+    int fd = -1;               // eventfd
+};
+
+void init(Mailbox *mb);
+// any thread
+void push(Mailbox *mb, MailboxNode *node);
+// the consumer: clear the eventfd and take all nodes, in FIFO order
+MailboxNode *pop_all(Mailbox *mb);
@@ -1,23 +1,250 @@
 // stdlib
 #include <assert.h>
+#include <time.h>
+// C++
+#include <algorithm>
 // proj
 #include "thread_pool.h"
 
+// a queued work, freed after it's run
+struct Task {
+    // A task is just a function pointer with a void* argument
+    void (*f)(void *) = NULL;
+    void *arg = NULL;
+    Future *fut = NULL;  // optional
+    Task *next = NULL;   // the injection stack
+};
+
+const int64_t k_deque_init_cap = 256;
+
+// the worker of the calling thread, NULL for other threads
+static thread_local Worker *t_worker = NULL;
+
+static uint64_t now_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// only written by the owner, read by anyone
+static void bump(uint64_t &counter, uint64_t n) {
+    uint64_t v = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+    __atomic_store_n(&counter, v + n, __ATOMIC_RELAXED);
+}
+
+// Part 1: The Chase-Lev deque, with the memory orders from "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013).
+static TaskArray *array_new(int64_t cap) {
+    TaskArray *a = new TaskArray();
+    a->cap = cap;
+    a->tasks = new Task *[cap];
+    return a;
+}
+
+static Task *get(TaskArray *a, int64_t i) {
+    return __atomic_load_n(&a->tasks[i & (a->cap - 1)], __ATOMIC_RELAXED);
+}
+
+static void put(TaskArray *a, int64_t i, Task *task) {
+    __atomic_store_n(&a->tasks[i & (a->cap - 1)], task, __ATOMIC_RELAXED);
+}
+
+// the owner: the same tasks in a 2x array
+static TaskArray *grow(Worker *w, TaskArray *a, int64_t top, int64_t bottom) {
+    TaskArray *bigger = array_new(a->cap * 2);
+    for (int64_t i = top; i < bottom; ++i) { put(bigger, i, get(a, i)); }
+    bigger->prev = a;
+    __atomic_store_n(&w->array, bigger, __ATOMIC_RELEASE);
+    return bigger;
+}
+
+// the owner
+static void push(Worker *w, Task *task) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    TaskArray *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+    if (b - t >= a->cap) { a = grow(w, a, t, b); }
+    put(a, b, task);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// the owner, the newest task
+static Task *take(Worker *w) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    TaskArray *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t > b) {  // empty
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Task *task = get(a, b);
+    if (t == b) {
+        // the last one, thieves may be taking it too
+        if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// any thread, the oldest task
+static Task *steal(Worker *w) {
+    while (true) {
+        int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) { return NULL; }
+        // an old array still has the task if the CAS succeeds
+        TaskArray *a = __atomic_load_n(&w->array, __ATOMIC_ACQUIRE);
+        Task *task = get(a, t);
+        if (__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return task;
+        }
+        // lost the race to the owner or another thief, retry
+    }
+}
+
+// Part 2: Sleeping and waking up
+static bool has_work(ThreadPool *tp) {
+    if (__atomic_load_n(&tp->injected, __ATOMIC_SEQ_CST)) { return true; }
+    for (Worker *w : tp->workers) {
+        int64_t t = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+        int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+        if (b > t) { return true; }
+    }
+    return false;
+}
+
+// a producer, after making a task visible
+static void wake(ThreadPool *tp, bool all) {
+    // either the sleeper sees the task or the producer sees the sleeper
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tp->sleeping, __ATOMIC_RELAXED) == 0) { return; }
+    pthread_mutex_lock(&tp->mu);
+    if (all) {
+        pthread_cond_broadcast(&tp->not_empty);
+    } else {
+        pthread_cond_signal(&tp->not_empty);
+    }
+    pthread_mutex_unlock(&tp->mu);
+}
+
+// a worker found nothing. Returns false when shutting down with nothing left
+static bool wait_for_work(ThreadPool *tp, Worker *w) {
+    // the time is taken per sleep rather than per task, it's not free
+    uint64_t start_ns = now_ns();
+    __atomic_store_n(&w->idle_since_ns, start_ns, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&tp->mu);
+    __atomic_add_fetch(&tp->sleeping, 1, __ATOMIC_SEQ_CST);
+    bool work = has_work(tp);
+    // wait for the condition: a task somewhere
+    while (!work && !tp->stop) {
+        pthread_cond_wait(&tp->not_empty, &tp->mu);
+        work = has_work(tp);
+    }
+    __atomic_sub_fetch(&tp->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tp->mu);
+    __atomic_store_n(&w->idle_since_ns, 0, __ATOMIC_RELAXED);
+    bump(w->idle_ns, now_ns() - start_ns);
+    return work;
+}
+
+// Part 3: The workers
+static void inject(ThreadPool *tp, Task *task) {
+    Task *head = __atomic_load_n(&tp->injected, __ATOMIC_RELAXED);
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(&tp->injected, &head, task, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// move all injected tasks into the worker's deque, returns the oldest one
+static Task *take_injected(ThreadPool *tp, Worker *w) {
+    if (!__atomic_load_n(&tp->injected, __ATOMIC_RELAXED)) { return NULL; }
+    Task *task = __atomic_exchange_n(&tp->injected, NULL, __ATOMIC_ACQUIRE);
+    // reverse to FIFO order
+    Task *fifo = NULL;
+    while (task) {
+        Task *next = task->next;
+        task->next = fifo;
+        fifo = task;
+        task = next;
+    }
+    if (!fifo) { return NULL; }
+    bool more = fifo->next != NULL;
+    // a pushed task may be stolen and freed right away
+    for (Task *t = fifo->next, *next = NULL; t; t = next) {
+        next = t->next;
+        push(w, t);
+    }
+    if (more) { wake(tp, true); }  // the others can steal them
+    return fifo;
+}
+
+static uint64_t xorshift(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static Task *find_task(ThreadPool *tp, Worker *w) {
+    if (Task *task = take(w)) { return task; }
+    if (Task *task = take_injected(tp, w)) { return task; }
+    // steal, starting from a random victim
+    size_t n = tp->workers.size();
+    size_t start = (size_t)(xorshift(w->rand) % n);
+    for (size_t i = 0; i < n; ++i) {
+        Worker *victim = tp->workers[(start + i) % n];
+        if (victim == w) { continue; }
+        if (Task *task = steal(victim)) {
+            bump(w->steals, 1);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void complete(Future *fut) {
+    if (__atomic_sub_fetch(&fut->pending, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (fut->then) { fut->then(fut); }
+    // the producer may free the future once it's ready
+    Mailbox *mb = fut->mailbox;
+    MailboxNode *node = fut->node;
+    __atomic_store_n(&fut->ready, 1, __ATOMIC_RELEASE);
+    if (mb) { push(mb, node); }
+}
+
+static void run(ThreadPool *tp, Worker *w, Task *task) {
+    task->f(task->arg);
+    if (task->fut) { complete(task->fut); }
+    delete task;
+    bump(w->tasks, 1);
+    // wake up the producer if it's waiting for all works
+    if (__atomic_sub_fetch(&tp->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&tp->mu);
+        pthread_cond_broadcast(&tp->idle);
+        pthread_mutex_unlock(&tp->mu);
+    }
+}
+
 // worker is the real code of consumer
 static void *worker(void *arg) {
-    ThreadPool *tp = (ThreadPool *)arg;
+    Worker *w = (Worker *)arg;
+    t_worker = w;
+    ThreadPool *tp = w->tp;
     while (true) {
-        pthread_mutex_lock(&tp->mu);
-        // wait for the condition: a non-empty queue
-        while (tp->queue.empty()) {
-            pthread_cond_wait(&tp->not_empty, &tp->mu);
+        if (Task *task = find_task(tp, w)) {
+            run(tp, w, task);
+        } else if (!wait_for_work(tp, w)) {
+            break;  // shutdown()
         }
-        // condition met,consume the queue
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
-        pthread_mutex_unlock(&tp->mu);
-        // do the work
-        w.f(w.arg);
     }
     return NULL;
 }
@@ -26,17 +253,97 @@ static void *worker(void *arg) {
 void init(ThreadPool *tp, size_t num_threads) {
     pthread_mutex_init(&tp->mu, NULL);
     pthread_cond_init(&tp->not_empty, NULL);
-    tp->threads.resize(num_threads);
+    pthread_cond_init(&tp->idle, NULL);
+    tp->start_ns = now_ns();
+    // all workers exist before any of them looks for a victim
+    tp->workers.resize(num_threads);
     for (size_t i = 0; i < num_threads; ++i) {
-        int rv = pthread_create(&tp->threads[i], NULL, &worker, tp);
+        Worker *w = new Worker();
+        w->tp = tp;
+        w->id = i;
+        w->rand = 0x9E3779B97F4A7C15ull * (i + 1);
+        w->array = array_new(k_deque_init_cap);
+        tp->workers[i] = w;
+    }
+    for (Worker *w : tp->workers) {
+        int rv = pthread_create(&w->thread, NULL, &worker, w);
         assert(rv == 0);
+        (void)rv;
     }
 }
 
-// the producer (event loop)
+// the producer: the event loop, or a worker splitting its task
+void queue(ThreadPool *tp, void (*f)(void *), void *arg, Future *fut) {
+    assert(!tp->workers.empty());
+    Task *task = new Task();
+    task->f = f;
+    task->arg = arg;
+    task->fut = fut;
+    __atomic_add_fetch(&tp->pending, 1, __ATOMIC_RELAXED);
+    Worker *w = t_worker;
+    if (w && w->tp == tp) {
+        push(w, task);  // likely run by itself, unless stolen
+    } else {
+        assert(!__atomic_load_n(&tp->stop, __ATOMIC_RELAXED));
+        inject(tp, task);
+    }
+    wake(tp, false);
+}
+
 void queue(ThreadPool *tp, void (*f)(void *), void *arg) {
+    queue(tp, f, arg, NULL);
+}
+
+bool is_ready(Future *fut) {
+    return __atomic_load_n(&fut->ready, __ATOMIC_ACQUIRE);
+}
+
+// the producer: wait until all queued works are done
+void wait_idle(ThreadPool *tp) {
+    pthread_mutex_lock(&tp->mu);
+    while (__atomic_load_n(&tp->pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&tp->idle, &tp->mu);
+    }
+    pthread_mutex_unlock(&tp->mu);
+}
+
+void shutdown(ThreadPool *tp) {
     pthread_mutex_lock(&tp->mu);
-    tp->queue.push_back(Work{f, arg});
-    pthread_cond_signal(&tp->not_empty);
+    __atomic_store_n(&tp->stop, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&tp->not_empty);
     pthread_mutex_unlock(&tp->mu);
-}
\ No newline at end of file
+    // a worker exits when there is nothing left anywhere
+    for (Worker *w : tp->workers) { pthread_join(w->thread, NULL); }
+    assert(tp->pending == 0 && !tp->injected);
+
+    for (Worker *w : tp->workers) {
+        TaskArray *a = w->array;
+        while (a) {
+            TaskArray *prev = a->prev;
+            delete[] a->tasks;
+            delete a;
+            a = prev;
+        }
+        delete w;
+    }
+    tp->workers.clear();
+    pthread_cond_destroy(&tp->idle);
+    pthread_cond_destroy(&tp->not_empty);
+    pthread_mutex_destroy(&tp->mu);
+}
+
+void stats(ThreadPool *tp, std::vector<WorkerStats> &out) {
+    uint64_t elapsed_ns = now_ns() - tp->start_ns;
+    out.resize(tp->workers.size());
+    for (size_t i = 0; i < tp->workers.size(); ++i) {
+        Worker *w = tp->workers[i];
+        WorkerStats &st = out[i];
+        st.tasks = __atomic_load_n(&w->tasks, __ATOMIC_RELAXED);
+        st.steals = __atomic_load_n(&w->steals, __ATOMIC_RELAXED);
+        st.idle_ns = __atomic_load_n(&w->idle_ns, __ATOMIC_RELAXED);
+        uint64_t since = __atomic_load_n(&w->idle_since_ns, __ATOMIC_RELAXED);
+        if (since) { st.idle_ns += now_ns() - since; }  // sleeping now
+        st.idle_ns = std::min(st.idle_ns, elapsed_ns);
+        st.busy_ns = elapsed_ns - st.idle_ns;
+    }
+}
@@ -2,29 +2,98 @@
 // stdlib
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 // C++
-#include <deque>
 #include <vector>
+// proj
+#include "mailbox.h"
 
 // A thread pool has a fixed number of consumer threads, called "workers". An
-// unspecified number of producers can issue tasks to workers via a queue.
-// Consumers sleep when the queue is empty, until they are woken up by a
-// producer.
-
-struct Work {
-    // A task is just a function pointer with a void* argument
-    void (*f)(void *) = NULL;
-    void *arg = NULL;
+// unspecified number of producers can issue tasks to workers.
+//
+// Work stealing: each worker owns a Chase-Lev deque of tasks. The owner pushes
+// and pops at the bottom, the other workers steal from the top with a CAS
+// when they run out. A task queued by a worker goes to its own deque, a task
+// queued by any other thread (e.g. the event loop) goes to a lock-free
+// injection stack. A worker takes the whole stack with 1 exchange and moves it
+// into its deque, where the others can steal from.
+// The mutex is only for sleeping: workers sleep when they find nothing to do,
+// until they are woken up by a producer.
+
+struct Task;
+struct ThreadPool;
+
+// The completion of 1 or more tasks. It's owned by the producer, which sets
+// 'pending' to the number of tasks before queueing them.
+struct Future {
+    uint32_t pending = 0;  // tasks not done, accessed atomically
+    uint32_t ready = 0;    // after 'then', accessed atomically
+    // optional, run by the worker that completes the last task, e.g. to merge
+    // the results of the tasks
+    void (*then)(Future *fut) = NULL;
+    // optional, then 'node' is pushed into 'mailbox' to wake up an event loop.
+    // The future must be kept until the node is received.
+    Mailbox *mailbox = NULL;
+    MailboxNode *node = NULL;
+};
+
+// a circular array of tasks. A full deque moves to a 2x array, the old ones
+// are kept until shutdown() since a thief may still read them
+struct TaskArray {
+    int64_t cap = 0;  // power of 2
+    TaskArray *prev = NULL;
+    Task **tasks = NULL;
+};
+
+// the hot fields of a worker are on their own cache lines
+struct alignas(64) Worker {
+    ThreadPool *tp = NULL;
+    pthread_t thread;
+    size_t id = 0;
+    uint64_t rand = 0;  // for picking victims
+    // Chase-Lev deque, the indexes only grow. Accessed atomically
+    int64_t top = 0;                 // thieves
+    alignas(64) int64_t bottom = 0;  // the owner
+    TaskArray *array = NULL;
+    // utilization, written by the owner and read by anyone. Accessed atomically
+    alignas(64) uint64_t tasks = 0;  // run
+    uint64_t steals = 0;             // of 'tasks', from another worker
+    uint64_t idle_ns = 0;            // sleeping, the rest is busy
+    uint64_t idle_since_ns = 0;      // 0 if not sleeping
 };
 
 struct ThreadPool {
-    std::vector<pthread_t> threads;
-    std::deque<Work> queue;
+    std::vector<Worker *> workers;
+    Task *injected = NULL;  // lock-free stack, accessed atomically
+    uint64_t start_ns = 0;
+    // for sleeping
     pthread_mutex_t mu;
     pthread_cond_t not_empty;
+    uint32_t sleeping = 0;  // accessed atomically
+    bool stop = false;      // by shutdown(), accessed atomically
+    // for waiting on the completion
+    size_t pending = 0;  // queued or running works, accessed atomically
+    pthread_cond_t idle;
 };
 
 // The consumers (workers)
 void init(ThreadPool *tp, size_t num_threads);
-// The producer (event loop)
+// The producer: any thread, including the workers
 void queue(ThreadPool *tp, void (*f)(void *), void *arg);
+// The producer: a task of a future
+void queue(ThreadPool *tp, void (*f)(void *), void *arg, Future *fut);
+// all tasks of the future are done
+bool is_ready(Future *fut);
+// The producer: wait until all queued works are done
+void wait_idle(ThreadPool *tp);
+// finish the queued works and join the workers, the pool can't be used after
+void shutdown(ThreadPool *tp);
+// per worker utilization
+struct WorkerStats {
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+    uint64_t busy_ns = 0;  // running or looking for tasks, since init()
+    uint64_t idle_ns = 0;
+};
+
+void stats(ThreadPool *tp, std::vector<WorkerStats> &out);
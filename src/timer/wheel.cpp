@@ -0,0 +1,105 @@
+// proj
+#include "../common/common.h"
+#include "wheel.h"
+
+const uint64_t k_slot_mask = k_wheel_slots - 1;
+
+void init(TimerWheel *tw, uint64_t now_ms) {
+    tw->now = now_ms;
+    tw->size = 0;
+    init(&tw->due);
+    for (size_t level = 0; level < k_wheel_levels; ++level) {
+        for (size_t i = 0; i < k_wheel_slots; ++i) {
+            init(&tw->slots[level][i]);
+        }
+    }
+}
+
+// The level is the highest byte in which the time differs from the wheel
+// time, the slot is that byte of the time. So the span of the slot is entered
+// (and cascaded) after the wheel time, and before the timer expires.
+static DL_List *slot_of(TimerWheel *tw, uint64_t expire_at) {
+    if (expire_at < tw->now) { return &tw->due; }  // already expired
+    uint64_t diff = expire_at ^ tw->now;
+    size_t level = 0;
+    while (level + 1 < k_wheel_levels &&
+           (diff >> (k_wheel_bits * (level + 1))) != 0) {
+        level++;
+    }
+    uint64_t span = expire_at >> (k_wheel_bits * level);
+    if ((expire_at - tw->now) >> (k_wheel_bits * k_wheel_levels)) {
+        // too far: park it in the last span of this round of the top level
+        span = (tw->now >> (k_wheel_bits * level)) - 1;
+    }
+    return &tw->slots[level][span & k_slot_mask];
+}
+
+void upsert(TimerWheel *tw, TimerNode *t, uint64_t expire_at) {
+    if (is_armed(t)) {
+        detach(&t->node);
+    } else {
+        tw->size++;
+    }
+    t->expire_at = expire_at;
+    insert_before(slot_of(tw, expire_at), &t->node);
+}
+
+void del(TimerWheel *tw, TimerNode *t) {
+    if (!is_armed(t)) { return; }
+    detach(&t->node);
+    t->node.prev = t->node.next = NULL;
+    tw->size--;
+}
+
+// process the tick 'tw->now'
+static void tick(TimerWheel *tw) {
+    uint64_t t = tw->now;
+    // the spans of the higher levels that start at this tick
+    size_t top = 0;
+    while (top + 1 < k_wheel_levels) {
+        uint64_t span_mask = ((uint64_t)1 << (k_wheel_bits * (top + 1))) - 1;
+        if ((t & span_mask) != 0) { break; }
+        top++;
+    }
+    // move their timers down, they are placed by the new wheel time
+    for (size_t level = top; level > 0; --level) {
+        DL_List moved;
+        init(&moved);
+        splice(&tw->slots[level][(t >> (k_wheel_bits * level)) & k_slot_mask],
+               &moved);
+        while (!is_empty(&moved)) {
+            DL_List *node = moved.next;
+            detach(node);
+            TimerNode *timer = container_of(node, TimerNode, node);
+            insert_before(slot_of(tw, timer->expire_at), node);
+        }
+    }
+    // the whole list of this tick is due
+    splice(&tw->slots[0][t & k_slot_mask], &tw->due);
+    tw->now = t + 1;
+}
+
+TimerNode *peek_expired(TimerWheel *tw, uint64_t now_ms) {
+    while (is_empty(&tw->due) && tw->now < now_ms) {
+        if (tw->size == 0) {
+            tw->now = now_ms;  // nothing to do for the skipped ticks
+            break;
+        }
+        tick(tw);
+    }
+    if (is_empty(&tw->due)) { return NULL; }
+    return container_of(tw->due.next, TimerNode, node);
+}
+
+// tick 't' is processed once the time is past it
+uint64_t next_expiry(TimerWheel *tw) {
+    if (!is_empty(&tw->due)) { return tw->now; }
+    if (tw->size == 0) { return (uint64_t)-1; }
+    if ((tw->now & k_slot_mask) == 0) { return tw->now + 1; }  // cascading
+    // the ticks of level 0, until the next cascading
+    uint64_t end = (tw->now | k_slot_mask) + 1;
+    for (uint64_t t = tw->now; t < end; ++t) {
+        if (!is_empty(&tw->slots[0][t & k_slot_mask])) { return t + 1; }
+    }
+    return end + 1;
+}
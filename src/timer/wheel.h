@@ -0,0 +1,45 @@
+#pragma once
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+// proj
+#include "../list/dl_list.h"
+
+// A hierarchical timing wheel for many timers, e.g. key TTLs.
+// Level 0 has a list per millisecond of the next 256ms. Each higher level has
+// a list per 256x longer span: 65s, 4.6h, 49 days. A timer is linked into the
+// level of the highest byte in which its expiry time differs from the wheel
+// time, so adding or removing it is O(1), whatever the number of timers.
+//
+// The wheel advances 1 tick (1ms) at a time. When it enters a new span of a
+// higher level, the timers of that span move down a level ("cascading"); each
+// timer moves at most once per level. Level 0 lists are due as a whole.
+// Timers later than the top level are parked in it and placed again when
+// their span comes around.
+const size_t k_wheel_bits = 8;
+const size_t k_wheel_slots = (size_t)1 << k_wheel_bits;
+const size_t k_wheel_levels = 4;
+
+struct TimerNode {
+    DL_List node;            // unlinked (NULL) if the timer is not armed
+    uint64_t expire_at = 0;  // exact, in ms
+};
+
+struct TimerWheel {
+    uint64_t now = 0;  // the next tick, the earlier ones were processed
+    size_t size = 0;   // armed timers
+    DL_List due;       // expired, in the order of the ticks
+    DL_List slots[k_wheel_levels][k_wheel_slots];
+};
+
+void init(TimerWheel *tw, uint64_t now_ms);
+inline bool is_armed(TimerNode *t) { return t->node.next != NULL; }
+// arm or re-arm a timer
+void upsert(TimerWheel *tw, TimerNode *t, uint64_t expire_at);
+void del(TimerWheel *tw, TimerNode *t);
+// Advance the wheel up to 'now_ms' until there is an expired timer and return
+// it, or NULL. A mass expiry is processed a tick at a time, so the caller can
+// stop at any point.
+TimerNode *peek_expired(TimerWheel *tw, uint64_t now_ms);
+// the time when peek_expired() may find more timers, -1 if there are none
+uint64_t next_expiry(TimerWheel *tw);
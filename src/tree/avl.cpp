@@ -20,7 +20,7 @@ static void update(AVLNode *node) {
 static AVLNode *rote_left(AVLNode *node) {
     AVLNode *parent = node->parent;
     AVLNode *new_node = node->right;
-    AVLNode *inner = node->left;
+    AVLNode *inner = new_node->left;
 
     // node <-> inner
     node->right = inner;
@@ -42,7 +42,7 @@ static AVLNode *rote_left(AVLNode *node) {
 static AVLNode *rote_right(AVLNode *node) {
     AVLNode *parent = node->parent;
     AVLNode *new_node = node->left;
-    AVLNode *inner = node->right;
+    AVLNode *inner = new_node->right;
 
     // node <-> inner
     node->left = inner;
@@ -0,0 +1,503 @@
+// stdlib
+#include <assert.h>
+#include <string.h>
+// C++
+#include <new>
+#include <vector>
+// proj
+#include "../alloc/slab.h"
+#include "btree.h"
+
+// a node is merged into a sibling if it's less than 1/4 full, and only if the
+// result is at most 3/4 full, so the next inserts don't split it right away
+const size_t k_bleaf_min = k_bleaf_cap / 4;
+const size_t k_binner_min = k_binner_cap / 4;
+
+static BLeaf *leaf_new(BTree *tree) {
+    BLeaf *leaf = new (slab_alloc(sizeof(BLeaf))) BLeaf();
+    leaf->hdr.is_leaf = true;
+    tree->nleaves++;
+    return leaf;
+}
+
+static BInner *inner_new(BTree *tree) {
+    tree->ninners++;
+    return new (slab_alloc(sizeof(BInner))) BInner();
+}
+
+static void node_free(BTree *tree, BNode *node) {
+    if (node->is_leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        if (leaf->prev) { leaf->prev->next = leaf->next; }
+        if (leaf->next) { leaf->next->prev = leaf->prev; }
+        slab_free(leaf, sizeof(BLeaf));
+        tree->nleaves--;
+    } else {
+        slab_free(node, sizeof(BInner));
+        tree->ninners--;
+    }
+}
+
+static BLeaf *as_leaf(BNode *node) {
+    assert(node->is_leaf);
+    return (BLeaf *)node;
+}
+
+static BInner *as_inner(BNode *node) {
+    assert(!node->is_leaf);
+    return (BInner *)node;
+}
+
+// (lhs_score, lhs) vs (score, key)
+static int cmp_key(double lhs_score, BItem *lhs, double score, const void *key,
+                   BTreeCmp cmp) {
+    if (lhs_score != score) { return lhs_score < score ? -1 : 1; }
+    return cmp(lhs, key);
+}
+
+// the first position in the leaf >= the key
+static size_t leaf_lower_bound(BLeaf *leaf, double score, const void *key,
+                               BTreeCmp cmp) {
+    size_t lo = 0, hi = leaf->hdr.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cmp_key(leaf->scores[mid], leaf->items[mid], score, key, cmp) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child whose subtree covers the key: the last separator <= the key
+static size_t inner_child_for(BInner *node, double score, const void *key,
+                              BTreeCmp cmp) {
+    size_t lo = 1, hi = node->hdr.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cmp_key(node->scores[mid], node->keys[mid], score, key, cmp) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static size_t child_index(BInner *parent, BNode *child) {
+    for (size_t i = 0; i < parent->hdr.n; ++i) {
+        if (parent->children[i] == child) { return i; }
+    }
+    assert(!"not a child");
+    return 0;
+}
+
+static size_t item_index(BLeaf *leaf, BItem *item) {
+    for (size_t i = 0; i < leaf->hdr.n; ++i) {
+        if (leaf->items[i] == item) { return i; }
+    }
+    assert(!"not in the leaf");
+    return 0;
+}
+
+static uint32_t node_count(BNode *node) {
+    if (node->is_leaf) { return node->n; }
+    BInner *inner = (BInner *)node;
+    uint32_t total = 0;
+    for (size_t i = 0; i < inner->hdr.n; ++i) { total += inner->counts[i]; }
+    return total;
+}
+
+// the smallest key in the subtree
+static void first_key(BNode *node, double &score, BItem *&key) {
+    if (node->is_leaf) {
+        score = ((BLeaf *)node)->scores[0];
+        key = ((BLeaf *)node)->items[0];
+    } else {
+        first_key(((BInner *)node)->children[0], score, key);
+    }
+}
+
+// insert a child at position i
+static void inner_insert(BInner *node, size_t i, BNode *child, uint32_t count) {
+    size_t n = node->hdr.n;
+    assert(n < k_binner_cap);
+    memmove(&node->counts[i + 1], &node->counts[i], (n - i) * sizeof(uint32_t));
+    memmove(&node->scores[i + 1], &node->scores[i], (n - i) * sizeof(double));
+    memmove(&node->keys[i + 1], &node->keys[i], (n - i) * sizeof(BItem *));
+    memmove(&node->children[i + 1], &node->children[i],
+            (n - i) * sizeof(BNode *));
+    node->counts[i] = count;
+    first_key(child, node->scores[i], node->keys[i]);
+    node->children[i] = child;
+    child->parent = node;
+    node->hdr.n++;
+}
+
+// Step 1: Split a full child in 2, the parent has room for the new one
+static void split_child(BTree *tree, BInner *parent, size_t i) {
+    BNode *child = parent->children[i];
+    size_t mid = child->n / 2;
+    size_t moved = child->n - mid;
+    BNode *sibling = NULL;
+    uint32_t count = 0;
+    if (child->is_leaf) {
+        BLeaf *left = (BLeaf *)child;
+        BLeaf *right = leaf_new(tree);
+        memcpy(right->scores, &left->scores[mid], moved * sizeof(double));
+        memcpy(right->items, &left->items[mid], moved * sizeof(BItem *));
+        for (size_t j = 0; j < moved; ++j) { right->items[j]->leaf = right; }
+        right->hdr.n = (uint16_t)moved;
+        left->hdr.n = (uint16_t)mid;
+        // the leaf list
+        right->prev = left;
+        right->next = left->next;
+        if (left->next) { left->next->prev = right; }
+        left->next = right;
+        sibling = &right->hdr;
+        count = (uint32_t)moved;
+    } else {
+        BInner *left = (BInner *)child;
+        BInner *right = inner_new(tree);
+        memcpy(right->counts, &left->counts[mid], moved * sizeof(uint32_t));
+        memcpy(right->scores, &left->scores[mid], moved * sizeof(double));
+        memcpy(right->keys, &left->keys[mid], moved * sizeof(BItem *));
+        memcpy(right->children, &left->children[mid], moved * sizeof(BNode *));
+        for (size_t j = 0; j < moved; ++j) {
+            right->children[j]->parent = right;
+            count += right->counts[j];
+        }
+        right->hdr.n = (uint16_t)moved;
+        left->hdr.n = (uint16_t)mid;
+        sibling = &right->hdr;
+    }
+    parent->counts[i] -= count;
+    inner_insert(parent, i + 1, sibling, count);
+}
+
+static bool is_full(BNode *node) {
+    return node->n == (node->is_leaf ? k_bleaf_cap : k_binner_cap);
+}
+
+// Step 2: Insert. Full nodes are split on the way down, so a split never
+// goes back up.
+void insert(BTree *tree, BItem *item, double score, const void *key,
+            BTreeCmp cmp) {
+    if (!tree->root) { tree->root = &leaf_new(tree)->hdr; }
+    if (is_full(tree->root)) {
+        // the tree grows at the root
+        BInner *root = inner_new(tree);
+        inner_insert(root, 0, tree->root, (uint32_t)tree->size);
+        split_child(tree, root, 0);
+        tree->root = &root->hdr;
+    }
+
+    BNode *node = tree->root;
+    while (!node->is_leaf) {
+        BInner *inner = (BInner *)node;
+        size_t i = inner_child_for(inner, score, key, cmp);
+        if (is_full(inner->children[i])) {
+            split_child(tree, inner, i);
+            if (cmp_key(inner->scores[i + 1], inner->keys[i + 1], score, key,
+                        cmp) <= 0) {
+                i++;
+            }
+        }
+        inner->counts[i]++;
+        node = inner->children[i];
+    }
+
+    BLeaf *leaf = (BLeaf *)node;
+    size_t pos = leaf_lower_bound(leaf, score, key, cmp);
+    size_t n = leaf->hdr.n;
+    memmove(&leaf->scores[pos + 1], &leaf->scores[pos],
+            (n - pos) * sizeof(double));
+    memmove(&leaf->items[pos + 1], &leaf->items[pos],
+            (n - pos) * sizeof(BItem *));
+    leaf->scores[pos] = score;
+    leaf->items[pos] = item;
+    leaf->hdr.n++;
+    item->leaf = leaf;
+    tree->size++;
+}
+
+// Bulk load: the leaves are filled left to right, then each level of inner
+// nodes above them. The nodes are 3/4 full like after random inserts, so the
+// next updates don't split all of them at once. The items are spread evenly,
+// the last node isn't left nearly empty.
+const size_t k_bleaf_fill = k_bleaf_cap * 3 / 4;
+const size_t k_binner_fill = k_binner_cap * 3 / 4;
+
+// the number of nodes for n entries, and the entries of node i
+static size_t fill_nodes(size_t n, size_t fill) {
+    return (n + fill - 1) / fill;
+}
+
+static size_t fill_begin(size_t n, size_t nodes, size_t i) {
+    return n * i / nodes;
+}
+
+void build(BTree *tree, BItem **items, const double *scores, size_t n) {
+    assert(!tree->root);
+    if (n == 0) { return; }
+
+    std::vector<BNode *> level(fill_nodes(n, k_bleaf_fill));
+    BLeaf *prev = NULL;
+    for (size_t i = 0; i < level.size(); ++i) {
+        size_t begin = fill_begin(n, level.size(), i);
+        size_t end = fill_begin(n, level.size(), i + 1);
+        BLeaf *leaf = leaf_new(tree);
+        memcpy(leaf->scores, &scores[begin], (end - begin) * sizeof(double));
+        memcpy(leaf->items, &items[begin], (end - begin) * sizeof(BItem *));
+        for (size_t j = begin; j < end; ++j) { items[j]->leaf = leaf; }
+        leaf->hdr.n = (uint16_t)(end - begin);
+        leaf->prev = prev;
+        if (prev) { prev->next = leaf; }
+        prev = leaf;
+        level[i] = &leaf->hdr;
+    }
+
+    while (level.size() > 1) {
+        std::vector<BNode *> upper(fill_nodes(level.size(), k_binner_fill));
+        for (size_t i = 0; i < upper.size(); ++i) {
+            size_t begin = fill_begin(level.size(), upper.size(), i);
+            size_t end = fill_begin(level.size(), upper.size(), i + 1);
+            BInner *inner = inner_new(tree);
+            for (size_t j = begin; j < end; ++j) {
+                inner_insert(inner, j - begin, level[j], node_count(level[j]));
+            }
+            upper[i] = &inner->hdr;
+        }
+        level.swap(upper);
+    }
+    tree->root = level[0];
+    tree->size = n;
+}
+
+// the smallest key of the node changed, update the separator that refers to it
+static void update_first_key(BNode *node) {
+    double score = 0;
+    BItem *key = NULL;
+    first_key(node, score, key);
+    while (BInner *parent = node->parent) {
+        size_t i = child_index(parent, node);
+        if (i > 0) {
+            parent->scores[i] = score;
+            parent->keys[i] = key;
+            return;
+        }
+        node = &parent->hdr;  // also the smallest key of the parent
+    }
+}
+
+static void rebalance(BTree *tree, BNode *node);
+
+// remove the child at position i and free it
+static void remove_child(BTree *tree, BInner *node, size_t i) {
+    node_free(tree, node->children[i]);
+    size_t n = node->hdr.n;
+    memmove(&node->counts[i], &node->counts[i + 1],
+            (n - i - 1) * sizeof(uint32_t));
+    memmove(&node->scores[i], &node->scores[i + 1],
+            (n - i - 1) * sizeof(double));
+    memmove(&node->keys[i], &node->keys[i + 1], (n - i - 1) * sizeof(BItem *));
+    memmove(&node->children[i], &node->children[i + 1],
+            (n - i - 1) * sizeof(BNode *));
+    node->hdr.n--;
+    if (i == 0 && node->hdr.n > 0) { update_first_key(&node->hdr); }
+    rebalance(tree, &node->hdr);
+}
+
+// move all of 'right' into 'left', they are siblings at i and i+1
+static void merge(BTree *tree, BInner *parent, size_t i) {
+    BNode *lnode = parent->children[i];
+    BNode *rnode = parent->children[i + 1];
+    size_t ln = lnode->n, rn = rnode->n;
+    if (lnode->is_leaf) {
+        BLeaf *left = (BLeaf *)lnode;
+        BLeaf *right = (BLeaf *)rnode;
+        memcpy(&left->scores[ln], right->scores, rn * sizeof(double));
+        memcpy(&left->items[ln], right->items, rn * sizeof(BItem *));
+        for (size_t j = 0; j < rn; ++j) { right->items[j]->leaf = left; }
+    } else {
+        BInner *left = (BInner *)lnode;
+        BInner *right = (BInner *)rnode;
+        memcpy(&left->counts[ln], right->counts, rn * sizeof(uint32_t));
+        memcpy(&left->scores[ln], right->scores, rn * sizeof(double));
+        memcpy(&left->keys[ln], right->keys, rn * sizeof(BItem *));
+        memcpy(&left->children[ln], right->children, rn * sizeof(BNode *));
+        // the first separator of 'right' was in the parent
+        left->scores[ln] = parent->scores[i + 1];
+        left->keys[ln] = parent->keys[i + 1];
+        for (size_t j = 0; j < rn; ++j) { right->children[j]->parent = left; }
+    }
+    lnode->n = (uint16_t)(ln + rn);
+    rnode->n = 0;
+    parent->counts[i] += parent->counts[i + 1];
+    parent->counts[i + 1] = 0;
+    remove_child(tree, parent, i + 1);
+}
+
+// Step 3: Fix a node after a removal: free it if empty, merge it if too small
+static void rebalance(BTree *tree, BNode *node) {
+    BInner *parent = node->parent;
+    if (!parent) {
+        // the root: the tree shrinks at the root
+        if (node->n == 0) {
+            node_free(tree, node);
+            tree->root = NULL;
+        } else if (!node->is_leaf && node->n == 1) {
+            tree->root = ((BInner *)node)->children[0];
+            tree->root->parent = NULL;
+            node_free(tree, node);
+        }
+        return;
+    }
+    size_t i = child_index(parent, node);
+    if (node->n == 0) { return remove_child(tree, parent, i); }
+
+    size_t cap = node->is_leaf ? k_bleaf_cap : k_binner_cap;
+    size_t min = node->is_leaf ? k_bleaf_min : k_binner_min;
+    if (node->n >= min) { return; }
+    if (i + 1 < parent->hdr.n &&
+        node->n + parent->children[i + 1]->n <= cap * 3 / 4) {
+        merge(tree, parent, i);
+    } else if (i > 0 && node->n + parent->children[i - 1]->n <= cap * 3 / 4) {
+        merge(tree, parent, i - 1);
+    }
+}
+
+void del(BTree *tree, BItem *item) {
+    BLeaf *leaf = item->leaf;
+    size_t pos = item_index(leaf, item);
+    size_t n = leaf->hdr.n;
+    memmove(&leaf->scores[pos], &leaf->scores[pos + 1],
+            (n - pos - 1) * sizeof(double));
+    memmove(&leaf->items[pos], &leaf->items[pos + 1],
+            (n - pos - 1) * sizeof(BItem *));
+    leaf->hdr.n--;
+    item->leaf = NULL;
+    tree->size--;
+    // the subtree counts
+    for (BNode *node = &leaf->hdr; node->parent; node = &node->parent->hdr) {
+        node->parent->counts[child_index(node->parent, node)]--;
+    }
+    // the removed item may be a separator
+    if (pos == 0 && leaf->hdr.n > 0) { update_first_key(&leaf->hdr); }
+    rebalance(tree, &leaf->hdr);
+}
+
+BItem *seekge(BTree *tree, double score, const void *key, BTreeCmp cmp) {
+    if (!tree->root) { return NULL; }
+    BNode *node = tree->root;
+    while (!node->is_leaf) {
+        BInner *inner = (BInner *)node;
+        node = inner->children[inner_child_for(inner, score, key, cmp)];
+    }
+    BLeaf *leaf = (BLeaf *)node;
+    size_t pos = leaf_lower_bound(leaf, score, key, cmp);
+    if (pos < leaf->hdr.n) { return leaf->items[pos]; }
+    // all items in the leaf are smaller
+    return leaf->next ? leaf->next->items[0] : NULL;
+}
+
+// Step 4: Order statistics with the subtree counts
+int64_t rank(BItem *item) {
+    int64_t r = (int64_t)item_index(item->leaf, item);
+    for (BNode *node = &item->leaf->hdr; node->parent;
+         node = &node->parent->hdr) {
+        BInner *parent = node->parent;
+        size_t i = child_index(parent, node);
+        for (size_t j = 0; j < i; ++j) { r += parent->counts[j]; }
+    }
+    return r;
+}
+
+static BItem *node_at(BNode *node, int64_t r) {
+    if (r < 0 || r >= (int64_t)node_count(node)) { return NULL; }
+    while (!node->is_leaf) {
+        BInner *inner = (BInner *)node;
+        size_t i = 0;
+        while (r >= (int64_t)inner->counts[i]) { r -= inner->counts[i++]; }
+        node = inner->children[i];
+    }
+    return as_leaf(node)->items[r];
+}
+
+BItem *at(BTree *tree, int64_t r) {
+    return tree->root ? node_at(tree->root, r) : NULL;
+}
+
+// a short offset is likely in the same leaf or the next one
+BItem *offset(BItem *item, int64_t offset) {
+    BLeaf *leaf = item->leaf;
+    int64_t pos = (int64_t)item_index(leaf, item) + offset;
+    int64_t n = leaf->hdr.n;
+    if (pos >= 0 && pos < n) { return leaf->items[pos]; }
+    if (pos >= n && leaf->next && pos - n < leaf->next->hdr.n) {
+        return leaf->next->items[pos - n];
+    }
+    if (pos < 0 && leaf->prev && pos + leaf->prev->hdr.n >= 0) {
+        return leaf->prev->items[pos + leaf->prev->hdr.n];
+    }
+    // by the rank from the root
+    BNode *root = &leaf->hdr;
+    while (root->parent) { root = &root->parent->hdr; }
+    return node_at(root, rank(item) + offset);
+}
+
+void seek(BIter *it, BItem *item) {
+    it->leaf = item->leaf;
+    it->idx = item_index(item->leaf, item);
+}
+
+BItem *get(BIter *it) { return it->leaf->items[it->idx]; }
+
+bool next(BIter *it) {
+    if (it->idx + 1 < it->leaf->hdr.n) {
+        it->idx++;
+    } else if (it->leaf->next) {
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool prev(BIter *it) {
+    if (it->idx > 0) {
+        it->idx--;
+    } else if (it->leaf->prev) {
+        it->leaf = it->leaf->prev;
+        it->idx = it->leaf->hdr.n - 1;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+size_t mem_usage(BTree *tree) {
+    return tree->nleaves * slab_usable_size(sizeof(BLeaf)) +
+           tree->ninners * slab_usable_size(sizeof(BInner));
+}
+
+static void dispose(BTree *tree, BNode *node, void (*f)(BItem *)) {
+    if (node->is_leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        for (size_t i = 0; i < leaf->hdr.n; ++i) { f(leaf->items[i]); }
+    } else {
+        BInner *inner = as_inner(node);
+        for (size_t i = 0; i < inner->hdr.n; ++i) {
+            dispose(tree, inner->children[i], f);
+        }
+    }
+    node_free(tree, node);
+}
+
+void clear(BTree *tree, void (*f)(BItem *)) {
+    if (tree->root) { dispose(tree, tree->root, f); }
+    tree->root = NULL;
+    tree->size = 0;
+}
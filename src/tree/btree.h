@@ -0,0 +1,99 @@
+#pragma once
+
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * B+tree with subtree counts (an order-statistic tree)
+ * +----------+------------+--------+--------+-----------+
+ * |   Tree   | Worst case | Branch | Random | Difficuly |
+ * +----------+------------+--------+--------+-----------+
+ * |  B+tree  |   O(log N) | 16, 30 |   No   |    Hard   |
+ * +----------+------------+--------+--------+-----------+
+ *
+ * Unlike the AVL tree, a node holds many keys: a lookup does a few cache misses
+ * per level instead of 1 per key compared, and there are a few levels. The
+ * items are only in the leaves, in (score, item) arrays: the scores are
+ * compared without touching the items. The leaves are linked for range scans.
+ *
+ * An inner node keeps the number of items under each child, so the rank of an
+ * item and the item at a rank are found in O(log N).
+ *
+ * The items are intrusive: an item knows its leaf, so it can be deleted or
+ * ranked without a search. The key of an item is (score, item): equal scores
+ * are ordered by a compare function.
+ */
+const size_t k_bleaf_cap = 30;   // items in a leaf, 512 bytes
+const size_t k_binner_cap = 16;  // children of an inner node
+
+struct BInner;
+struct BLeaf;
+
+// the common header of leaves and inner nodes
+struct BNode {
+    BInner *parent = NULL;
+    uint16_t n = 0;  // items or children
+    bool is_leaf = false;
+};
+
+struct BLeaf {
+    BNode hdr;
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+    double scores[k_bleaf_cap];
+    struct BItem *items[k_bleaf_cap];
+};
+
+struct BInner {
+    BNode hdr;
+    uint32_t counts[k_binner_cap];  // items in each subtree
+    // the separators: the smallest key of each subtree, [0] is not used
+    double scores[k_binner_cap];
+    struct BItem *keys[k_binner_cap];
+    BNode *children[k_binner_cap];
+};
+
+// embedded in the item
+struct BItem {
+    BLeaf *leaf = NULL;
+};
+
+struct BTree {
+    BNode *root = NULL;
+    size_t size = 0;
+    size_t nleaves = 0;
+    size_t ninners = 0;
+};
+
+// a position for iterating in order, invalidated by updates
+struct BIter {
+    BLeaf *leaf = NULL;
+    size_t idx = 0;  // in the leaf
+};
+
+// compares the item with a key of the same score: < 0, 0 or > 0
+typedef int (*BTreeCmp)(BItem *item, const void *key);
+
+// the key (score, key) of an item must be unique
+void insert(BTree *tree, BItem *item, double score, const void *key,
+            BTreeCmp cmp);
+void del(BTree *tree, BItem *item);
+// bulk load an empty tree in O(n), the items are sorted and unique
+void build(BTree *tree, BItem **items, const double *scores, size_t n);
+// the first item >= (score, key)
+BItem *seekge(BTree *tree, double score, const void *key, BTreeCmp cmp);
+// the item at a rank offset from an item, NULL if out of range
+BItem *offset(BItem *item, int64_t offset);
+// 0-based
+int64_t rank(BItem *item);
+BItem *at(BTree *tree, int64_t rank);
+// the position of an item, then the next or the previous one in O(1)
+void seek(BIter *it, BItem *item);
+BItem *get(BIter *it);
+bool next(BIter *it);  // false at the ends, the position is unchanged
+bool prev(BIter *it);
+// bytes of the tree nodes
+size_t mem_usage(BTree *tree);
+// free the nodes, invoke the callback on each item
+void clear(BTree *tree, void (*f)(BItem *));
@@ -1,39 +1,44 @@
 // proj
 #include "heap.h"
 
-// calculate the index of a child node given the index of the parent node
-static size_t left(size_t i) { return i * 2 + 1; }
-static size_t right(size_t i) { return 1 * 2 + 2; }
+// calculate the index of the first child given the index of the parent node
+template <size_t D>
+static size_t first_child(size_t i) { return i * D + 1; }
 // calculate the index of the parent given the indexes of its children
-static size_t parent(size_t i) { return (i + 1) / 2 - 1; }
+template <size_t D>
+static size_t parent(size_t i) { return (i - 1) / D; }
 
 // update heap value to be the minimum
+template <size_t D>
 static void up(HeapItem *a, size_t pos) {
     HeapItem t = a[pos];
-    while (pos > 0 && a[parent(pos)].val > t.val) {
+    while (pos > 0 && a[parent<D>(pos)].val > t.val) {
         // swap with the parent
-        a[pos] = a[parent(pos)];
+        a[pos] = a[parent<D>(pos)];
         *a[pos].ref = pos;
-        pos = parent(pos);
+        pos = parent<D>(pos);
     }
     a[pos] = t;
     *a[pos].ref = pos;
 }
 
 //  update the heap value to be the greater
+template <size_t D>
 static void down(HeapItem *a, size_t pos, size_t len) {
     HeapItem t = a[pos];
     while (true) {
         // find the smallest one among the parent and their kids
-        size_t l = left(pos);
-        size_t r = right(pos);
+        size_t first = first_child<D>(pos);
+        if (first >= len) { break; }
+        size_t end = first + D < len ? first + D : len;
         size_t min_pos = pos;
         uint64_t min_val = t.val;
-        if (l < len && a[l].val < min_val) {
-            min_pos = l;
-            min_val = a[l].val;
+        for (size_t i = first; i < end; ++i) {
+            if (a[i].val < min_val) {
+                min_pos = i;
+                min_val = a[i].val;
+            }
         }
-        if (r < len && a[r].val < min_val) { min_pos = r; }
         if (min_pos == pos) { break; }
         // swap with the kid
         a[pos] = a[min_pos];
@@ -44,10 +49,16 @@ static void down(HeapItem *a, size_t pos, size_t len) {
     *a[pos].ref = pos;
 }
 
+template <size_t D>
 void update(HeapItem *a, size_t pos, size_t len) {
-    if (pos > 0 && a[parent(pos)].val > a[pos].val) {
-        up(a, pos);
+    if (pos > 0 && a[parent<D>(pos)].val > a[pos].val) {
+        up<D>(a, pos);
     } else {
-        down(a, pos, len);
+        down<D>(a, pos, len);
     }
-}
\ No newline at end of file
+}
+
+// the arities in use
+template void update<2>(HeapItem *a, size_t pos, size_t len);
+template void update<4>(HeapItem *a, size_t pos, size_t len);
+template void update<8>(HeapItem *a, size_t pos, size_t len);
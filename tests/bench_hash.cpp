@@ -0,0 +1,72 @@
+// stdlib
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+// C++
+#include <algorithm>
+#include <vector>
+// proj
+#include "../src/common/common.h"
+
+// the previous hash function, for comparison
+static uint64_t hash_fnv(const uint8_t *data, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) { h = (h + data[i]) * 0x01000193; }
+    return h;
+}
+
+static uint64_t now_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// ns per call, over keys of the same length at different offsets
+static double bench(uint64_t (*h)(const uint8_t *, size_t),
+                    const std::vector<uint8_t> &buf, size_t len) {
+    size_t iters = (size_t)200000000 / (len + 16);
+    uint64_t sink = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iters; ++i) {
+        size_t off = i & 1023;
+        sink += h(&buf[off], len);
+    }
+    uint64_t elapsed = now_ns() - start;
+    // keep the result alive
+    if (sink == 42) { printf("\n"); }
+    return (double)elapsed / iters;
+}
+
+// full hash code collisions among random keys. A 32-bit hash code can't tell
+// all keys apart when there are many of them
+static size_t collisions(uint64_t (*h)(const uint8_t *, size_t), size_t n) {
+    std::vector<uint64_t> codes(n);
+    char key[32];
+    for (size_t i = 0; i < n; ++i) {
+        unsigned long long r = ((unsigned long long)rand() << 31) ^ rand();
+        int len = snprintf(key, sizeof(key), "key:%llx", r);
+        codes[i] = h((const uint8_t *)key, (size_t)len);
+    }
+    std::sort(codes.begin(), codes.end());
+    size_t count = 0;
+    for (size_t i = 1; i < n; ++i) { count += codes[i] == codes[i - 1]; }
+    return count;
+}
+
+int main() {
+    hash_seed_init();
+    std::vector<uint8_t> buf(1024 + 4096);
+    for (uint8_t &c : buf) { c = (uint8_t)rand(); }
+
+    printf("%8s %12s %12s\n", "len", "fnv ns", "hash ns");
+    for (size_t len : {4, 8, 16, 24, 32, 64, 128, 256, 1024, 4096}) {
+        double fnv = bench(&hash_fnv, buf, len);
+        double fast = bench(&hash, buf, len);
+        printf("%8zu %12.2f %12.2f\n", len, fnv, fast);
+    }
+
+    size_t n = 1 << 22;
+    printf("hash code collisions of %zu keys: fnv %zu, hash %zu\n", n,
+           collisions(&hash_fnv, n), collisions(&hash, n));
+    return 0;
+}
@@ -0,0 +1,117 @@
+// stdlib
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+// C++
+#include <vector>
+// proj
+#include "../src/tree/heap.h"
+
+// The TTL heap operations of the server, by the arity of the heap. Each item
+// refers to a key padded to the size of 'Entry', the index is written back
+// there on every move.
+struct Key {
+    uint64_t pad[6];
+    size_t heap_idx = -1;
+};
+
+static uint64_t now_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t g_rand = 88172645463325252ULL;
+static uint64_t xorshift() {
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 7;
+    g_rand ^= g_rand << 17;
+    return g_rand;
+}
+
+// the same as the server
+template <size_t D>
+static void heap_del(HeapVector &a, size_t pos) {
+    a[pos] = a.back();
+    a.pop_back();
+    if (pos < a.size()) { update<D>(a.data(), pos, a.size()); }
+}
+
+template <size_t D>
+static void heap_upsert(HeapVector &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;
+    } else {
+        pos = a.size();
+        a.push_back(t);
+    }
+    update<D>(a.data(), pos, a.size());
+}
+
+static double per_op(uint64_t start, size_t n) {
+    return (double)(now_ns() - start) / (double)n;
+}
+
+// ns per op: insert n, re-arm n random, delete n/2 random, pop the rest
+template <size_t D>
+static void bench(size_t n) {
+    std::vector<Key> keys(n);
+    HeapVector heap;
+    size_t rounds = 1 + 4000000 / n;  // enough ops for the small heaps
+
+    double insert_ns = 0, rearm_ns = 0, del_ns = 0, pop_ns = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; ++i) {
+            HeapItem item = {xorshift() >> 20, &keys[i].heap_idx};
+            heap_upsert<D>(heap, keys[i].heap_idx, item);
+        }
+        insert_ns += per_op(start, n);
+
+        start = now_ns();
+        for (size_t i = 0; i < n; ++i) {
+            Key &key = keys[xorshift() % n];
+            HeapItem item = {xorshift() >> 20, &key.heap_idx};
+            heap_upsert<D>(heap, key.heap_idx, item);
+        }
+        rearm_ns += per_op(start, n);
+
+        start = now_ns();
+        size_t ndel = 0;
+        for (size_t i = 0; i < n / 2; ++i) {
+            Key &key = keys[xorshift() % n];
+            if (key.heap_idx == (size_t)-1) { continue; }
+            heap_del<D>(heap, key.heap_idx);
+            key.heap_idx = -1;
+            ndel++;
+        }
+        del_ns += per_op(start, ndel);
+
+        start = now_ns();
+        size_t npop = heap.size();
+        while (!heap.empty()) {
+            *heap[0].ref = -1;
+            heap_del<D>(heap, 0);
+        }
+        pop_ns += per_op(start, npop);
+    }
+    printf("d=%zu %9zu items: upsert %6.1f rearm %6.1f delete %6.1f "
+           "pop %6.1f ns/op\n",
+           D, n, insert_ns / rounds, rearm_ns / rounds, del_ns / rounds,
+           pop_ns / rounds);
+}
+
+// usage: bench_heap [number of items ...]
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes = {1000, 100000, 1000000, 10000000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) { sizes.push_back(atoll(argv[i])); }
+    }
+    for (size_t n : sizes) {
+        bench<2>(n);
+        bench<4>(n);
+        bench<8>(n);
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+// stdlib
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+// C++
+#include <vector>
+// proj
+#include "../src/common/common.h"
+#include "../src/timer/wheel.h"
+#include "../src/tree/heap.h"
+
+// The TTL engines as used by the server, for N keys that have a TTL:
+// set the TTLs, re-arm random keys (PEXPIRE), cancel some (PERSIST, DEL), and
+// expire all of them. The keys are padded to the size of 'Entry'.
+const uint64_t k_max_ttl_ms = 3600 * 1000;
+
+struct HeapEntry {
+    uint64_t pad[4];
+    size_t heap_idx = -1;
+};
+
+struct WheelEntry {
+    uint64_t pad[4];
+    TimerNode timer;
+};
+
+static uint64_t now_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t g_rand = 88172645463325252ULL;
+static uint64_t xorshift() {
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 7;
+    g_rand ^= g_rand << 17;
+    return g_rand;
+}
+
+// the same as the server
+static void heap_del(HeapVector &a, size_t pos) {
+    a[pos] = a.back();
+    a.pop_back();
+    if (pos < a.size()) { update(a.data(), pos, a.size()); }
+}
+
+static void heap_upsert(HeapVector &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;
+    } else {
+        pos = a.size();
+        a.push_back(t);
+    }
+    update(a.data(), pos, a.size());
+}
+
+struct Result {
+    double set_ns = 0;
+    double rearm_ns = 0;
+    double cancel_ns = 0;
+    double expire_ns = 0;
+};
+
+static double per_op(uint64_t start, size_t n) {
+    return (double)(now_ns() - start) / (double)n;
+}
+
+static Result bench_heap(size_t n) {
+    Result res;
+    std::vector<HeapEntry> ents(n);
+    HeapVector heap;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        HeapItem item = {xorshift() % k_max_ttl_ms, &ents[i].heap_idx};
+        heap_upsert(heap, ents[i].heap_idx, item);
+    }
+    res.set_ns = per_op(start, n);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        HeapEntry &ent = ents[xorshift() % n];
+        HeapItem item = {xorshift() % k_max_ttl_ms, &ent.heap_idx};
+        heap_upsert(heap, ent.heap_idx, item);
+    }
+    res.rearm_ns = per_op(start, n);
+
+    start = now_ns();
+    size_t ncancel = n / 4;
+    for (size_t i = 0; i < ncancel; ++i) {
+        HeapEntry &ent = ents[xorshift() % n];
+        if (ent.heap_idx == (size_t)-1) { continue; }
+        heap_del(heap, ent.heap_idx);
+        ent.heap_idx = -1;
+    }
+    res.cancel_ns = per_op(start, ncancel);
+
+    // expire all, a millisecond at a time
+    start = now_ns();
+    size_t nexpired = heap.size();
+    for (uint64_t now = 0; now <= k_max_ttl_ms; ++now) {
+        while (!heap.empty() && heap[0].val < now) {
+            *heap[0].ref = -1;
+            heap_del(heap, 0);
+        }
+    }
+    res.expire_ns = per_op(start, nexpired);
+    return res;
+}
+
+static Result bench_wheel(size_t n) {
+    Result res;
+    std::vector<WheelEntry> ents(n);
+    TimerWheel *tw = new TimerWheel();
+    init(tw, 0);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        upsert(tw, &ents[i].timer, xorshift() % k_max_ttl_ms);
+    }
+    res.set_ns = per_op(start, n);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        WheelEntry &ent = ents[xorshift() % n];
+        upsert(tw, &ent.timer, xorshift() % k_max_ttl_ms);
+    }
+    res.rearm_ns = per_op(start, n);
+
+    start = now_ns();
+    size_t ncancel = n / 4;
+    for (size_t i = 0; i < ncancel; ++i) {
+        del(tw, &ents[xorshift() % n].timer);
+    }
+    res.cancel_ns = per_op(start, ncancel);
+
+    start = now_ns();
+    size_t nexpired = tw->size;
+    for (uint64_t now = 0; now <= k_max_ttl_ms; ++now) {
+        while (TimerNode *t = peek_expired(tw, now)) { del(tw, t); }
+    }
+    res.expire_ns = per_op(start, nexpired);
+    delete tw;
+    return res;
+}
+
+static void print(const char *name, size_t n, const Result &r) {
+    printf("%-6s %9zu timers: set %6.1f rearm %6.1f cancel %6.1f "
+           "expire %6.1f ns/op\n",
+           name, n, r.set_ns, r.rearm_ns, r.cancel_ns, r.expire_ns);
+}
+
+// usage: bench_ttl [number of timers ...]
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes = {1000000, 10000000, 50000000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) { sizes.push_back(atoll(argv[i])); }
+    }
+    for (size_t n : sizes) {
+        print("heap", n, bench_heap(n));
+        print("wheel", n, bench_wheel(n));
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+// stdlib
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../src/sorted_set/zset.h"
+
+// Loading a sorted set: n inserts vs 1 bulk build, then a few range queries
+// on the result.
+static uint64_t now_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t g_rand = 88172645463325252ULL;
+static uint64_t xorshift() {
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 7;
+    g_rand ^= g_rand << 17;
+    return g_rand;
+}
+
+// ns per member of a full scan
+static double scan_ns(ZSet *zset) {
+    uint64_t start = now_ns();
+    double sum = 0;
+    ZIter it;
+    for (bool ok = at(zset, 0, &it); ok; ok = next(&it)) { sum += it.score; }
+    double ns = (double)(now_ns() - start) / (double)size(zset);
+    if (sum == 42) { printf("\n"); }  // keep the loop
+    return ns;
+}
+
+static void bench(size_t n) {
+    std::vector<std::string> names(n);
+    std::vector<ZPair> pairs(n);
+    for (size_t i = 0; i < n; ++i) {
+        names[i] = "player:" + std::to_string(i);
+        pairs[i].score = (double)(xorshift() % 1000000000);
+        pairs[i].name = names[i].data();
+        pairs[i].len = names[i].size();
+    }
+
+    // build() sorts the pairs, the inserts get the unsorted copy
+    std::vector<ZPair> sorted = pairs;
+    ZSet bulk;
+    uint64_t start = now_ns();
+    build(&bulk, sorted.data(), n);
+    double build_ms = (double)(now_ns() - start) / 1e6;
+    double build_scan = scan_ns(&bulk);
+
+    ZSet one;
+    start = now_ns();
+    for (ZPair &p : pairs) { insert(&one, p.name, p.len, p.score); }
+    double insert_ms = (double)(now_ns() - start) / 1e6;
+    double insert_scan = scan_ns(&one);
+
+    printf("%9zu members: insert %8.1f ms (scan %4.1f ns), "
+           "build %8.1f ms (scan %4.1f ns)\n",
+           n, insert_ms, insert_scan, build_ms, build_scan);
+    clear(&one);
+    clear(&bulk);
+}
+
+// usage: bench_zset [number of members ...]
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes = {100, 10000, 1000000, 5000000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) { sizes.push_back(atoll(argv[i])); }
+    }
+    for (size_t n : sizes) { bench(n); }
+    return 0;
+}
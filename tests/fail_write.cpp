@@ -0,0 +1,20 @@
+// stdlib
+#include <errno.h>
+// system
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// LD_PRELOAD shim for tests: write() to a socket fails with ECONNRESET, as if
+// the peer reset the connection between reading the request and writing the
+// response. Other fds (eventfds, stderr) are untouched.
+extern "C" ssize_t write(int fd, const void *buf, size_t n) {
+    static ssize_t (*real)(int, const void *, size_t) =
+        (ssize_t(*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    return real(fd, buf, n);
+}
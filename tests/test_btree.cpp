@@ -0,0 +1,266 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+// C++
+#include <set>
+#include <utility>
+#include <vector>
+// proj
+#include "../src/common/common.h"
+#include "../src/tree/btree.h"
+
+// the key is (score, id)
+struct Data {
+    BItem tree;
+    double score = 0;
+    uint32_t id = 0;
+};
+
+typedef std::set<std::pair<double, uint32_t>> RefSet;
+
+static int data_cmp(BItem *item, const void *key) {
+    uint32_t lhs = container_of(item, Data, tree)->id;
+    uint32_t rhs = *(const uint32_t *)key;
+    return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+
+static bool key_less(double ls, BItem *l, double rs, BItem *r) {
+    if (ls != rs) { return ls < rs; }
+    return container_of(l, Data, tree)->id < container_of(r, Data, tree)->id;
+}
+
+struct Container {
+    BTree tree;
+    RefSet ref;
+    std::vector<Data> data;
+};
+
+// the number of items, checks the node invariants along the way
+static uint32_t verify(BTree *tree, BNode *node, BInner *parent, size_t depth,
+                       size_t &leaf_depth, BLeaf *&prev, size_t &nleaves,
+                       size_t &ninners) {
+    assert(node->parent == parent);
+    assert(node->n > 0);
+    if (node->is_leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        nleaves++;
+        // all leaves are on the same level
+        if (leaf_depth == 0) { leaf_depth = depth; }
+        assert(leaf_depth == depth);
+        // the leaf list
+        assert(leaf->prev == prev);
+        if (prev) { assert(prev->next == leaf); }
+        prev = leaf;
+        for (size_t i = 0; i < leaf->hdr.n; ++i) {
+            assert(leaf->items[i]->leaf == leaf);
+            assert(leaf->scores[i] ==
+                   container_of(leaf->items[i], Data, tree)->score);
+            if (i > 0) {
+                assert(key_less(leaf->scores[i - 1], leaf->items[i - 1],
+                                leaf->scores[i], leaf->items[i]));
+            }
+        }
+        return leaf->hdr.n;
+    }
+
+    BInner *inner = (BInner *)node;
+    ninners++;
+    assert(parent != NULL || inner->hdr.n >= 2);
+    uint32_t total = 0;
+    for (size_t i = 0; i < inner->hdr.n; ++i) {
+        BNode *child = inner->children[i];
+        uint32_t count = verify(tree, child, inner, depth + 1, leaf_depth,
+                                prev, nleaves, ninners);
+        assert(count == inner->counts[i]);
+        total += count;
+        // the separator is the smallest key of the subtree
+        BNode *first = child;
+        while (!first->is_leaf) { first = ((BInner *)first)->children[0]; }
+        if (i > 0) {
+            assert(inner->scores[i] == ((BLeaf *)first)->scores[0]);
+            assert(inner->keys[i] == ((BLeaf *)first)->items[0]);
+        }
+    }
+    return total;
+}
+
+static void verify(Container &c) {
+    BTree *tree = &c.tree;
+    assert(tree->size == c.ref.size());
+    if (!tree->root) {
+        assert(c.ref.empty());
+        assert(tree->nleaves == 0 && tree->ninners == 0);
+        return;
+    }
+    size_t leaf_depth = 0, nleaves = 0, ninners = 0;
+    BLeaf *last = NULL;
+    uint32_t total = verify(tree, tree->root, NULL, 1, leaf_depth, last,
+                            nleaves, ninners);
+    assert(total == tree->size);
+    assert(last->next == NULL);
+    assert(nleaves == tree->nleaves && ninners == tree->ninners);
+
+    // the order, the rank and the offset
+    int64_t r = 0;
+    BItem *item = at(tree, 0);
+    for (auto &p : c.ref) {
+        Data *d = &c.data[p.second];
+        assert(item == &d->tree);
+        assert(rank(item) == r);
+        assert(at(tree, r) == item);
+        item = offset(item, +1);
+        r++;
+    }
+    assert(item == NULL);
+    assert(at(tree, -1) == NULL && at(tree, r) == NULL);
+
+    // the cursor, both ways
+    BIter it;
+    seek(&it, at(tree, 0));
+    auto p = c.ref.begin();
+    do {
+        assert(get(&it) == &c.data[(p++)->second].tree);
+    } while (next(&it));
+    assert(p == c.ref.end());
+    do {
+        assert(get(&it) == &c.data[(--p)->second].tree);
+    } while (prev(&it));
+    assert(p == c.ref.begin());
+}
+
+static void add(Container &c, uint32_t id, double score) {
+    Data *d = &c.data[id];
+    d->score = score;
+    insert(&c.tree, &d->tree, score, &d->id, &data_cmp);
+    c.ref.insert(std::make_pair(score, id));
+}
+
+static void remove(Container &c, uint32_t id) {
+    Data *d = &c.data[id];
+    assert(c.ref.erase(std::make_pair(d->score, id)) == 1);
+    del(&c.tree, &d->tree);
+    assert(d->tree.leaf == NULL);
+}
+
+static void init(Container &c, size_t n) {
+    c.data.resize(n);
+    for (size_t i = 0; i < n; ++i) { c.data[i].id = (uint32_t)i; }
+}
+
+// random inserts and deletes, with few distinct scores to tie on the ids
+static void test_random(size_t n, size_t rounds, uint32_t nscores) {
+    Container c;
+    init(c, n);
+    for (size_t r = 0; r < rounds; ++r) {
+        uint32_t id = rand() % n;
+        if (c.data[id].tree.leaf) {
+            remove(c, id);
+        } else {
+            add(c, id, rand() % nscores);
+        }
+        if (r % 97 == 0) { verify(c); }
+    }
+    verify(c);
+    // delete everything, the tree shrinks to nothing
+    for (uint32_t id = 0; id < n; ++id) {
+        if (c.data[id].tree.leaf) { remove(c, id); }
+        if (id % 31 == 0) { verify(c); }
+    }
+    verify(c);
+    assert(c.tree.root == NULL);
+}
+
+// sequential inserts split on the right edge
+static void test_sequential(size_t n) {
+    Container c;
+    init(c, n);
+    for (uint32_t i = 0; i < n; ++i) { add(c, i, i); }
+    verify(c);
+    for (uint32_t i = 0; i < n; i += 2) { remove(c, i); }
+    verify(c);
+    for (uint32_t i = n; i-- > 0;) {
+        if (i % 2) { remove(c, i); }
+    }
+    verify(c);
+}
+
+static void test_seek_offset(size_t n) {
+    Container c;
+    init(c, n);
+    // the scores are 0, 2, 4, ...
+    for (uint32_t i = 0; i < n; ++i) { add(c, i, i * 2.0); }
+    verify(c);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t key = 0;
+        // an exact match
+        BItem *item = seekge(&c.tree, i * 2.0, &key, &data_cmp);
+        assert(item == &c.data[i].tree);
+        // between 2 keys
+        item = seekge(&c.tree, i * 2.0 + 1, &key, &data_cmp);
+        assert(item == (i + 1 < n ? &c.data[i + 1].tree : NULL));
+        // any offset from any item
+        for (int64_t off = -(int64_t)n - 1; off <= (int64_t)n + 1; off += 7) {
+            int64_t j = (int64_t)i + off;
+            BItem *expect = (j >= 0 && j < (int64_t)n) ? &c.data[j].tree : NULL;
+            assert(offset(&c.data[i].tree, off) == expect);
+        }
+    }
+    uint32_t key = 0;
+    assert(seekge(&c.tree, -1, &key, &data_cmp) == &c.data[0].tree);
+}
+
+// bulk load, then random updates on the result
+static void test_build(size_t n) {
+    Container c;
+    init(c, n);
+    std::vector<BItem *> items;
+    std::vector<double> scores;
+    for (uint32_t i = 0; i < n; ++i) {
+        c.data[i].score = i / 3;  // ties on the id
+        items.push_back(&c.data[i].tree);
+        scores.push_back(c.data[i].score);
+        c.ref.insert(std::make_pair(c.data[i].score, i));
+    }
+    build(&c.tree, items.data(), scores.data(), n);
+    verify(c);
+    for (size_t r = 0; r < n * 2; ++r) {
+        uint32_t id = rand() % n;
+        if (c.data[id].tree.leaf) {
+            remove(c, id);
+        } else {
+            add(c, id, rand() % (n + 1));
+        }
+        if (r % 97 == 0) { verify(c); }
+    }
+    verify(c);
+}
+
+static size_t g_cleared = 0;
+static void on_clear(BItem *) { g_cleared++; }
+
+static void test_clear(size_t n) {
+    Container c;
+    init(c, n);
+    for (uint32_t i = 0; i < n; ++i) { add(c, i, rand() % 100); }
+    g_cleared = 0;
+    clear(&c.tree, &on_clear);
+    assert(g_cleared == n);
+    assert(c.tree.root == NULL && c.tree.size == 0);
+    assert(c.tree.nleaves == 0 && c.tree.ninners == 0);
+}
+
+int main() {
+    for (size_t n : {1, 2, 10, 31, 100, 1000}) {
+        test_random(n, n * 20, 4);
+        test_random(n, n * 20, 1000000);
+        test_sequential(n);
+        test_seek_offset(n);
+        test_clear(n);
+        test_build(n);
+    }
+    test_build(0);
+    test_build(100000);
+    test_random(20000, 200000, 16);
+    test_sequential(100000);
+    return 0;
+}
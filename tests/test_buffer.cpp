@@ -0,0 +1,80 @@
+// stdlib
+#include <assert.h>
+#include <string.h>
+// C++
+#include <deque>
+// proj
+#include "../src/buffer/buffer.h"
+
+static void verify(const Buffer &buf, const std::deque<uint8_t> &ref) {
+    assert(buf_size(buf) == ref.size());
+    for (size_t i = 0; i < ref.size(); ++i) {
+        assert(buf_data(buf)[i] == ref[i]);
+    }
+    assert(buf.buffer_begin <= buf.data_begin);
+    assert(buf.data_end <= buf.buffer_end);
+}
+
+static void test_fifo() {
+    Buffer buf;
+    std::deque<uint8_t> ref;
+    uint8_t next = 0;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        // append more than consumed on average
+        size_t n = (size_t)rand() % 300;
+        uint8_t data[300];
+        for (size_t j = 0; j < n; ++j) { data[j] = next++; }
+        buf_append(buf, data, n);
+        ref.insert(ref.end(), data, data + n);
+
+        size_t m = (size_t)rand() % 290;
+        if (m > ref.size()) { m = ref.size(); }
+        buf_consume(buf, m);
+        ref.erase(ref.begin(), ref.begin() + m);
+        verify(buf, ref);
+    }
+}
+
+static void test_consume_is_o1() {
+    Buffer buf;
+    uint8_t data[100] = {};
+    buf_append(buf, data, sizeof(data));
+    uint8_t *begin = buf.buffer_begin;
+    buf_consume(buf, 10);
+    // no data is moved
+    assert(buf.buffer_begin == begin);
+    assert(buf.data_begin == begin + 10);
+    // an empty buffer restarts from the front
+    buf_consume(buf, 90);
+    assert(buf.data_begin == begin && buf.data_end == begin);
+}
+
+static void test_reserve() {
+    Buffer buf;
+    uint8_t *dst = buf_reserve(buf, 5000);
+    assert(buf_space(buf) >= 5000);
+    memset(dst, 'a', 5000);
+    buf_commit(buf, 5000);
+    assert(buf_size(buf) == 5000);
+    buf_consume(buf, 4000);
+    // the consumed space is reused instead of growing
+    uint8_t *begin = buf.buffer_begin;
+    size_t cap = buf.buffer_end - buf.buffer_begin;
+    buf_reserve(buf, cap - 1000);
+    assert(buf.buffer_begin == begin);
+    assert(buf_size(buf) == 1000 && buf_data(buf)[999] == 'a');
+
+    buf_truncate(buf, 10);
+    assert(buf_size(buf) == 10);
+
+    Buffer other;
+    swap(buf, other);
+    assert(buf_empty(buf) && buf_size(other) == 10);
+}
+
+int main() {
+    test_fifo();
+    test_consume_is_o1();
+    test_reserve();
+    return 0;
+}
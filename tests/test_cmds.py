@@ -41,6 +41,138 @@ $ ./client zquery zset 1 "" 0 10
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client ZSCORE zset n2
+(dbl) 2
+$ ./client zscore zset
+(err) 4wrong number of arguments
+$ ./client nosuchcmd
+(err) 1unknown command
+$ ./client scan 0 match z?e[st] count 100
+(arr) len=2
+(int) 0
+(arr) len=1
+(str) zset
+(arr) end
+(arr) end
+$ ./client scan 0 match nosuchkey*
+(arr) len=2
+(int) 0
+(arr) len=0
+(arr) end
+(arr) end
+$ ./client scan x
+(err) 4invalid cursor
+$ ./client zscan zset 0 MATCH n*
+(arr) len=2
+(int) 0
+(arr) len=2
+(str) n2
+(dbl) 2
+(arr) end
+(arr) end
+$ ./client set tmp v
+(nil)
+$ ./client pexpire tmp 0
+(int) 1
+$ ./client get tmp
+(nil)
+$ ./client pttl tmp
+(int) -2
+$ ./client pexpire tmp 100
+(int) 0
+$ ./client zadd rz 1 a
+(int) 1
+$ ./client zadd rz 2 b
+(int) 1
+$ ./client zadd rz 2 c
+(int) 1
+$ ./client zadd rz 3 d
+(int) 1
+$ ./client zrank rz c
+(int) 2
+$ ./client zrevrank rz c
+(int) 1
+$ ./client zrank rz nosuch
+(nil)
+$ ./client zcount rz (1 +inf
+(int) 3
+$ ./client zcount rz 3 1
+(int) 0
+$ ./client zrangebyscore rz 2 3 WITHSCORES LIMIT 1 5
+(arr) len=4
+(str) c
+(dbl) 2
+(str) d
+(dbl) 3
+(arr) end
+$ ./client zrevrangebyscore rz (3 -inf LIMIT 0 2
+(arr) len=2
+(str) c
+(str) b
+(arr) end
+$ ./client zrevrange rz 0 -3
+(arr) len=2
+(str) d
+(str) c
+(arr) end
+$ ./client zrevrange nosuch 0 -1
+(arr) len=0
+(arr) end
+$ ./client zcount rz x 1
+(err) 4min or max is not a float
+$ ./client zadd mz 3 c 1 a 2 b 4 a
+(int) 3
+$ ./client zadd mz NX 9 a 5 e
+(int) 1
+$ ./client zadd mz GT 1 b 7 c
+(int) 0
+$ ./client zadd mz INCR 0.5 b
+(dbl) 2.5
+$ ./client zadd mz XX INCR 1 nosuch
+(nil)
+$ ./client zrangebyscore mz -inf +inf WITHSCORES
+(arr) len=8
+(str) b
+(dbl) 2.5
+(str) a
+(dbl) 4
+(str) e
+(dbl) 5
+(str) c
+(dbl) 7
+(arr) end
+$ ./client zadd mz NX XX 1 a
+(err) 4NX is not compatible with XX, GT or LT
+$ ./client zunionstore uz 2 rz mz WEIGHTS 1 10
+(int) 5
+$ ./client zrangebyscore uz 20 +inf WITHSCORES
+(arr) len=8
+(str) b
+(dbl) 27
+(str) a
+(dbl) 41
+(str) e
+(dbl) 50
+(str) c
+(dbl) 72
+(arr) end
+$ ./client zinterstore uz 2 rz mz AGGREGATE max
+(int) 3
+$ ./client zrangebyscore uz -inf +inf WITHSCORES
+(arr) len=6
+(str) b
+(dbl) 2.5
+(str) a
+(dbl) 4
+(str) c
+(dbl) 7
+(arr) end
+$ ./client zinterstore uz 2 rz nosuch
+(int) 0
+$ ./client zscore uz a
+(nil)
+$ ./client zunionstore uz 1 rz AGGREGATE avg
+(err) 4syntax error
 """
 
 
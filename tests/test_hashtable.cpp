@@ -0,0 +1,228 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+// C++
+#include <map>
+#include <set>
+// proj
+#include "../src/common/common.h"
+#include "../src/hashtable/hashtable.h"
+
+struct Data {
+    HashNode node;
+    uint32_t val = 0;
+};
+
+static bool eq(HashNode *lhs, HashNode *rhs) {
+    return container_of(lhs, Data, node)->val ==
+           container_of(rhs, Data, node)->val;
+}
+
+// a bad hash function on purpose, to test the collisions
+static uint64_t (*g_hash)(uint32_t) = NULL;
+static uint64_t good_hash(uint32_t val) {
+    return hash((const uint8_t *)&val, sizeof(val));
+}
+static uint64_t same_tag(uint32_t val) { return (uint64_t)val << 7; }
+static uint64_t same_group(uint32_t val) { return val & 0x7F; }
+
+static Data *find(HashMap *hmap, uint32_t val) {
+    Data key;
+    key.val = val;
+    key.node.hcode = g_hash(val);
+    HashNode *node = lookup(hmap, &key.node, &eq);
+    return node ? container_of(node, Data, node) : NULL;
+}
+
+static bool cb_count(HashNode *node, void *arg) {
+    (void)node;
+    ++*(size_t *)arg;
+    return true;
+}
+
+static void verify(HashMap *hmap, const std::map<uint32_t, Data *> &ref) {
+    assert(size(hmap) == ref.size());
+    size_t n = 0;
+    foreach (hmap, &cb_count, &n);
+    assert(n == ref.size());
+    for (const auto &kv : ref) { assert(find(hmap, kv.first) == kv.second); }
+}
+
+static void test_random(uint64_t (*h)(uint32_t), uint32_t range) {
+    g_hash = h;
+    HashMap hmap;
+    std::map<uint32_t, Data *> ref;
+    for (uint32_t i = 0; i < 20000; ++i) {
+        uint32_t val = (uint32_t)rand() % range;
+        bool exists = ref.count(val);
+        if (rand() % 3 && !exists) {
+            Data *d = new Data();
+            d->val = val;
+            d->node.hcode = g_hash(val);
+            insert(&hmap, &d->node);
+            ref[val] = d;
+        } else {
+            Data key;
+            key.val = val;
+            key.node.hcode = g_hash(val);
+            HashNode *node = del(&hmap, &key.node, &eq);
+            assert(!!node == exists);
+            if (node) {
+                delete ref[val];
+                ref.erase(val);
+            }
+        }
+        // a miss is not affected by the tombstones
+        assert(find(&hmap, range + i) == NULL);
+        if (i % 1000 == 0) { verify(&hmap, ref); }
+    }
+    verify(&hmap, ref);
+    for (const auto &kv : ref) { delete kv.second; }
+    clear(&hmap);
+}
+
+// the keys are moved a few at a time while they are inserted
+static void test_growth() {
+    g_hash = &good_hash;
+    HashMap hmap;
+    std::map<uint32_t, Data *> ref;
+    for (uint32_t i = 0; i < 100000; ++i) {
+        Data *d = new Data();
+        d->val = i;
+        d->node.hcode = g_hash(i);
+        insert(&hmap, &d->node);
+        ref[i] = d;
+        assert(find(&hmap, i) == d);
+        assert(find(&hmap, i / 2) == ref[i / 2]);
+    }
+    verify(&hmap, ref);
+    for (const auto &kv : ref) { delete kv.second; }
+    clear(&hmap);
+}
+
+static void cb_scan(HashNode *node, void *arg) {
+    ((std::set<uint32_t> *)arg)->insert(container_of(node, Data, node)->val);
+}
+
+// the map grows, shrinks and rehashes during the scan
+static void test_scan() {
+    g_hash = &good_hash;
+    HashMap hmap;
+    std::map<uint32_t, Data *> ref;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        Data *d = new Data();
+        d->val = i;
+        d->node.hcode = g_hash(i);
+        insert(&hmap, &d->node);
+        ref[i] = d;
+    }
+    for (uint32_t round = 0; round < 2; ++round) {
+        std::set<uint32_t> seen;
+        uint64_t cursor = 0;
+        uint32_t next = 1000 * (round + 1);
+        do {
+            cursor = scan(&hmap, cursor, &cb_scan, &seen);
+            // add a lot of keys, or remove the added keys
+            for (uint32_t j = 0; j < 50; ++j) {
+                if (round == 0) {
+                    Data *d = new Data();
+                    d->val = next;
+                    d->node.hcode = g_hash(next);
+                    insert(&hmap, &d->node);
+                    ref[next++] = d;
+                } else if (ref.size() > 1000) {
+                    Data *d = ref.rbegin()->second;
+                    assert(del(&hmap, &d->node, &eq) == &d->node);
+                    ref.erase(d->val);
+                    delete d;
+                }
+            }
+        } while (cursor != 0);
+        // the original keys are there all the time
+        for (uint32_t i = 0; i < 1000; ++i) { assert(seen.count(i)); }
+        verify(&hmap, ref);
+    }
+    for (const auto &kv : ref) { delete kv.second; }
+    clear(&hmap);
+}
+
+// the table shrinks after mass deletes, and doesn't resize back and forth
+// no resizing after reserve(), empty or not
+static void test_reserve() {
+    g_hash = &good_hash;
+    HashMap hmap;
+    std::map<uint32_t, Data *> ref;
+    for (uint32_t n : {0, 1000, 50000}) {
+        reserve(&hmap, n + 50000);
+        while (is_rehashing(&hmap)) { rehash_step(&hmap, 1000); }
+        size_t bytes = mem_usage(&hmap);
+        for (uint32_t i = n; i < n + 50000; ++i) {
+            Data *d = new Data();
+            d->val = i;
+            d->node.hcode = g_hash(i);
+            insert(&hmap, &d->node);
+            ref[i] = d;
+            assert(!is_rehashing(&hmap));
+        }
+        assert(mem_usage(&hmap) == bytes);
+        verify(&hmap, ref);
+        // the inserts go to the start of the next round
+        for (auto it = ref.lower_bound(n + 1000); it != ref.end();) {
+            assert(del(&hmap, &it->second->node, &eq) == &it->second->node);
+            delete it->second;
+            it = ref.erase(it);
+        }
+        while (is_rehashing(&hmap)) { rehash_step(&hmap, 1000); }
+    }
+    for (const auto &kv : ref) { delete kv.second; }
+    clear(&hmap);
+}
+
+static void test_shrink() {
+    g_hash = &good_hash;
+    HashMap hmap;
+    std::map<uint32_t, Data *> ref;
+    for (uint32_t i = 0; i < 100000; ++i) {
+        Data *d = new Data();
+        d->val = i;
+        d->node.hcode = g_hash(i);
+        insert(&hmap, &d->node);
+        ref[i] = d;
+    }
+    size_t peak = mem_usage(&hmap);
+    while (ref.size() > 100) {
+        Data *d = ref.begin()->second;
+        assert(del(&hmap, &d->node, &eq) == &d->node);
+        ref.erase(ref.begin());
+        delete d;
+    }
+    for (uint32_t i = 0; i < 1000; ++i) { find(&hmap, i); }  // finish it
+    verify(&hmap, ref);
+    size_t small = mem_usage(&hmap);
+    assert(small * 100 < peak);
+
+    // insert and delete around the current size
+    for (uint32_t i = 0; i < 10000; ++i) {
+        Data *d = new Data();
+        d->val = 1000000 + i;
+        d->node.hcode = g_hash(d->val);
+        insert(&hmap, &d->node);
+        assert(del(&hmap, &d->node, &eq) == &d->node);
+        delete d;
+        assert(mem_usage(&hmap) == small);
+    }
+    for (const auto &kv : ref) { delete kv.second; }
+    clear(&hmap);
+}
+
+int main() {
+    test_random(&good_hash, 5000);
+    test_random(&good_hash, 50);
+    test_random(&same_tag, 500);
+    test_random(&same_group, 500);
+    test_growth();
+    test_scan();
+    test_shrink();
+    test_reserve();
+    return 0;
+}
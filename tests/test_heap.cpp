@@ -4,14 +4,14 @@
 #include <map>
 #include <vector>
 // proj
-#include "../src/tree/heap.cpp"
+#include "../src/tree/heap.h"
 
 struct Data {
     size_t heap_idx = -1;
 };
 
 struct Container {
-    std::vector<HeapItem> heap;
+    HeapVector heap;
     std::multimap<uint64_t, Data *> map;
 };
 
@@ -19,6 +19,7 @@ static void dispose(Container &c) {
     for (auto p : c.map) { delete p.second; }
 }
 
+template <size_t D>
 static void add(Container &c, uint64_t val) {
     Data *d = new Data();
     c.map.insert(std::make_pair(val, d));
@@ -26,9 +27,10 @@ static void add(Container &c, uint64_t val) {
     item.ref = &d->heap_idx;
     item.val = val;
     c.heap.push_back(item);
-    update(c.heap.data(), c.heap.size() - 1, c.heap.size());
+    update<D>(c.heap.data(), c.heap.size() - 1, c.heap.size());
 }
 
+template <size_t D>
 static void del(Container &c, uint64_t val) {
     auto it = c.map.find(val);
     assert(it != c.map.end());
@@ -38,44 +40,69 @@ static void del(Container &c, uint64_t val) {
     c.heap[d->heap_idx] = c.heap.back();
     c.heap.pop_back();
     if (d->heap_idx < c.heap.size()) {
-        update(c.heap.data(), d->heap_idx, c.heap.size());
+        update<D>(c.heap.data(), d->heap_idx, c.heap.size());
     }
     delete d;
     c.map.erase(it);
 }
 
+template <size_t D>
 static void verify(Container &c) {
     assert(c.heap.size() == c.map.size());
     for (size_t i = 0; i < c.heap.size(); i++) {
-        size_t l = left(i);
-        size_t r = right(i);
-        assert(l >= c.heap.size() || c.heap[l].val >= c.heap[i].val);
-        assert(r >= c.heap.size() || c.heap[r].val >= c.heap[i].val);
+        for (size_t k = i * D + 1; k <= i * D + D && k < c.heap.size(); ++k) {
+            assert(c.heap[k].val >= c.heap[i].val);
+        }
         assert(*c.heap[i].ref == i);
     }
+    // the children of a node start a cache line
+    if (c.heap.size() > 1) {
+        assert((uintptr_t)&c.heap[1] % k_heap_line == 0);
+    }
 }
 
+template <size_t D>
 static void test_case(size_t sz) {
     for (uint32_t j = 0; j < 2 + sz * 2; ++j) {
         Container c;
-        for (uint32_t i = 0; i < sz; ++i) { add(c, 1 + i * 2); }
-        verify(c);
-        add(c, j);
-        verify(c);
+        for (uint32_t i = 0; i < sz; ++i) { add<D>(c, 1 + i * 2); }
+        verify<D>(c);
+        add<D>(c, j);
+        verify<D>(c);
         dispose(c);
     }
 
     for (uint32_t j = 0; j < sz; ++j) {
         Container c;
-        for (uint32_t i = 0; i < sz; ++j) { add(c, i); }
-        verify(c);
-        del(c, j);
-        verify(c);
+        for (uint32_t i = 0; i < sz; ++i) { add<D>(c, i); }
+        verify<D>(c);
+        del<D>(c, j);
+        verify<D>(c);
         dispose(c);
     }
 }
 
+// pop everything in order
+template <size_t D>
+static void test_pop(size_t sz) {
+    Container c;
+    for (uint32_t i = 0; i < sz; ++i) { add<D>(c, (i * 7919) % sz); }
+    for (uint32_t i = 0; i < sz; ++i) {
+        assert(c.heap[0].val == i);
+        del<D>(c, i);
+    }
+    verify<D>(c);
+    dispose(c);
+}
+
 int main() {
-    for (uint32_t i = 0; i < 200; ++i) { test_case(i); }
+    for (uint32_t i = 0; i < 200; ++i) {
+        test_case<2>(i);
+        test_case<4>(i);
+        test_case<8>(i);
+    }
+    test_pop<2>(10000);
+    test_pop<4>(10000);
+    test_pop<8>(10000);
     return 0;
-}
\ No newline at end of file
+}
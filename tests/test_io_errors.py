@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Threaded I/O: a connection that is read and written in the same event loop
+# iteration, and the write fails. The server must close it once and go on.
+# Needs ./server, ./fail_write.so and a free port 1234.
+
+import os
+import socket
+import struct
+import subprocess
+import time
+
+
+def req(*args):
+    args = [a.encode() for a in args]
+    body = struct.pack("<I", len(args))
+    body += b"".join(struct.pack("<I", len(a)) + a for a in args)
+    return struct.pack("<I", len(body)) + body
+
+
+def connect():
+    for _ in range(50):
+        try:
+            return socket.create_connection(("127.0.0.1", 1234))
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    raise Exception("no server")
+
+
+env = dict(os.environ, LD_PRELOAD=os.path.abspath("fail_write.so"))
+server = subprocess.Popen(["./server", "--io-threads", "2"], env=env,
+                          stderr=subprocess.DEVNULL)
+try:
+    # enough connections in 1 batch to use the I/O threads too
+    for _ in range(20):
+        conns = [connect() for _ in range(8)]
+        for c in conns:
+            c.sendall(req("get", "k"))
+        for c in conns:
+            try:
+                assert c.recv(100) == b""  # closed without a response
+            except ConnectionResetError:
+                pass
+            c.close()
+        assert server.poll() is None, "the server died"
+    time.sleep(0.2)
+    assert server.poll() is None, "the server died"
+finally:
+    server.kill()
+    server.wait()
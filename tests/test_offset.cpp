@@ -32,6 +32,7 @@ static void add(Container &c, uint32_t val) {
             *from = &data->node;
             data->node.parent = cur;
             c.root = fix(&data->node);
+            return;
         }
         cur = *from;
     }
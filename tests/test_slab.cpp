@@ -0,0 +1,89 @@
+// stdlib
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+// C++
+#include <vector>
+// proj
+#include "../src/alloc/slab.h"
+
+struct Obj {
+    void *ptr = NULL;
+    size_t size = 0;
+    uint8_t fill = 0;
+};
+
+static size_t live_objs() {
+    SlabStats stats[k_slab_num_classes];
+    slab_stats(stats);
+    size_t live = 0;
+    for (const SlabStats &st : stats) {
+        live += st.live;
+        assert(st.live + st.free == st.slabs * (k_slab_size / st.obj_size));
+    }
+    return live;
+}
+
+static size_t total_slabs() {
+    SlabStats stats[k_slab_num_classes];
+    slab_stats(stats);
+    size_t slabs = 0;
+    for (const SlabStats &st : stats) { slabs += st.slabs; }
+    return slabs;
+}
+
+// the objects never overlap
+static void test_random() {
+    std::vector<Obj> objs;
+    for (uint32_t i = 0; i < 100000; ++i) {
+        if (objs.empty() || rand() % 3) {
+            Obj o;
+            o.size = 1 + (size_t)rand() % 600;  // some are too large
+            o.ptr = slab_alloc(o.size);
+            assert(slab_usable_size(o.size) >= o.size);
+            o.fill = (uint8_t)i;
+            memset(o.ptr, o.fill, o.size);
+            objs.push_back(o);
+        } else {
+            size_t pos = (size_t)rand() % objs.size();
+            Obj o = objs[pos];
+            for (size_t j = 0; j < o.size; ++j) {
+                assert(((uint8_t *)o.ptr)[j] == o.fill);
+            }
+            slab_free(o.ptr, o.size);
+            objs[pos] = objs.back();
+            objs.pop_back();
+        }
+    }
+    for (Obj &o : objs) { slab_free(o.ptr, o.size); }
+    assert(live_objs() == 0);
+}
+
+static void *free_all(void *arg) {
+    std::vector<void *> *ptrs = (std::vector<void *> *)arg;
+    for (void *ptr : *ptrs) { slab_free(ptr, 40); }
+    return NULL;
+}
+
+// allocated by 1 thread, freed by another, the memory is reused
+static void test_cross_thread() {
+    size_t slabs = 0;
+    for (int round = 0; round < 10; ++round) {
+        std::vector<void *> ptrs;
+        for (size_t i = 0; i < 100000; ++i) { ptrs.push_back(slab_alloc(40)); }
+        assert(live_objs() == ptrs.size());
+        pthread_t th;
+        pthread_create(&th, NULL, &free_all, &ptrs);
+        pthread_join(th, NULL);
+        assert(live_objs() == 0);
+        if (round == 0) { slabs = total_slabs(); }
+    }
+    assert(total_slabs() == slabs);  // no growth after the 1st round
+}
+
+int main() {
+    test_random();
+    test_cross_thread();
+    return 0;
+}
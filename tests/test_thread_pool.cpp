@@ -0,0 +1,132 @@
+// stdlib
+#include <assert.h>
+#include <poll.h>
+#include <stdint.h>
+// C++
+#include <vector>
+// proj
+#include "../src/common/common.h"
+#include "../src/thread/thread_pool.h"
+
+static ThreadPool *g_tp = NULL;
+static uint64_t g_count = 0;  // accessed atomically
+
+static void count(void *) {
+    __atomic_add_fetch(&g_count, 1, __ATOMIC_RELAXED);
+}
+
+// a tree of tasks queued by the workers, the deques grow and get stolen from
+static void spawn(void *arg) {
+    uintptr_t depth = (uintptr_t)arg;
+    count(NULL);
+    if (depth == 0) { return; }
+    for (int i = 0; i < 4; ++i) { queue(g_tp, &spawn, (void *)(depth - 1)); }
+}
+
+static void flat(void *arg) {
+    uintptr_t n = (uintptr_t)arg;
+    for (uintptr_t i = 0; i < n; ++i) { queue(g_tp, &count, NULL); }
+}
+
+static uint64_t total_tasks(ThreadPool *tp) {
+    std::vector<WorkerStats> st;
+    stats(tp, st);
+    uint64_t n = 0;
+    for (WorkerStats &s : st) {
+        assert(s.steals <= s.tasks);
+        n += s.tasks;
+    }
+    return n;
+}
+
+static void test_queue(size_t nthreads) {
+    ThreadPool tp;
+    init(&tp, nthreads);
+    g_tp = &tp;
+    g_count = 0;
+    // from this thread, through the injection stack
+    for (int i = 0; i < 10000; ++i) { queue(&tp, &count, NULL); }
+    wait_idle(&tp);
+    assert(g_count == 10000);
+    // from the workers, 1 + 4 + ... + 4^7 tasks
+    queue(&tp, &spawn, (void *)7);
+    wait_idle(&tp);
+    assert(g_count == 10000 + 21845);
+    // 1 deque grows past its initial size
+    queue(&tp, &flat, (void *)5000);
+    wait_idle(&tp);
+    assert(g_count == 10000 + 21845 + 5000);
+    assert(total_tasks(&tp) == 10000 + 21845 + 5001);
+    shutdown(&tp);
+}
+
+struct Join {
+    Future fut;
+    MailboxNode node;
+    uint64_t sum = 0;
+    uint64_t parts[8] = {};
+    uint32_t thens = 0;
+};
+
+static void part(void *arg) {
+    uint64_t *p = (uint64_t *)arg;
+    uint64_t i = *p;
+    *p = 0;
+    for (uint64_t k = 0; k < 1000; ++k) { *p += i * 1000 + k; }
+}
+
+// run by the last task, the parts are visible
+static void then(Future *fut) {
+    Join *j = container_of(fut, Join, fut);
+    for (uint64_t p : j->parts) { j->sum += p; }
+    j->thens++;
+}
+
+static void test_future() {
+    ThreadPool tp;
+    init(&tp, 3);
+    Mailbox mb;
+    init(&mb);
+    for (int round = 0; round < 100; ++round) {
+        Join *j = new Join();
+        j->fut.pending = 8;
+        j->fut.then = &then;
+        j->fut.mailbox = &mb;
+        j->fut.node = &j->node;
+        for (uint64_t i = 0; i < 8; ++i) {
+            j->parts[i] = i;
+            queue(&tp, &part, &j->parts[i], &j->fut);
+        }
+        // the event loop is woken up by the node
+        struct pollfd pfd = {mb.fd, POLLIN, 0};
+        MailboxNode *node = NULL;
+        while (!node) {
+            assert(poll(&pfd, 1, 10000) == 1);
+            node = pop_all(&mb);
+        }
+        assert(node == &j->node && !node->next);
+        assert(is_ready(&j->fut) && j->thens == 1);
+        assert(j->sum == 8000 * 7999 / 2);
+        delete j;
+    }
+    shutdown(&tp);
+}
+
+// the queued works are done before shutdown() returns
+static void test_shutdown() {
+    ThreadPool tp;
+    init(&tp, 2);
+    g_tp = &tp;
+    g_count = 0;
+    for (int i = 0; i < 100; ++i) { queue(&tp, &spawn, (void *)3); }
+    shutdown(&tp);
+    assert(g_count == 100 * 85);
+}
+
+int main() {
+    test_queue(1);
+    test_queue(4);
+    test_future();
+    test_shutdown();
+    return 0;
+}
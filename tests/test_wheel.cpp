@@ -0,0 +1,112 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+// C++
+#include <set>
+#include <utility>
+#include <vector>
+// proj
+#include "../src/common/common.h"
+#include "../src/timer/wheel.h"
+
+struct Data {
+    TimerNode timer;
+};
+
+typedef std::set<std::pair<uint64_t, Data *>> RefSet;
+
+static uint64_t rand64() {
+    return ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 2) ^ rand();
+}
+
+// pop all the expired timers, they must match the reference
+static void expire(TimerWheel *tw, RefSet &ref, uint64_t now) {
+    while (TimerNode *t = peek_expired(tw, now)) {
+        Data *d = container_of(t, Data, timer);
+        assert(t->expire_at < now);
+        assert(ref.erase(std::make_pair(t->expire_at, d)) == 1);
+        del(tw, t);
+        assert(!is_armed(t));
+    }
+    assert(ref.empty() || ref.begin()->first >= now);
+    assert(tw->size == ref.size());
+}
+
+// random timers, from 'start' until 'duration' ticks later
+static void test_random(uint64_t start, uint64_t duration, uint64_t max_ttl) {
+    TimerWheel tw;
+    init(&tw, start);
+    RefSet ref;
+    std::vector<Data> data(1000);
+    uint64_t now = start;
+    while (now < start + duration) {
+        Data *d = &data[rand() % data.size()];
+        bool armed = is_armed(&d->timer);
+        if (armed) {
+            assert(ref.erase(std::make_pair(d->timer.expire_at, d)) == 1);
+        }
+        if (armed && rand() % 4 == 0) {
+            del(&tw, &d->timer);
+        } else {
+            uint64_t expire_at = now + rand64() % max_ttl;
+            upsert(&tw, &d->timer, expire_at);
+            ref.insert(std::make_pair(expire_at, d));
+        }
+        // the wakeup time is no later than the first timer
+        uint64_t next = next_expiry(&tw);
+        assert(ref.empty() || next <= ref.begin()->first + 1);
+        now += rand() % 64;
+        expire(&tw, ref, now);
+    }
+    // the rest
+    for (size_t i = 0; i < data.size(); ++i) { del(&tw, &data[i].timer); }
+    assert(tw.size == 0);
+    assert(next_expiry(&tw) == (uint64_t)-1);
+}
+
+// timers beyond the top level are parked and not lost
+static void test_far() {
+    TimerWheel tw;
+    init(&tw, 1000);
+    std::vector<Data> data(100);
+    for (size_t i = 0; i < data.size(); ++i) {
+        upsert(&tw, &data[i].timer, ((uint64_t)1 << 40) + i);
+    }
+    for (uint64_t now = 1000; now < 2000000; now += 1000) {
+        assert(!peek_expired(&tw, now));
+    }
+    assert(tw.size == data.size());
+    for (size_t i = 0; i < data.size(); ++i) { del(&tw, &data[i].timer); }
+    assert(tw.size == 0);
+}
+
+// a mass expiry is processed a tick at a time
+static void test_bulk() {
+    TimerWheel tw;
+    init(&tw, 0);
+    std::vector<Data> data(10000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        upsert(&tw, &data[i].timer, 100 + i % 10);
+    }
+    uint64_t prev = 0;
+    size_t n = 0;
+    while (TimerNode *t = peek_expired(&tw, 1000)) {
+        assert(t->expire_at >= prev);  // in the order of the ticks
+        prev = t->expire_at;
+        del(&tw, t);
+        n++;
+    }
+    assert(n == data.size());
+}
+
+int main() {
+    // levels 0 and 1
+    test_random(0, 1000000, 100000);
+    // crossing the spans of the higher levels
+    test_random(((uint64_t)1 << 24) - 100000, 300000, (uint64_t)1 << 22);
+    test_random(((uint64_t)1 << 32) - 100000, 300000, (uint64_t)1 << 20);
+    test_random((uint64_t)1 << 40, 100000, (uint64_t)1 << 34);
+    test_far();
+    test_bulk();
+    return 0;
+}
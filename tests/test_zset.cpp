@@ -0,0 +1,134 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+// C++
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+// proj
+#include "../src/sorted_set/zset.h"
+
+typedef std::set<std::pair<double, std::string>> RefSet;
+
+// the members in order, both ways, and by rank
+static void verify(ZSet *zset, RefSet &ref) {
+    assert(size(zset) == ref.size());
+    ZIter it;
+    bool ok = at(zset, 0, &it);
+    int64_t r = 0;
+    for (auto &p : ref) {
+        assert(ok);
+        assert(it.score == p.first);
+        assert(std::string(it.name, it.len) == p.second);
+        assert(rank(&it) == r);
+        // the point query finds the same member
+        ZIter found;
+        assert(lookup(zset, p.second.data(), p.second.size(), &found));
+        assert(found.score == p.first && rank(&found) == r);
+        ok = offset(&it, +1);
+        r++;
+    }
+    assert(!ok);
+    // backwards from the last one
+    if (!ref.empty()) {
+        assert(at(zset, (int64_t)ref.size() - 1, &it));
+        for (auto p = ref.rbegin(); p != ref.rend(); ++p) {
+            assert(std::string(it.name, it.len) == p->second);
+            ok = offset(&it, -1);
+        }
+        assert(!ok);
+    }
+    assert(!at(zset, -1, &it) && !at(zset, (int64_t)ref.size(), &it));
+}
+
+static void test_seek(ZSet *zset, RefSet &ref, double score) {
+    ZIter it;
+    auto p = ref.lower_bound(std::make_pair(score, std::string()));
+    bool ok = seekge(zset, score, "", 0, &it);
+    assert(ok == (p != ref.end()));
+    if (ok) { assert(std::string(it.name, it.len) == p->second); }
+}
+
+// random updates, crossing the limits both ways
+static void test_random(size_t max_entries, size_t max_value, size_t nnames) {
+    g_zset_limits.max_entries = max_entries;
+    g_zset_limits.max_value = max_value;
+    ZSet zset;
+    RefSet ref;
+    std::vector<double> scores(nnames, -1);
+    bool tree = false, listpack = false;
+    for (size_t i = 0; i < nnames * 50; ++i) {
+        size_t id = rand() % nnames;
+        std::string name = "m" + std::to_string(id);
+        if (id % 97 == 0) { name += std::string(max_value, 'x'); }  // long
+        if (rand() % 2) {
+            double score = rand() % 10;
+            bool added = insert(&zset, name.data(), name.size(), score);
+            assert(added == (scores[id] < 0));
+            ref.erase(std::make_pair(scores[id], name));
+            ref.insert(std::make_pair(score, name));
+            scores[id] = score;
+        } else {
+            bool removed = del(&zset, name.data(), name.size());
+            assert(removed == (scores[id] >= 0));
+            ref.erase(std::make_pair(scores[id], name));
+            scores[id] = -1;
+        }
+        // never a large listpack
+        if (!zset.index) { assert(size(&zset) <= max_entries); }
+        tree = tree || zset.index;
+        listpack = listpack || !zset.index;
+        if (i % 13 == 0) {
+            verify(&zset, ref);
+            test_seek(&zset, ref, rand() % 12 - 1);
+        }
+    }
+    verify(&zset, ref);
+    assert(tree && (listpack || max_entries == 0));
+    clear(&zset);
+    assert(size(&zset) == 0 && !zset.lp && !zset.index);
+}
+
+// bulk load into either encoding, then keep updating it
+static void test_build(size_t max_entries, size_t n) {
+    g_zset_limits.max_entries = max_entries;
+    g_zset_limits.max_value = 64;
+    std::vector<std::string> names(n);
+    std::vector<ZPair> pairs(n);
+    RefSet ref;
+    for (size_t i = 0; i < n; ++i) {
+        names[i] = "m" + std::to_string(i);
+        pairs[i].score = rand() % 10;
+        pairs[i].name = names[i].data();
+        pairs[i].len = names[i].size();
+        ref.insert(std::make_pair(pairs[i].score, names[i]));
+    }
+    ZSet zset;
+    build(&zset, pairs.data(), n);
+    assert(!zset.index == (n <= max_entries));
+    verify(&zset, ref);
+    for (size_t i = 0; i < n; ++i) {
+        size_t id = rand() % n;
+        ZIter it;
+        assert(lookup(&zset, names[id].data(), names[id].size(), &it));
+        ref.erase(std::make_pair(it.score, names[id]));
+        double score = rand() % 10;
+        assert(!insert(&zset, names[id].data(), names[id].size(), score));
+        ref.insert(std::make_pair(score, names[id]));
+    }
+    verify(&zset, ref);
+    clear(&zset);
+}
+
+int main() {
+    test_random(4, 3, 10);
+    test_random(16, 8, 40);
+    test_random(128, 64, 300);
+    test_random(0, 64, 50);  // always a tree once added to
+    test_build(128, 0);
+    test_build(128, 100);
+    test_build(128, 129);
+    test_build(16, 5000);
+    return 0;
+}